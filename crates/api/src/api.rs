@@ -664,6 +664,29 @@ impl Forge for Api {
         .await?)
     }
 
+    async fn discover_dhcp_batch(
+        &self,
+        request: Request<rpc::DhcpDiscoveryBatch>,
+    ) -> Result<Response<rpc::DhcpDiscoveryBatchResult>, Status> {
+        log_request_data(&request);
+
+        Ok(crate::dhcp::discover::discover_dhcp_batch(
+            self,
+            request,
+            Some(self.runtime_config.rack_management_enabled),
+        )
+        .await?)
+    }
+
+    async fn find_dhcp_records(
+        &self,
+        request: Request<rpc::DhcpDiscoveryBatch>,
+    ) -> Result<Response<rpc::DhcpDiscoveryBatchResult>, Status> {
+        log_request_data(&request);
+
+        Ok(crate::dhcp::discover::find_dhcp_records(self, request).await?)
+    }
+
     async fn find_machine_ids(
         &self,
         request: Request<rpc::MachineSearchConfig>,
@@ -168,6 +168,8 @@ impl InternalRBACRules {
         x.perm("CleanupMachineCompleted", vec![Machineatron, Scout]);
         x.perm("ReportForgeScoutError", vec![Scout]);
         x.perm("DiscoverDhcp", vec![Dhcp, Machineatron]);
+        x.perm("DiscoverDhcpBatch", vec![Dhcp, Machineatron]);
+        x.perm("FindDhcpRecords", vec![Dhcp]);
         x.perm("FindInterfaces", vec![ForgeAdminCLI, Agent]);
         x.perm("DeleteInterface", vec![ForgeAdminCLI]);
         x.perm("FindIpAddress", vec![ForgeAdminCLI]);
@@ -23,9 +23,11 @@ use carbide_uuid::machine::MachineId;
 use carbide_uuid::rack::RackId;
 use db::dhcp_entry::DhcpEntry;
 use db::{self, expected_machine, machine_interface};
+use futures::{StreamExt, stream};
 use mac_address::MacAddress;
 use model::dpa_interface::DpaInterface;
 use model::expected_machine::ExpectedHostNic;
+use model::machine::MachineInterfaceSnapshot;
 use sqlx::PgConnection;
 use tonic::{Request, Response};
 
@@ -35,6 +37,10 @@ use crate::api::Api;
 // MTU for both the underlay and overlay networks on
 // the E/W Fabric
 const SPX_MTU: i32 = 9000;
+/// Most discoveries accepted in one DiscoverDhcpBatch request
+const MAX_DISCOVER_DHCP_BATCH_SIZE: usize = 256;
+/// Discoveries of one DiscoverDhcpBatch which are run at the same time
+const DISCOVER_DHCP_BATCH_CONCURRENCY: usize = 16;
 
 /// Given a desired IP address, compute the relay address by toggling the LSB.
 fn get_relay_from_desired(desired: Ipv4Addr) -> Ipv4Addr {
@@ -162,6 +168,146 @@ async fn handle_dhcp_from_dpa(
     handle_underlay_from_dpa(txn, &mut dpa_if, macaddr, relay_address).await
 }
 
+/// Run each discovery in the batch as if it had come in through DiscoverDhcp.
+///
+/// Each discovery gets its own transaction, so one failing doesn't affect the others. Its
+/// error is returned in its slot of the result instead. Up to
+/// `DISCOVER_DHCP_BATCH_CONCURRENCY` of them run at once, the results stay in order.
+pub async fn discover_dhcp_batch(
+    api: &Api,
+    request: Request<rpc::DhcpDiscoveryBatch>,
+    rack_level_service: Option<bool>,
+) -> Result<Response<rpc::DhcpDiscoveryBatchResult>, CarbideError> {
+    let discoveries = batch_discoveries(request)?;
+    let results = stream::iter(discoveries)
+        .map(|discovery| async move {
+            batch_result(discover_dhcp(api, Request::new(discovery), rack_level_service).await)
+        })
+        .buffered(DISCOVER_DHCP_BATCH_CONCURRENCY)
+        .collect::<Vec<_>>()
+        .await;
+
+    Ok(Response::new(rpc::DhcpDiscoveryBatchResult { results }))
+}
+
+/// What DiscoverDhcpBatch would return for the discoveries whose machine interface exists
+/// already, without writing anything.
+///
+/// Unlike DiscoverDhcp this never creates or moves an interface, allocates an address or
+/// records the DHCP request. A discovery which would need any of that, or whose interface is
+/// on another segment than its relay's, gets NotFound in its slot. The DHCP hook uses this to
+/// refill its cache at startup without acting on behalf of machines which haven't asked.
+pub async fn find_dhcp_records(
+    api: &Api,
+    request: Request<rpc::DhcpDiscoveryBatch>,
+) -> Result<Response<rpc::DhcpDiscoveryBatchResult>, CarbideError> {
+    let discoveries = batch_discoveries(request)?;
+    let results = stream::iter(discoveries)
+        .map(|discovery| async move { batch_result(find_dhcp_record(api, discovery).await) })
+        .buffered(DISCOVER_DHCP_BATCH_CONCURRENCY)
+        .collect::<Vec<_>>()
+        .await;
+
+    Ok(Response::new(rpc::DhcpDiscoveryBatchResult { results }))
+}
+
+fn batch_discoveries(
+    request: Request<rpc::DhcpDiscoveryBatch>,
+) -> Result<Vec<rpc::DhcpDiscovery>, CarbideError> {
+    let discoveries = request.into_inner().discoveries;
+    if discoveries.len() > MAX_DISCOVER_DHCP_BATCH_SIZE {
+        return Err(CarbideError::InvalidArgument(format!(
+            "at most {MAX_DISCOVER_DHCP_BATCH_SIZE} discoveries per batch, got {}",
+            discoveries.len()
+        )));
+    }
+    Ok(discoveries)
+}
+
+fn batch_result(
+    result: Result<Response<rpc::DhcpRecord>, CarbideError>,
+) -> rpc::DhcpDiscoveryResult {
+    let result = match result {
+        Ok(record) => rpc::dhcp_discovery_result::Result::Record(record.into_inner()),
+        Err(err) => {
+            let status: tonic::Status = err.into();
+            rpc::dhcp_discovery_result::Result::Error(rpc::DhcpDiscoveryError {
+                code: status.code().into(),
+                message: status.message().to_string(),
+            })
+        }
+    };
+    rpc::DhcpDiscoveryResult {
+        result: Some(result),
+    }
+}
+
+async fn find_dhcp_record(
+    api: &Api,
+    discovery: rpc::DhcpDiscovery,
+) -> Result<Response<rpc::DhcpRecord>, CarbideError> {
+    let rpc::DhcpDiscovery {
+        mac_address,
+        relay_address,
+        link_address,
+        ..
+    } = discovery;
+
+    let address_to_use_for_dhcp = link_address.as_ref().unwrap_or(&relay_address);
+    let parsed_relay: IpAddr = address_to_use_for_dhcp.parse()?;
+    let address_family = IpAddr::from_str(&relay_address)?.address_family();
+    let parsed_mac: MacAddress = mac_address.parse()?;
+    let not_found = || CarbideError::NotFoundError {
+        kind: "machine_interface",
+        id: mac_address.clone(),
+    };
+
+    let mut txn = api.txn_begin().await?;
+
+    let mut interfaces = machine_interface::find_by_mac_address(&mut txn, parsed_mac).await?;
+    if interfaces.len() != 1 {
+        return Err(not_found());
+    }
+    let interface = interfaces.remove(0);
+    match db::network_segment::for_relay(&mut txn, parsed_relay).await? {
+        Some(segment) if segment.id == interface.segment_id => {}
+        _ => return Err(not_found()),
+    }
+    reject_instance_host(&mut txn, &interface).await?;
+
+    let record: rpc::DhcpRecord = db::dhcp_record::find_by_mac_address(
+        &mut txn,
+        &parsed_mac,
+        &interface.segment_id,
+        address_family,
+    )
+    .await?
+    .into();
+
+    txn.commit().await?;
+    Ok(Response::new(record))
+}
+
+/// A host with an instance on it gets its DHCP from the DPU, not from us
+async fn reject_instance_host(
+    txn: &mut PgConnection,
+    machine_interface: &MachineInterfaceSnapshot,
+) -> Result<(), CarbideError> {
+    if let Some(machine_id) = machine_interface.machine_id {
+        // Can't block host's DHCP handling completely to support Zero-DPU.
+        if machine_id.machine_type().is_host()
+            && let Some(instance_id) =
+                db::instance::find_id_by_machine_id(&mut *txn, &machine_id).await?
+        {
+            // An instance is associated with machine id. DPU must process it.
+            return Err(CarbideError::internal(format!(
+                "DHCP request received for instance: {instance_id}. Ignoring."
+            )));
+        }
+    }
+    Ok(())
+}
+
 pub async fn discover_dhcp(
     api: &Api,
     request: Request<rpc::DhcpDiscovery>,
@@ -268,18 +414,7 @@ pub async fn discover_dhcp(
     )
     .await?;
 
-    if let Some(machine_id) = machine_interface.machine_id {
-        // Can't block host's DHCP handling completely to support Zero-DPU.
-        if machine_id.machine_type().is_host()
-            && let Some(instance_id) =
-                db::instance::find_id_by_machine_id(&mut txn, &machine_id).await?
-        {
-            // An instance is associated with machine id. DPU must process it.
-            return Err(CarbideError::internal(format!(
-                "DHCP request received for instance: {instance_id}. Ignoring."
-            )));
-        }
-    }
+    reject_instance_host(&mut txn, &machine_interface).await?;
 
     // Save vendor string, this is allowed to fail due to dhcp happening more than once on the same machine/vendor string
     if let Some(vendor) = vendor_string {
@@ -143,6 +143,117 @@ async fn test_machine_dhcp_with_api(pool: sqlx::PgPool) -> Result<(), Box<dyn st
     Ok(())
 }
 
+#[crate::sqlx_test]
+async fn test_machine_dhcp_batch_with_api(
+    pool: sqlx::PgPool,
+) -> Result<(), Box<dyn std::error::Error>> {
+    let env = common::api_fixtures::create_test_env(pool.clone()).await;
+
+    let response = env
+        .api
+        .discover_dhcp_batch(tonic::Request::new(rpc::forge::DhcpDiscoveryBatch {
+            discoveries: vec![
+                DhcpDiscovery::builder("FF:FF:FF:FF:FF:FF", FIXTURE_DHCP_RELAY_ADDRESS).rpc(),
+                DhcpDiscovery::builder("not-a-mac", FIXTURE_DHCP_RELAY_ADDRESS).rpc(),
+                DhcpDiscovery::builder("FF:FF:FF:FF:FF:FE", FIXTURE_DHCP_RELAY_ADDRESS).rpc(),
+            ],
+        }))
+        .await
+        .unwrap()
+        .into_inner();
+
+    // One result per discovery, in order. The bad one fails on its own.
+    assert_eq!(response.results.len(), 3);
+    let records = response
+        .results
+        .into_iter()
+        .map(|r| r.result.unwrap())
+        .collect::<Vec<_>>();
+    let rpc::forge::dhcp_discovery_result::Result::Record(first) = &records[0] else {
+        panic!("first discovery failed: {:?}", records[0]);
+    };
+    assert_eq!(first.mac_address, "FF:FF:FF:FF:FF:FF");
+    assert_eq!(first.segment_id.unwrap(), env.admin_segment.unwrap());
+    // With the status code DiscoverDhcp would have returned
+    let rpc::forge::dhcp_discovery_result::Result::Error(second) = &records[1] else {
+        panic!("second discovery succeeded: {:?}", records[1]);
+    };
+    assert_eq!(second.code, i32::from(tonic::Code::Internal));
+    assert!(!second.message.is_empty());
+    let rpc::forge::dhcp_discovery_result::Result::Record(third) = &records[2] else {
+        panic!("third discovery failed: {:?}", records[2]);
+    };
+    assert_eq!(third.mac_address, "FF:FF:FF:FF:FF:FE");
+    assert_ne!(first.address, third.address);
+
+    // Both good discoveries allocated an address
+    let mut txn = pool.begin().await?;
+    assert_eq!(
+        db::machine_interface::count_by_segment_id(&mut txn, &env.admin_segment.unwrap())
+            .await
+            .unwrap(),
+        2
+    );
+    txn.commit().await.unwrap();
+    Ok(())
+}
+
+// Finds the record of an interface which exists, and doesn't create one for a new MAC
+#[crate::sqlx_test]
+async fn test_find_dhcp_records_with_api(
+    pool: sqlx::PgPool,
+) -> Result<(), Box<dyn std::error::Error>> {
+    let env = common::api_fixtures::create_test_env(pool.clone()).await;
+
+    let discovered = env
+        .api
+        .discover_dhcp(
+            DhcpDiscovery::builder("FF:FF:FF:FF:FF:FF", FIXTURE_DHCP_RELAY_ADDRESS).tonic_request(),
+        )
+        .await
+        .unwrap()
+        .into_inner();
+
+    let response = env
+        .api
+        .find_dhcp_records(tonic::Request::new(rpc::forge::DhcpDiscoveryBatch {
+            discoveries: vec![
+                DhcpDiscovery::builder("FF:FF:FF:FF:FF:FF", FIXTURE_DHCP_RELAY_ADDRESS).rpc(),
+                DhcpDiscovery::builder("FF:FF:FF:FF:FF:FE", FIXTURE_DHCP_RELAY_ADDRESS).rpc(),
+            ],
+        }))
+        .await
+        .unwrap()
+        .into_inner();
+
+    assert_eq!(response.results.len(), 2);
+    let records = response
+        .results
+        .into_iter()
+        .map(|r| r.result.unwrap())
+        .collect::<Vec<_>>();
+    let rpc::forge::dhcp_discovery_result::Result::Record(found) = &records[0] else {
+        panic!("known interface not found: {:?}", records[0]);
+    };
+    assert_eq!(found.address, discovered.address);
+    assert_eq!(found.segment_id, discovered.segment_id);
+    let rpc::forge::dhcp_discovery_result::Result::Error(unknown) = &records[1] else {
+        panic!("unknown interface found: {:?}", records[1]);
+    };
+    assert_eq!(unknown.code, i32::from(tonic::Code::NotFound));
+
+    // Only DiscoverDhcp allocated an address
+    let mut txn = pool.begin().await?;
+    assert_eq!(
+        db::machine_interface::count_by_segment_id(&mut txn, &env.admin_segment.unwrap())
+            .await
+            .unwrap(),
+        1
+    );
+    txn.commit().await.unwrap();
+    Ok(())
+}
+
 #[crate::sqlx_test]
 async fn test_multiple_machines_dhcp_with_api(
     pool: sqlx::PgPool,
@@ -0,0 +1,131 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2026 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Cache misses from many Kea packet threads at once, before and after the multi-threaded
+//! runtime.
+//!
+//! `CALLER_THREADS` threads, standing in for Kea's packet threads, each make
+//! `CALLS_PER_THREAD` DiscoverDhcp calls to `MockAPIServer` over one shared connection. The
+//! API takes `API_DELAY` to answer, so the calls overlap like misses in a boot storm do.
+//!
+//! - `shared_current_thread`: every caller `block_on`s the same current-thread runtime, which
+//!   is how misses ran before `CarbideDhcpContext::run_on_runtime`. Only one caller at a time
+//!   drives the connection.
+//! - `run_on_runtime`: the hook's multi-threaded runtime, which the callers hand their call to.
+//!
+//! Criterion reports calls per second for each. Run with `cargo bench --bench api_runtime`,
+//! it doesn't need Kea.
+
+use std::thread;
+use std::time::{Duration, Instant};
+
+use ::rpc::forge as rpc;
+use ::rpc::forge::forge_client::ForgeClient;
+use criterion::{Criterion, Throughput, criterion_group, criterion_main};
+use dhcp::{CarbideDhcpContext, mock_api_server};
+use tokio::runtime::{Builder, Runtime};
+use tonic::transport::Channel;
+
+const CALLER_THREADS: usize = 16;
+const CALLS_PER_THREAD: usize = 8;
+const API_DELAY: Duration = Duration::from_millis(2);
+
+fn discovery(caller: usize, call: usize) -> rpc::DhcpDiscovery {
+    rpc::DhcpDiscovery {
+        mac_address: format!("02:42:ac:14:{caller:02x}:{call:02x}"),
+        relay_address: "172.20.0.1".to_string(),
+        ..Default::default()
+    }
+}
+
+// Every caller thread makes its calls through `call`, returns how long they all took
+fn run_callers(call: impl Fn(rpc::DhcpDiscovery) + Sync) -> Duration {
+    let start = Instant::now();
+    thread::scope(|s| {
+        for caller in 0..CALLER_THREADS {
+            let call = &call;
+            s.spawn(move || {
+                for n in 0..CALLS_PER_THREAD {
+                    call(discovery(caller, n));
+                }
+            });
+        }
+    });
+    start.elapsed()
+}
+
+fn bench_runtime(c: &mut Criterion, url: &str) {
+    let mut group = c.benchmark_group("api_runtime");
+    group.throughput(Throughput::Elements(
+        (CALLER_THREADS * CALLS_PER_THREAD) as u64,
+    ));
+    group.sample_size(10);
+
+    // The connection is made on, and only driven by, the shared runtime
+    let current_thread: Runtime = Builder::new_current_thread().enable_all().build().unwrap();
+    let client: ForgeClient<Channel> = current_thread
+        .block_on(ForgeClient::connect(url.to_string()))
+        .expect("unable to connect to MockAPIServer");
+    group.bench_function("shared_current_thread", |b| {
+        b.iter_custom(|iters| {
+            (0..iters)
+                .map(|_| {
+                    run_callers(|request| {
+                        let mut client = client.clone();
+                        current_thread
+                            .block_on(client.discover_dhcp(request))
+                            .expect("discovery failed");
+                    })
+                })
+                .sum()
+        });
+    });
+
+    let client: ForgeClient<Channel> = CarbideDhcpContext::get_tokio_runtime()
+        .block_on(ForgeClient::connect(url.to_string()))
+        .expect("unable to connect to MockAPIServer");
+    group.bench_function("run_on_runtime", |b| {
+        b.iter_custom(|iters| {
+            (0..iters)
+                .map(|_| {
+                    run_callers(|request| {
+                        let mut client = client.clone();
+                        CarbideDhcpContext::run_on_runtime(async move {
+                            client.discover_dhcp(request).await
+                        })
+                        .expect("discovery panicked")
+                        .expect("discovery failed");
+                    })
+                })
+                .sum()
+        });
+    });
+
+    group.finish();
+}
+
+fn benches(c: &mut Criterion) {
+    // The API server has its own runtime, so neither way of calling it is slowed by serving
+    let server_rt = Builder::new_multi_thread().enable_all().build().unwrap();
+    let mut api_server = server_rt.block_on(mock_api_server::MockAPIServer::start());
+    api_server.set_response_delay(API_DELAY);
+
+    bench_runtime(c, api_server.local_http_addr());
+}
+
+criterion_group!(api_runtime, benches);
+criterion_main!(api_runtime);
@@ -0,0 +1,146 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2026 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Per-lookup cost of the machine cache key.
+//!
+//! `legacy_string_key` is the key the cache used to build with `format!`, looked up in a single
+//! `Mutex<LruCache<String, _>>` the way the cache used to be. `cache_key` builds a `CacheKey` and
+//! looks it up in the real cache.
+
+use std::hint::black_box;
+use std::net::{IpAddr, Ipv4Addr};
+use std::num::NonZeroUsize;
+use std::sync::Mutex;
+
+use criterion::{Criterion, Throughput, criterion_group, criterion_main};
+use dhcp::cache::{self, CacheEntryStatus, CacheKey};
+use lru::LruCache;
+use mac_address::MacAddress;
+
+const NUM_CLIENTS: u8 = 200;
+
+struct Client {
+    mac_address: MacAddress,
+    link_address: IpAddr,
+    circuit_id: Option<String>,
+    remote_id: Option<String>,
+    vendor_id: &'static str,
+}
+
+fn clients() -> Vec<Client> {
+    (0..NUM_CLIENTS)
+        .map(|idx| Client {
+            mac_address: MacAddress::new([2, 66, 172, 20, 1, idx]),
+            link_address: IpAddr::V4(Ipv4Addr::new(172, 20, 1, 1)),
+            circuit_id: Some(format!("Ethernet{idx}")),
+            remote_id: Some("b8:3f:d2:90:97:a6".to_string()),
+            vendor_id: "PXEClient",
+        })
+        .collect()
+}
+
+// What cache::key used to be
+fn legacy_key(client: &Client) -> String {
+    format!(
+        "{}_{}_{}_{}_{}",
+        client.mac_address,
+        client.link_address,
+        match &client.circuit_id {
+            Some(cid) => cid.as_str(),
+            None => "",
+        },
+        match &client.remote_id {
+            Some(rid) => rid.as_str(),
+            None => "",
+        },
+        client.vendor_id,
+    )
+}
+
+fn cache_key(client: &Client) -> Option<CacheKey> {
+    CacheKey::new(
+        client.mac_address,
+        client.link_address,
+        &client.circuit_id,
+        &client.remote_id,
+        client.vendor_id,
+    )
+}
+
+fn bench_cache_lookup(c: &mut Criterion) {
+    let clients = clients();
+    let mut group = c.benchmark_group("cache_lookup");
+    group.throughput(Throughput::Elements(clients.len() as u64));
+
+    let legacy_cache = Mutex::new(LruCache::new(NonZeroUsize::new(1000).unwrap()));
+    for client in &clients {
+        legacy_cache
+            .lock()
+            .unwrap()
+            .put(legacy_key(client), CacheEntryStatus::DiscoveryFailing(1));
+    }
+    group.bench_function("legacy_string_key", |b| {
+        b.iter(|| {
+            for client in &clients {
+                let key = legacy_key(client);
+                black_box(legacy_cache.lock().unwrap().get(&key).cloned());
+            }
+        });
+    });
+
+    for client in &clients {
+        cache::put(
+            cache_key(client).unwrap(),
+            CacheEntryStatus::DiscoveryFailing(1),
+        );
+    }
+    group.bench_function("cache_key", |b| {
+        b.iter(|| {
+            for client in &clients {
+                black_box(cache_key(client).as_ref().and_then(cache::get));
+            }
+        });
+    });
+
+    group.finish();
+}
+
+fn bench_key_build(c: &mut Criterion) {
+    let clients = clients();
+    let mut group = c.benchmark_group("cache_key_build");
+    group.throughput(Throughput::Elements(clients.len() as u64));
+
+    group.bench_function("legacy_string_key", |b| {
+        b.iter(|| {
+            for client in &clients {
+                black_box(legacy_key(client));
+            }
+        });
+    });
+    group.bench_function("cache_key", |b| {
+        b.iter(|| {
+            for client in &clients {
+                black_box(cache_key(client));
+            }
+        });
+    });
+
+    group.finish();
+}
+
+criterion_group!(benches, bench_cache_lookup, bench_key_build);
+criterion_main!(benches);
@@ -0,0 +1,376 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2026 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! End to end DHCP load generator.
+//!
+//! Starts a real Kea with the hook library loaded, talking to `MockAPIServer`, and has many
+//! clients behind one relay (us) run DISCOVER / OFFER / REQUEST / ACK exchanges against it until
+//! the time is up. Clients cycle through the option 82 layouts and vendor classes we see in
+//! the field. Prints exchanges and packets per second, and OFFER and ACK latency percentiles.
+//!
+//! Run with `cargo bench --bench dhcp_load`. Like the Kea tests it needs /usr/sbin/kea-dhcp4.
+//! Set these in the environment to change the load:
+//!
+//! - `DHCP_LOAD_CLIENTS`: simulated clients, each with one exchange in flight. 1 to 250, default 16.
+//!   Above Kea's packet-queue-size (28) packets get dropped, which shows up as timeouts.
+//! - `DHCP_LOAD_SECS`: how long to run, default 10.
+//! - `DHCP_LOAD_KEA_THREADS`: Kea packet processing threads, default 4.
+//! - `DHCP_LOAD_API_DELAY_MS`: how long the API takes to answer a discovery, default 0.
+//! - `DHCP_LOAD_API_FAILURE_PERCENT`: percentage of discoveries the API fails, default 0.
+//! - `DHCP_LOAD_CACHE_TTL_SECS`: `carbide-cache-ttl-secs`. 0 sends every packet to the API.
+//! - `DHCP_LOAD_BATCH_WINDOW_US`: `carbide-discovery-batch-window-us`, default 0 (no batching).
+
+use std::env;
+use std::io::ErrorKind;
+use std::net::UdpSocket;
+use std::str::FromStr;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::mpsc::{Receiver, RecvTimeoutError, Sender, channel};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use dhcp::mock_api_server;
+use dhcproto::v4::relay::{RelayAgentInformation, RelayInfo};
+use dhcproto::{Decodable, Decoder, v4};
+use serde_json::json;
+
+#[path = "../tests/common/mod.rs"]
+mod common;
+
+use common::{DHCPFactory, Kea, RELAY_IP};
+
+const DHCP_IN_PORT: u16 = 7100;
+const DHCP_OUT_PORT: u16 = DHCP_IN_PORT + 1;
+
+// How long a client waits for an answer before giving up on the exchange
+const RESPONSE_TIMEOUT: Duration = Duration::from_millis(500);
+
+// What firmware and OSes put in option 60
+const VENDOR_CLASSES: [&str; 6] = [
+    "HTTPClient:Arch:00016:UNDI:003001",
+    "PXEClient:Arch:00007:UNDI:003000",
+    "PXEClient:Arch:00011:UNDI:003000",
+    "nvidia-bluefield-dpu aarch64",
+    "BF2Client",
+    "iDRAC",
+];
+
+struct LoadConfig {
+    clients: u8,
+    duration: Duration,
+    kea_threads: u16,
+    api_delay: Duration,
+    api_failure_percent: u8,
+    cache_ttl_secs: Option<u32>,
+    batch_window_us: u32,
+}
+
+impl LoadConfig {
+    fn from_env() -> LoadConfig {
+        LoadConfig {
+            clients: env_or("DHCP_LOAD_CLIENTS", 16).clamp(1, 250),
+            duration: Duration::from_secs(env_or("DHCP_LOAD_SECS", 10)),
+            kea_threads: env_or("DHCP_LOAD_KEA_THREADS", 4),
+            api_delay: Duration::from_millis(env_or("DHCP_LOAD_API_DELAY_MS", 0)),
+            api_failure_percent: env_or("DHCP_LOAD_API_FAILURE_PERCENT", 0),
+            cache_ttl_secs: env::var("DHCP_LOAD_CACHE_TTL_SECS")
+                .ok()
+                .and_then(|v| v.parse().ok()),
+            batch_window_us: env_or("DHCP_LOAD_BATCH_WINDOW_US", 0),
+        }
+    }
+
+    fn hook_parameters(&self) -> serde_json::Value {
+        let mut parameters = json!({
+            "carbide-discovery-batch-window-us": self.batch_window_us,
+        });
+        if let Some(ttl) = self.cache_ttl_secs {
+            parameters["carbide-cache-ttl-secs"] = ttl.into();
+        }
+        parameters
+    }
+}
+
+fn env_or<T: FromStr>(name: &str, default: T) -> T {
+    match env::var(name) {
+        Ok(value) => value.parse().unwrap_or_else(|_| {
+            panic!("{name}={value} is not valid");
+        }),
+        Err(_) => default,
+    }
+}
+
+#[derive(Default)]
+struct ClientStats {
+    exchanges: u64,
+    timeouts: u64,
+    naks: u64,
+    offer_latency: Vec<Duration>,
+    ack_latency: Vec<Duration>,
+}
+
+impl ClientStats {
+    fn merge(&mut self, other: ClientStats) {
+        self.exchanges += other.exchanges;
+        self.timeouts += other.timeouts;
+        self.naks += other.naks;
+        self.offer_latency.extend(other.offer_latency);
+        self.ack_latency.extend(other.ack_latency);
+    }
+}
+
+fn main() -> Result<(), eyre::Report> {
+    let config = LoadConfig::from_env();
+
+    let rt = tokio::runtime::Builder::new_multi_thread()
+        .enable_all()
+        .build()
+        .unwrap();
+    let mut api_server = rt.block_on(mock_api_server::MockAPIServer::start());
+    api_server.set_response_delay(config.api_delay);
+    api_server.set_failure_percent(config.api_failure_percent);
+
+    // Start Kea process. Stops on drop.
+    let mut kea = Kea::with_hook_parameters(
+        api_server.local_http_addr(),
+        DHCP_IN_PORT,
+        DHCP_OUT_PORT,
+        config.kea_threads,
+        config.hook_parameters(),
+    )?;
+    kea.run()?;
+
+    // UDP socket to Kea. We're pretending to be dhcp-relay.
+    let socket = UdpSocket::bind(format!("{RELAY_IP}:{DHCP_OUT_PORT}"))?;
+    socket.connect(format!("127.0.0.1:{DHCP_IN_PORT}"))?;
+    socket.set_read_timeout(Some(RESPONSE_TIMEOUT))?;
+
+    let should_stop = AtomicBool::new(false);
+    let mut stats = ClientStats::default();
+    let start = Instant::now();
+    thread::scope(|s| {
+        // Client idx -> where the receive thread sends its answers. idx 0 is unused.
+        let mut responses = vec![None];
+        let mut clients = Vec::with_capacity(config.clients.into());
+        for idx in 1..=config.clients {
+            let (tx, rx) = channel();
+            responses.push(Some(tx));
+            let socket = &socket;
+            let deadline = start + config.duration;
+            clients.push(s.spawn(move || run_client(idx, socket, rx, deadline)));
+        }
+        s.spawn(|| receive(&socket, responses, &should_stop));
+
+        for client in clients {
+            stats.merge(client.join().unwrap());
+        }
+        should_stop.store(true, Ordering::Relaxed);
+    });
+    let elapsed = start.elapsed();
+
+    report(&config, &api_server, &mut stats, elapsed);
+    Ok(())
+}
+
+// One client: DORA in a loop until `deadline`
+fn run_client(
+    idx: u8,
+    socket: &UdpSocket,
+    responses: Receiver<(v4::Message, Instant)>,
+    deadline: Instant,
+) -> ClientStats {
+    let mut stats = ClientStats::default();
+    let discover_orig = discover(idx);
+    let mut seq: u32 = 0;
+    while Instant::now() < deadline {
+        seq = seq.wrapping_add(1);
+        let xid = (seq << 8) | u32::from(idx);
+
+        let mut discover = discover_orig.clone();
+        discover.set_xid(xid);
+        let sent = Instant::now();
+        socket
+            .send(&DHCPFactory::encode(discover.clone()).unwrap())
+            .unwrap();
+        let Some((offer, received)) = wait_for(&responses, xid, v4::MessageType::Offer) else {
+            stats.timeouts += 1;
+            continue;
+        };
+        stats.offer_latency.push(received - sent);
+
+        let request = DHCPFactory::request(&discover, &offer);
+        let sent = Instant::now();
+        socket.send(&DHCPFactory::encode(request).unwrap()).unwrap();
+        let Some((ack, received)) = wait_for(&responses, xid, v4::MessageType::Ack) else {
+            stats.timeouts += 1;
+            continue;
+        };
+        if ack.opts().msg_type() == Some(v4::MessageType::Nak) {
+            stats.naks += 1;
+            continue;
+        }
+        stats.ack_latency.push(received - sent);
+        stats.exchanges += 1;
+    }
+    stats
+}
+
+// Wait for the answer to transaction `xid`, skipping late answers to ones we gave up on.
+// A NAK is returned too when waiting for an ACK.
+fn wait_for(
+    responses: &Receiver<(v4::Message, Instant)>,
+    xid: u32,
+    want: v4::MessageType,
+) -> Option<(v4::Message, Instant)> {
+    let give_up = Instant::now() + RESPONSE_TIMEOUT;
+    loop {
+        let timeout = give_up.saturating_duration_since(Instant::now());
+        match responses.recv_timeout(timeout) {
+            Ok((msg, received)) if msg.xid() == xid => {
+                let msg_type = msg.opts().msg_type();
+                if msg_type == Some(want)
+                    || (want == v4::MessageType::Ack && msg_type == Some(v4::MessageType::Nak))
+                {
+                    return Some((msg, received));
+                }
+            }
+            Ok(_) => {}
+            Err(RecvTimeoutError::Timeout | RecvTimeoutError::Disconnected) => return None,
+        }
+    }
+}
+
+// Single receive thread, hands each answer to the client whose xid it carries
+fn receive(
+    socket: &UdpSocket,
+    responses: Vec<Option<Sender<(v4::Message, Instant)>>>,
+    should_stop: &AtomicBool,
+) {
+    let mut recv_buf = [0u8; 1500]; // packet is 470 bytes, but allow for full MTU
+    while !should_stop.load(Ordering::Relaxed) {
+        let n = match socket.recv(&mut recv_buf) {
+            Ok(n) => n,
+            Err(err) if err.kind() == ErrorKind::WouldBlock => continue,
+            Err(err) => panic!("socket recv unhandled error: {err}"),
+        };
+        let received = Instant::now();
+        let Ok(msg) = v4::Message::decode(&mut Decoder::new(&recv_buf[..n])) else {
+            continue;
+        };
+        let idx = usize::from(msg.xid() as u8);
+        if let Some(Some(client)) = responses.get(idx) {
+            // The client is gone once its time is up
+            let _ = client.send((msg, received));
+        }
+    }
+}
+
+// The DISCOVER client `idx` sends. Clients get a mix of option 82 layouts and vendor classes,
+// and a MAC ending in `idx`, which gives each of them its own address from MockAPIServer.
+fn discover(idx: u8) -> v4::Message {
+    let mac = [0x02, 0x00, 0x00, 0x10, 0x00, idx];
+
+    let mut relay_agent = RelayAgentInformation::default();
+    match idx % 4 {
+        // Switch port, chassis MAC as remote id, link selection
+        0 => {
+            let circuit_id = format!("Ethernet{}", idx % 48);
+            relay_agent.insert(RelayInfo::AgentCircuitId(circuit_id.into_bytes()));
+            relay_agent.insert(RelayInfo::AgentRemoteId(b"b8:3f:d2:90:97:a6".to_vec()));
+            relay_agent.insert(RelayInfo::LinkSelection([172, 16, 42, idx].into()));
+        }
+        // Host interface and link selection
+        1 => {
+            relay_agent.insert(RelayInfo::AgentCircuitId(b"eth0".to_vec()));
+            relay_agent.insert(RelayInfo::LinkSelection([172, 16, 43, idx].into()));
+        }
+        // Cumulus style port and remote id, no link selection so giaddr is the link
+        2 => {
+            let circuit_id = format!("swp{}s0", idx % 32);
+            relay_agent.insert(RelayInfo::AgentCircuitId(circuit_id.into_bytes()));
+            relay_agent.insert(RelayInfo::AgentRemoteId(b"leaf-07".to_vec()));
+        }
+        // Only a VLAN circuit id
+        _ => {
+            let circuit_id = format!("vlan{}", 100 + u16::from(idx % 8));
+            relay_agent.insert(RelayInfo::AgentCircuitId(circuit_id.into_bytes()));
+        }
+    }
+
+    let vendor_class = VENDOR_CLASSES[usize::from(idx) % VENDOR_CLASSES.len()];
+    DHCPFactory::relayed_discover(mac, vendor_class.as_bytes(), relay_agent)
+}
+
+fn report(
+    config: &LoadConfig,
+    api_server: &mock_api_server::MockAPIServer,
+    stats: &mut ClientStats,
+    elapsed: Duration,
+) {
+    let secs = elapsed.as_secs_f64();
+    let responses = stats.offer_latency.len() + stats.ack_latency.len() + stats.naks as usize;
+    println!(
+        "dhcp_load: {} clients, {} Kea threads, API delay {:?}, API failures {}%, cache TTL {}, batch window {}us, {elapsed:.2?}",
+        config.clients,
+        config.kea_threads,
+        config.api_delay,
+        config.api_failure_percent,
+        config
+            .cache_ttl_secs
+            .map_or("default".to_string(), |ttl| format!("{ttl}s")),
+        config.batch_window_us,
+    );
+    println!(
+        "  exchanges: {} ({:.0}/s), timeouts {}, NAKs {}",
+        stats.exchanges,
+        stats.exchanges as f64 / secs,
+        stats.timeouts,
+        stats.naks
+    );
+    println!(
+        "  packets: {responses} responses ({:.0}/s)",
+        responses as f64 / secs
+    );
+    print_latency("OFFER", &mut stats.offer_latency);
+    print_latency("ACK", &mut stats.ack_latency);
+    println!(
+        "  API calls: DiscoverDhcp {}, DiscoverDhcpBatch {}",
+        api_server.calls_for(mock_api_server::ENDPOINT_DISCOVER_DHCP),
+        api_server.calls_for(mock_api_server::ENDPOINT_DISCOVER_DHCP_BATCH)
+    );
+}
+
+fn print_latency(name: &str, latency: &mut [Duration]) {
+    if latency.is_empty() {
+        println!("  {name} latency: no responses");
+        return;
+    }
+    latency.sort_unstable();
+    println!(
+        "  {name} latency: p50 {:.2?}, p99 {:.2?}, p999 {:.2?}, max {:.2?}",
+        percentile(latency, 0.50),
+        percentile(latency, 0.99),
+        percentile(latency, 0.999),
+        latency[latency.len() - 1]
+    );
+}
+
+// `sorted` must not be empty
+fn percentile(sorted: &[Duration], q: f64) -> Duration {
+    let rank = ((sorted.len() - 1) as f64 * q).round() as usize;
+    sorted[rank]
+}
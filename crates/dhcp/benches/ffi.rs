@@ -0,0 +1,269 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2026 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//! Per-packet cost of the functions callouts.cc calls.
+//!
+//! Each group times one part of the FFI surface on its own: building and freeing a discovery,
+//! the cache, and reading a machine's response. `packet` runs the whole sequence pkt4_receive
+//! and pkt4_send make for a client that is already in the cache, both through the
+//! `discovery_set_*` builder and through the single `discovery_fetch_machine_for` call.
+//! The builder is only built with the `bench-hooks` feature:
+//!
+//! ```text
+//! cargo bench -p carbide-dhcp --features bench-hooks --bench ffi
+//! ```
+//!
+//! The cache is filled by one discovery against `MockAPIServer`, and its TTL set so that entry
+//! outlives the run. Nothing here talks to the API after that.
+
+use std::ffi::CString;
+use std::hint::black_box;
+use std::net::{IpAddr, Ipv4Addr};
+use std::ptr;
+
+use criterion::{Criterion, criterion_group, criterion_main};
+use dhcp::cache::{self, CacheEntryStatus, CacheKey};
+use dhcp::discovery::*;
+use dhcp::machine::{Machine, machine_free, machine_get_response};
+use dhcp::{
+    CarbideDhcpContext, carbide_set_config_api, carbide_set_config_cache_ttl_secs, mock_api_server,
+};
+use mac_address::MacAddress;
+
+const MAC_ADDRESS: [u8; 6] = [2, 66, 172, 20, 2, 1];
+// Big endian, as Kea hands them over
+const RELAY: u32 = u32::from_be_bytes([172, 20, 2, 254]);
+const LINK_SELECT: u32 = u32::from_be_bytes([172, 20, 2, 0]);
+const CLIENT_SYSTEM: u16 = 7;
+
+// What pkt4_receive pulls out of one packet
+struct Packet {
+    vendor_class: CString,
+    circuit_id: CString,
+    remote_id: CString,
+}
+
+impl Packet {
+    fn new() -> Packet {
+        Packet {
+            vendor_class: CString::new("HTTPClient:Arch:00016:UNDI:003001").unwrap(),
+            circuit_id: CString::new("Ethernet12").unwrap(),
+            remote_id: CString::new("b8:3f:d2:90:97:a6").unwrap(),
+        }
+    }
+
+    // Fill a new discovery builder the way pkt4_receive does
+    fn builder(&self) -> *mut DiscoveryBuilderFFI {
+        let builder = discovery_builder_allocate();
+        unsafe {
+            discovery_set_link_select(builder, LINK_SELECT);
+            discovery_set_circuit_id(builder, self.circuit_id.as_ptr());
+            discovery_set_remote_id(builder, self.remote_id.as_ptr());
+            discovery_set_vendor_class(builder, self.vendor_class.as_ptr());
+            discovery_set_client_system(builder, CLIENT_SYSTEM);
+            discovery_set_relay(builder, RELAY);
+            discovery_set_mac_address(builder, MAC_ADDRESS.as_ptr(), MAC_ADDRESS.len());
+        }
+        builder
+    }
+
+    // pkt4_receive and pkt4_send, short of touching Kea's packets
+    fn run(&self) -> Option<u32> {
+        let builder = self.builder();
+        let mut machine: *mut Machine = ptr::null_mut();
+        let result = unsafe { discovery_fetch_machine(builder, &mut machine) };
+        unsafe { discovery_builder_free(builder) };
+        if result != DiscoveryBuilderResult::Success {
+            return None;
+        }
+        let response = machine_get_response(machine);
+        machine_free(machine);
+        Some(response.interface_address)
+    }
+
+    // What pkt4_receive hands over since discovery_fetch_machine_for
+    fn request(&self) -> DiscoveryRequest {
+        let view = |bytes: &[u8]| ByteView {
+            ptr: bytes.as_ptr(),
+            len: bytes.len(),
+        };
+        DiscoveryRequest {
+            relay_address: RELAY,
+            mac_address: view(&MAC_ADDRESS),
+            link_select_address: LINK_SELECT,
+            circuit_id: view(self.circuit_id.as_bytes()),
+            remote_id: view(self.remote_id.as_bytes()),
+            vendor_class: view(self.vendor_class.as_bytes()),
+            desired_address: 0,
+            client_system: CLIENT_SYSTEM,
+            has_client_system: true,
+            trace: ptr::null(),
+        }
+    }
+
+    // As `run`, with one call instead of the builder
+    fn run_request(&self) -> Option<u32> {
+        let request = self.request();
+        let mut machine: *mut Machine = ptr::null_mut();
+        let result = unsafe { discovery_fetch_machine_for(&request, &mut machine) };
+        if result != DiscoveryBuilderResult::Success {
+            return None;
+        }
+        let response = machine_get_response(machine);
+        machine_free(machine);
+        Some(response.interface_address)
+    }
+
+    fn cache_key(&self) -> CacheKey {
+        CacheKey::new(
+            MacAddress::new(MAC_ADDRESS),
+            IpAddr::V4(Ipv4Addr::from(LINK_SELECT)),
+            &Some(self.circuit_id.to_str().unwrap().to_string()),
+            &Some(self.remote_id.to_str().unwrap().to_string()),
+            "HTTPClient",
+        )
+        .unwrap()
+    }
+}
+
+fn bench_discovery_builder(c: &mut Criterion) {
+    let packet = Packet::new();
+    let mut group = c.benchmark_group("discovery_builder");
+
+    group.bench_function("allocate_free", |b| {
+        b.iter(|| unsafe { discovery_builder_free(black_box(discovery_builder_allocate())) });
+    });
+    group.bench_function("allocate_set_all_free", |b| {
+        b.iter(|| unsafe { discovery_builder_free(black_box(packet.builder())) });
+    });
+
+    let builder = discovery_builder_allocate();
+    group.bench_function("set_circuit_id", |b| {
+        b.iter(|| unsafe {
+            black_box(discovery_set_circuit_id(
+                builder,
+                packet.circuit_id.as_ptr(),
+            ))
+        });
+    });
+    group.bench_function("set_vendor_class", |b| {
+        b.iter(|| unsafe {
+            black_box(discovery_set_vendor_class(
+                builder,
+                packet.vendor_class.as_ptr(),
+            ))
+        });
+    });
+    group.bench_function("set_mac_address", |b| {
+        b.iter(|| unsafe {
+            black_box(discovery_set_mac_address(
+                builder,
+                MAC_ADDRESS.as_ptr(),
+                MAC_ADDRESS.len(),
+            ))
+        });
+    });
+    unsafe { discovery_builder_free(builder) };
+
+    group.finish();
+}
+
+fn bench_cache(c: &mut Criterion) {
+    let packet = Packet::new();
+    let key = packet.cache_key();
+    let missing = CacheKey::new(
+        MacAddress::new([2, 66, 172, 20, 2, 2]),
+        IpAddr::V4(Ipv4Addr::from(LINK_SELECT)),
+        &None,
+        &None,
+        "",
+    )
+    .unwrap();
+    let mut group = c.benchmark_group("cache");
+
+    group.bench_function("get_hit", |b| {
+        b.iter(|| black_box(cache::get(&key)));
+    });
+    group.bench_function("get_miss", |b| {
+        b.iter(|| black_box(cache::get(&missing)));
+    });
+    let put_key = CacheKey::new(
+        MacAddress::new([2, 66, 172, 20, 2, 3]),
+        IpAddr::V4(Ipv4Addr::from(LINK_SELECT)),
+        &None,
+        &None,
+        "",
+    )
+    .unwrap();
+    group.bench_function("put", |b| {
+        b.iter(|| cache::put(put_key, CacheEntryStatus::DiscoveryFailing(1)));
+    });
+
+    group.finish();
+}
+
+fn bench_machine(c: &mut Criterion) {
+    let packet = Packet::new();
+    let Some(CacheEntryStatus::ValidEntry(machine)) =
+        cache::get(&packet.cache_key()).map(|entry| entry.status)
+    else {
+        panic!("machine is not in the cache");
+    };
+    let mut group = c.benchmark_group("machine");
+
+    group.bench_function("get_response", |b| {
+        b.iter(|| black_box(machine_get_response(black_box(&*machine))));
+    });
+
+    group.finish();
+}
+
+fn bench_packet(c: &mut Criterion) {
+    let packet = Packet::new();
+    let mut group = c.benchmark_group("packet");
+
+    group.bench_function("cached_machine", |b| {
+        b.iter(|| black_box(packet.run()).expect("discovery failed"));
+    });
+    group.bench_function("cached_machine_request", |b| {
+        b.iter(|| black_box(packet.run_request()).expect("discovery failed"));
+    });
+
+    group.finish();
+}
+
+fn benches(c: &mut Criterion) {
+    let rt = CarbideDhcpContext::get_tokio_runtime();
+    let api_server = rt.block_on(mock_api_server::MockAPIServer::start());
+    let url = CString::new(api_server.local_http_addr()).unwrap();
+    unsafe { carbide_set_config_api(url.as_ptr()) };
+    // Don't let the machine expire partway through
+    carbide_set_config_cache_ttl_secs(u32::MAX);
+
+    // Fills the cache, every run after this is a hit
+    Packet::new()
+        .run()
+        .expect("discovery against MockAPIServer failed");
+
+    bench_discovery_builder(c);
+    bench_cache(c);
+    bench_machine(c);
+    bench_packet(c);
+}
+
+criterion_group!(ffi, benches);
+criterion_main!(ffi);
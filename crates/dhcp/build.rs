@@ -62,6 +62,7 @@ fn main() {
     println!("cargo:rustc-link-lib=keashim");
     println!("cargo:rustc-link-lib=stdc++");
     println!("cargo:rustc-link-lib=kea-asiolink");
+    println!("cargo:rustc-link-lib=kea-cc");
     println!("cargo:rustc-link-lib=kea-dhcpsrv");
     println!("cargo:rustc-link-lib=kea-dhcp++");
     println!("cargo:rustc-link-lib=kea-hooks");
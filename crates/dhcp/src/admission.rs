@@ -0,0 +1,292 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2026 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/// Keep a slow or broken carbide-api from holding all of Kea's packet threads
+///
+/// Every fetch which misses the cache goes through here. At most `carbide-api-max-in-flight`
+/// of them talk to carbide-api at once, and each gets `carbide-api-deadline-ms` for waiting
+/// its turn, connecting and the call itself. A fetch which runs out of time fails with
+/// `ApiDeadlineExceeded` rather than waiting on the client's own retries.
+///
+/// After `carbide-api-breaker-failures` failed calls in a row the breaker opens, and fetches
+/// fail with `ApiUnavailable` straight away. Once `carbide-api-breaker-cooldown-secs` has
+/// passed one fetch is let through to try again, and the breaker closes when it works. The
+/// readiness check in metrics.rs feeds the breaker as well, so it also closes as soon as that
+/// gets through. Only a call which didn't get an answer counts as failed, see `is_outage`. An
+/// error carbide-api answered with, like an unknown MAC address, shows it is up.
+///
+/// Cache hits never come here, so they are answered at full speed throughout.
+///
+/// There's a breaker per API URL, like the clients in api_client.rs, because unit tests run
+/// several mock API servers in the same process.
+///
+use std::collections::HashMap;
+use std::error::Error;
+use std::future::Future;
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+use lazy_static::lazy_static;
+use tokio::sync::Semaphore;
+use tokio::time::timeout;
+use tonic::{Code, Status};
+
+use crate::CONFIG;
+use crate::discovery::DiscoveryBuilderResult;
+use crate::metrics::set_service_ready;
+
+/// Default for `carbide-api-max-in-flight`
+pub const DEFAULT_MAX_IN_FLIGHT: usize = 64;
+/// Default for `carbide-api-deadline-ms`
+pub const DEFAULT_DEADLINE: Duration = Duration::from_secs(5);
+/// Default for `carbide-api-breaker-failures`
+pub const DEFAULT_BREAKER_FAILURES: u32 = 5;
+/// Default for `carbide-api-breaker-cooldown-secs`
+pub const DEFAULT_BREAKER_COOLDOWN: Duration = Duration::from_secs(10);
+
+lazy_static! {
+    static ref ADMISSION: AdmissionController = {
+        let config = CONFIG.load();
+        AdmissionController {
+            permits: Semaphore::new(config.api_max_in_flight),
+            deadline: config.api_deadline,
+            breaker_failures: config.api_breaker_failures,
+            breaker_cooldown: config.api_breaker_cooldown,
+            breakers: Mutex::new(HashMap::new()),
+        }
+    };
+}
+
+struct AdmissionController {
+    permits: Semaphore,
+    /// Zero for no deadline
+    deadline: Duration,
+    breaker_failures: u32,
+    breaker_cooldown: Duration,
+    breakers: Mutex<HashMap<String, Arc<Breaker>>>,
+}
+
+impl AdmissionController {
+    fn breaker(&self, url: &str) -> Arc<Breaker> {
+        let mut breakers = self.breakers.lock().unwrap();
+        if let Some(breaker) = breakers.get(url) {
+            return breaker.clone();
+        }
+        let breaker = Arc::new(Breaker::new(self.breaker_failures, self.breaker_cooldown));
+        breakers.insert(url.to_string(), breaker.clone());
+        breaker
+    }
+}
+
+/// A fetch allowed to go to carbide-api, see `admit`
+pub(crate) struct Admission {
+    breaker: Arc<Breaker>,
+}
+
+/// Let a fetch go to carbide-api at `url`, unless its breaker is open
+pub(crate) fn admit(url: &str) -> Result<Admission, DiscoveryBuilderResult> {
+    let breaker = ADMISSION.breaker(url);
+    if breaker.admit(Instant::now()) {
+        Ok(Admission { breaker })
+    } else {
+        Err(DiscoveryBuilderResult::ApiUnavailable)
+    }
+}
+
+/// Tell the breaker for `url` how a call made outside of `Admission::run` went
+pub(crate) fn record(url: &str, success: bool) {
+    ADMISSION.breaker(url).record(success, Instant::now());
+}
+
+impl Admission {
+    /// Run `call` once there's room for it, within the deadline.
+    ///
+    /// Returns None if the deadline passed first. Either way the breaker hears about it.
+    pub(crate) async fn run<F, T>(self, call: F) -> Option<Result<T, Status>>
+    where
+        F: Future<Output = Result<T, Status>>,
+    {
+        let admission = &*ADMISSION;
+        let bounded = async {
+            // Never closed, so this can't fail
+            let _permit = admission.permits.acquire().await.ok();
+            call.await
+        };
+        let result = if admission.deadline.is_zero() {
+            Some(bounded.await)
+        } else {
+            timeout(admission.deadline, bounded).await.ok()
+        };
+        let answered = match &result {
+            Some(Ok(_)) => true,
+            Some(Err(status)) => !is_outage(status),
+            None => false,
+        };
+        self.breaker.record(answered, Instant::now());
+        result
+    }
+}
+
+/// Whether a failed call means carbide-api isn't answering, rather than that it answered no
+pub(crate) fn is_outage(status: &Status) -> bool {
+    matches!(
+        status.code(),
+        Code::Unavailable | Code::DeadlineExceeded | Code::ResourceExhausted
+    ) || status
+        .source()
+        .is_some_and(|source| source.is::<tonic::transport::Error>())
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum BreakerState {
+    Closed {
+        failures: u32,
+    },
+    Open {
+        until: Instant,
+    },
+    /// Open, with one fetch let through to see whether carbide-api is back
+    Probing,
+}
+
+struct Breaker {
+    state: Mutex<BreakerState>,
+    /// Zero never opens the breaker
+    threshold: u32,
+    cooldown: Duration,
+}
+
+impl Breaker {
+    fn new(threshold: u32, cooldown: Duration) -> Breaker {
+        Breaker {
+            state: Mutex::new(BreakerState::Closed { failures: 0 }),
+            threshold,
+            cooldown,
+        }
+    }
+
+    fn admit(&self, now: Instant) -> bool {
+        let mut state = self.state.lock().unwrap();
+        match *state {
+            BreakerState::Closed { .. } => true,
+            BreakerState::Open { until } if now >= until => {
+                *state = BreakerState::Probing;
+                true
+            }
+            BreakerState::Open { .. } | BreakerState::Probing => false,
+        }
+    }
+
+    fn record(&self, success: bool, now: Instant) {
+        if self.threshold == 0 {
+            return;
+        }
+        let mut state = self.state.lock().unwrap();
+        let next = match (*state, success) {
+            (_, true) => BreakerState::Closed { failures: 0 },
+            (BreakerState::Closed { failures }, false) if failures + 1 < self.threshold => {
+                BreakerState::Closed {
+                    failures: failures + 1,
+                }
+            }
+            // Don't push back the probe of a breaker which is open already
+            (BreakerState::Open { until }, false) => BreakerState::Open { until },
+            (BreakerState::Closed { .. } | BreakerState::Probing, false) => BreakerState::Open {
+                until: now + self.cooldown,
+            },
+        };
+        let was_closed = matches!(*state, BreakerState::Closed { .. });
+        let is_closed = matches!(next, BreakerState::Closed { .. });
+        *state = next;
+        drop(state);
+
+        if was_closed && !is_closed {
+            log::error!(
+                "carbide-api failed {} times in a row, failing discoveries without calling it for {:?}",
+                self.threshold,
+                self.cooldown
+            );
+            set_service_ready(false);
+        } else if !was_closed && is_closed {
+            log::info!("carbide-api is answering again, resuming discoveries");
+            set_service_ready(true);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_breaker_opens_and_probes() {
+        let breaker = Breaker::new(3, Duration::from_secs(10));
+        let start = Instant::now();
+
+        // A success in between starts the count again
+        breaker.record(false, start);
+        breaker.record(false, start);
+        breaker.record(true, start);
+        breaker.record(false, start);
+        breaker.record(false, start);
+        assert!(breaker.admit(start));
+        breaker.record(false, start);
+        assert!(!breaker.admit(start));
+        assert!(!breaker.admit(start + Duration::from_secs(9)));
+
+        // One probe after the cooldown, nothing else until it's back
+        let later = start + Duration::from_secs(10);
+        assert!(breaker.admit(later));
+        assert!(!breaker.admit(later));
+        breaker.record(false, later);
+        assert!(!breaker.admit(later + Duration::from_secs(9)));
+        assert!(breaker.admit(later + Duration::from_secs(10)));
+        breaker.record(true, later + Duration::from_secs(10));
+        assert!(breaker.admit(later + Duration::from_secs(10)));
+        assert!(breaker.admit(later + Duration::from_secs(10)));
+    }
+
+    #[test]
+    fn test_breaker_closed_by_outside_check() {
+        let breaker = Breaker::new(1, Duration::from_secs(10));
+        let start = Instant::now();
+        breaker.record(false, start);
+        assert!(!breaker.admit(start));
+        breaker.record(true, start);
+        assert!(breaker.admit(start));
+    }
+
+    #[test]
+    fn test_is_outage() {
+        assert!(is_outage(&Status::unavailable("connection refused")));
+        assert!(is_outage(&Status::deadline_exceeded("too slow")));
+        assert!(is_outage(&Status::resource_exhausted("too many requests")));
+        assert!(!is_outage(&Status::not_found("no such machine")));
+        assert!(!is_outage(&Status::invalid_argument("bad MAC address")));
+        assert!(!is_outage(&Status::internal("database error")));
+    }
+
+    #[test]
+    fn test_breaker_off() {
+        let breaker = Breaker::new(0, Duration::from_secs(10));
+        let start = Instant::now();
+        for _ in 0..10 {
+            breaker.record(false, start);
+        }
+        assert!(breaker.admit(start));
+    }
+}
@@ -0,0 +1,75 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2026 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/// Long-lived clients for carbide-api
+///
+/// Building a new client for every cache miss means a TCP and mTLS handshake before we can
+/// send a single `discover_dhcp`. Instead we keep one `ForgeApiClient` per API URL and share
+/// it between all of Kea's packet threads. It holds a single HTTP/2 connection which
+/// multiplexes concurrent requests, and it reconnects by itself when the connection is
+/// dropped or when the client certificate on disk is newer than the connection.
+///
+/// Keyed by URL because unit tests run several mock API servers in the same process.
+///
+use std::collections::HashMap;
+use std::sync::Mutex;
+
+use lazy_static::lazy_static;
+use rpc::forge_api_client::ForgeApiClient;
+use rpc::forge_tls_client::ApiConfig;
+
+use crate::tls;
+
+lazy_static! {
+    static ref API_CLIENTS: Mutex<HashMap<String, ForgeApiClient>> = Mutex::new(HashMap::new());
+}
+
+/// Get the shared client for `url`, creating it if this is the first time we talk to it.
+///
+/// Creating the client does not connect, that happens on the first request.
+pub fn get(url: &str) -> ForgeApiClient {
+    let mut clients = API_CLIENTS.lock().unwrap();
+    if let Some(client) = clients.get(url) {
+        return client.clone();
+    }
+    let client = ForgeApiClient::new(&ApiConfig::new(url, &tls::build_forge_client_config()));
+    clients.insert(url.to_string(), client.clone());
+    client
+}
+
+/// Forget the shared client for `url`. The next `get` builds a fresh one.
+///
+/// Called after a failed request, in case the connection itself is what's broken.
+pub fn reset(url: &str) {
+    API_CLIENTS.lock().unwrap().remove(url);
+}
+
+/// Re-establish the connection of every shared client.
+///
+/// `ForgeApiClient` notices a rotated client certificate on its next request. Calling this
+/// from the background means that next request is not a DHCP packet waiting on a handshake.
+pub async fn reconnect_all() {
+    let clients: Vec<ForgeApiClient> = API_CLIENTS.lock().unwrap().values().cloned().collect();
+    for client in clients {
+        if let Err(err) = client.connection().await {
+            log::warn!(
+                "failed to reconnect to carbide-api at {}: {err}",
+                client.url()
+            );
+        }
+    }
+}
@@ -0,0 +1,304 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2026 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/// Batch DiscoverDhcp calls during boot storms
+///
+/// With `carbide-discovery-batch-window-us` set, discoveries that miss the cache are not sent
+/// one by one. A collector task per API URL gathers the ones which arrive within the window,
+/// or until it has `carbide-discovery-batch-max` of them, and sends them as one
+/// DiscoverDhcpBatch. Each result goes back to the caller waiting on it.
+///
+/// A lone discovery, or one for a carbide-api which doesn't know DiscoverDhcpBatch yet, goes
+/// out as a plain DiscoverDhcp.
+///
+use std::collections::HashMap;
+use std::sync::Mutex;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::Duration;
+
+use ::rpc::forge as rpc;
+use ::rpc::forge_api_client::ForgeApiClient;
+use lazy_static::lazy_static;
+use opentelemetry::Context;
+use opentelemetry::trace::FutureExt;
+use tokio::sync::{mpsc, oneshot};
+use tokio::time::Instant;
+use tonic::{Code, Status};
+
+use crate::{CONFIG, api_client, trace};
+
+/// Default for `carbide-discovery-batch-max`
+pub const DEFAULT_BATCH_MAX: usize = 32;
+
+/// Most discoveries carbide-api takes in one DiscoverDhcpBatch or FindDhcpRecords call
+pub const MAX_BATCH_SIZE: usize = 256;
+
+/// A discovery waiting in a collector
+struct Queued {
+    request: rpc::DhcpDiscovery,
+    /// The trace context of the packet, in case it goes out as a plain DiscoverDhcp
+    context: Context,
+    reply: oneshot::Sender<Result<rpc::DhcpRecord, Status>>,
+}
+
+lazy_static! {
+    /// Collector task for each API URL
+    static ref COLLECTORS: Mutex<HashMap<String, mpsc::UnboundedSender<Queued>>> =
+        Mutex::new(HashMap::new());
+}
+
+/// Set once a carbide-api answers DiscoverDhcpBatch with Unimplemented. We stop batching until
+/// restart rather than paying for a failed call every window.
+static BATCH_UNIMPLEMENTED: AtomicBool = AtomicBool::new(false);
+
+/// Call DiscoverDhcp for `request`, as part of a batch if batching is on.
+///
+/// Must run on the tokio runtime.
+pub async fn discover_dhcp(
+    client: &ForgeApiClient,
+    request: rpc::DhcpDiscovery,
+) -> Result<rpc::DhcpRecord, Status> {
+    let (window, max) = {
+        let config = CONFIG.load();
+        (config.discovery_batch_window, config.discovery_batch_max)
+    };
+    discover_dhcp_with(client, request, window, max).await
+}
+
+async fn discover_dhcp_with(
+    client: &ForgeApiClient,
+    request: rpc::DhcpDiscovery,
+    window: Duration,
+    max: usize,
+) -> Result<rpc::DhcpRecord, Status> {
+    if window.is_zero() || max < 2 || BATCH_UNIMPLEMENTED.load(Ordering::Relaxed) {
+        return discover_dhcp_one(client, request).await;
+    }
+
+    let (tx, rx) = oneshot::channel();
+    {
+        let mut collectors = COLLECTORS.lock().unwrap();
+        let collector = collectors
+            .entry(client.url().to_string())
+            .or_insert_with(|| {
+                let (collector_tx, collector_rx) = mpsc::unbounded_channel();
+                tokio::spawn(collect(client.url().to_string(), collector_rx, window, max));
+                collector_tx
+            });
+        let queued = Queued {
+            request,
+            context: Context::current(),
+            reply: tx,
+        };
+        if let Err(mpsc::error::SendError(Queued { request, .. })) = collector.send(queued) {
+            // The collector went away, it will be started again by the next call
+            collectors.remove(client.url());
+            drop(collectors);
+            return discover_dhcp_one(client, request).await;
+        }
+    }
+
+    rx.await
+        .unwrap_or_else(|_| Err(Status::internal("discovery batch dropped the request")))
+}
+
+// A plain DiscoverDhcp, which carries the packet's trace context to carbide-api
+async fn discover_dhcp_one(
+    client: &ForgeApiClient,
+    request: rpc::DhcpDiscovery,
+) -> Result<rpc::DhcpRecord, Status> {
+    let mut request = tonic::Request::new(request);
+    trace::inject(request.metadata_mut());
+    Ok(client
+        .connection()
+        .await?
+        .discover_dhcp(request)
+        .await?
+        .into_inner())
+}
+
+/// Look up the records of `requests` with FindDhcpRecords, which unlike DiscoverDhcp doesn't
+/// change anything on carbide-api
+///
+/// Results are in the same order as the requests. If the call fails every result is its error.
+/// Takes at most `MAX_BATCH_SIZE` requests. Must run on the tokio runtime.
+pub async fn find_dhcp_records(
+    client: &ForgeApiClient,
+    requests: Vec<rpc::DhcpDiscovery>,
+) -> Vec<Result<rpc::DhcpRecord, Status>> {
+    let count = requests.len();
+    let request = rpc::DhcpDiscoveryBatch {
+        discoveries: requests,
+    };
+    let status = match client.find_dhcp_records(request).await {
+        Ok(response) if response.results.len() == count => {
+            return response.results.into_iter().map(slot_result).collect();
+        }
+        Ok(response) => Status::internal(format!(
+            "FindDhcpRecords returned {} results for {count} discoveries",
+            response.results.len()
+        )),
+        Err(status) => status,
+    };
+    vec![Err(status); count]
+}
+
+// The record, or the status carbide-api failed that discovery with
+fn slot_result(result: rpc::DhcpDiscoveryResult) -> Result<rpc::DhcpRecord, Status> {
+    match result.result {
+        Some(rpc::dhcp_discovery_result::Result::Record(record)) => Ok(record),
+        Some(rpc::dhcp_discovery_result::Result::Error(error)) => {
+            Err(Status::new(error.code.into(), error.message))
+        }
+        None => Err(Status::internal("empty result in batch response")),
+    }
+}
+
+// Gather requests into batches and send them, until every sender is gone
+//
+// Each batch goes out on the shared client for `url` at the time, so it picks up a client
+// `api_client::reset` replaced.
+async fn collect(
+    url: String,
+    mut rx: mpsc::UnboundedReceiver<Queued>,
+    window: Duration,
+    max: usize,
+) {
+    while let Some(first) = rx.recv().await {
+        let mut batch = Vec::with_capacity(max);
+        batch.push(first);
+
+        let deadline = Instant::now() + window;
+        while batch.len() < max {
+            match tokio::time::timeout_at(deadline, rx.recv()).await {
+                Ok(Some(next)) => batch.push(next),
+                Ok(None) | Err(_) => break,
+            }
+        }
+
+        // Send in the background so the next batch can fill up meanwhile
+        tokio::spawn(send(api_client::get(&url), batch));
+    }
+}
+
+async fn send(client: ForgeApiClient, batch: Vec<Queued>) {
+    if batch.len() == 1 || BATCH_UNIMPLEMENTED.load(Ordering::Relaxed) {
+        send_unary(&client, batch).await;
+        return;
+    }
+
+    let request = rpc::DhcpDiscoveryBatch {
+        discoveries: batch.iter().map(|queued| queued.request.clone()).collect(),
+    };
+    match client.discover_dhcp_batch(request).await {
+        Ok(response) if response.results.len() == batch.len() => {
+            for (result, queued) in response.results.into_iter().zip(batch) {
+                // The caller only goes away if its task did
+                let _ = queued.reply.send(slot_result(result));
+            }
+        }
+        Ok(response) => {
+            let status = Status::internal(format!(
+                "DiscoverDhcpBatch returned {} results for {} discoveries",
+                response.results.len(),
+                batch.len()
+            ));
+            for queued in batch {
+                let _ = queued.reply.send(Err(status.clone()));
+            }
+        }
+        Err(status) if status.code() == Code::Unimplemented => {
+            log::warn!(
+                "carbide-api at {} does not implement DiscoverDhcpBatch, sending discoveries one by one",
+                client.url()
+            );
+            BATCH_UNIMPLEMENTED.store(true, Ordering::Relaxed);
+            send_unary(&client, batch).await;
+        }
+        Err(status) => {
+            for queued in batch {
+                let _ = queued.reply.send(Err(status.clone()));
+            }
+        }
+    }
+}
+
+// Each as a plain DiscoverDhcp, in the trace context of its packet
+async fn send_unary(client: &ForgeApiClient, batch: Vec<Queued>) {
+    for queued in batch {
+        let client = client.clone();
+        tokio::spawn(async move {
+            let result = discover_dhcp_one(&client, queued.request)
+                .with_context(queued.context)
+                .await;
+            let _ = queued.reply.send(result);
+        });
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use mac_address::MacAddress;
+
+    use super::*;
+    use crate::{CarbideDhcpContext, api_client, mock_api_server};
+
+    fn discovery(mac_address: MacAddress) -> rpc::DhcpDiscovery {
+        rpc::DhcpDiscovery {
+            mac_address: mac_address.to_string(),
+            relay_address: "172.20.0.1".to_string(),
+            ..Default::default()
+        }
+    }
+
+    // Discoveries arriving together go out as one DiscoverDhcpBatch, and each caller gets its own
+    // record back
+    #[test]
+    fn test_discover_dhcp_batches_concurrent_calls() {
+        let rt: &tokio::runtime::Runtime = CarbideDhcpContext::get_tokio_runtime();
+        let api_server = rt.block_on(mock_api_server::MockAPIServer::start());
+        let client = api_client::get(api_server.local_http_addr());
+
+        let macs: Vec<_> = (1..=8)
+            .map(|idx| MacAddress::new([2, 66, 172, 20, 16, idx]))
+            .collect();
+        let max = macs.len();
+        let calls: Vec<_> = macs
+            .iter()
+            .map(|mac| {
+                let client = client.clone();
+                let request = discovery(*mac);
+                rt.spawn(async move {
+                    discover_dhcp_with(&client, request, Duration::from_millis(100), max).await
+                })
+            })
+            .collect();
+
+        for (mac, call) in macs.iter().zip(calls) {
+            let record = rt.block_on(call).unwrap().unwrap();
+            assert_eq!(record.mac_address, mac.to_string());
+        }
+        assert_eq!(
+            api_server.calls_for(mock_api_server::ENDPOINT_DISCOVER_DHCP_BATCH),
+            1
+        );
+        assert_eq!(
+            api_server.calls_for(mock_api_server::ENDPOINT_DISCOVER_DHCP),
+            0
+        );
+    }
+}
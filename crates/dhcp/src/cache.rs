@@ -22,10 +22,39 @@
 /// be short lived.
 ///
 /// The cache is a static because we are called from Kea's hooks, potentially from multiple threads.
+/// It is split into shards, each with its own lock and LRU list, so packets for different hosts
+/// rarely wait on each other. Machines are shared out as `Arc`s rather than copied.
+///
+/// Size and TTLs come from the `carbide-cache-*` hook parameters, read the first time the
+/// cache is used.
+///
+/// A machine hit in the last `carbide-cache-refresh-ahead-secs` of its TTL is answered from the
+/// cache and refreshed from carbide-api in the background (see `needs_refresh`), so a busy
+/// client doesn't wait on the API when its entry runs out. Until a refresh succeeds the entry
+/// can be served for up to `carbide-cache-max-stale-secs` past its TTL.
+///
+/// The `carbide-cache-*` commands on Kea's control channel (callouts.cc) empty the cache,
+/// drop some of it, or report what's in it, through the `carbide_cache_*` calls below.
+///
+/// The vendor class is part of the key, since the boot filename and options depend on it, so
+/// a host netbooting from firmware PXE and then from iPXE would miss the entry from the first
+/// stage. With `carbide-cache-identity-reuse-secs` set, a machine carbide-api resolved for the
+/// same MAC address and relay that long ago at most is reused for the other stages, with only
+/// what's derived from the vendor class worked out again (see `get_identity`).
+///
+/// Inserts, invalidations and flushes are passed on to the HA peer when replication is on,
+/// see replication.rs. What the peer sends goes in through `replace`, `invalidate` and
+/// `flush`, which don't pass it on again.
 ///
 use std::{
-    net::IpAddr,
-    sync::Mutex,
+    fmt,
+    hash::{BuildHasher, RandomState},
+    net::{IpAddr, Ipv4Addr},
+    num::NonZeroUsize,
+    sync::{
+        Arc, Mutex,
+        atomic::{AtomicBool, Ordering},
+    },
     time::{Duration, Instant},
 };
 
@@ -33,127 +62,589 @@ use lazy_static::lazy_static;
 use lru::LruCache;
 use mac_address::MacAddress;
 
+use crate::CONFIG;
+use crate::discovery::ByteView;
 use crate::machine::Machine;
+use crate::metrics::{self, CacheLookup};
+use crate::replication;
 
-/// Data in cache is only valid this long
-const MACHINE_CACHE_TIMEOUT: Duration = Duration::from_secs(60);
-// For negative caching, the TTL should be longer
-const MACHINE_DISC_FAILED_CACHE_TIMEOUT: Duration = Duration::from_secs(5 * 60);
+/// Data in cache is only valid this long, unless `carbide-cache-ttl-secs` says otherwise
+pub const MACHINE_CACHE_TIMEOUT: Duration = Duration::from_secs(60);
+// For negative caching, the TTL should be longer. See `carbide-negative-cache-ttl-secs`.
+pub const MACHINE_DISC_FAILED_CACHE_TIMEOUT: Duration = Duration::from_secs(5 * 60);
+/// Refresh a machine hit this close to the end of its TTL, unless
+/// `carbide-cache-refresh-ahead-secs` says otherwise
+pub const MACHINE_CACHE_REFRESH_AHEAD: Duration = Duration::from_secs(10);
+/// After a refresh fails, wait this long before refreshing the machine again
+pub const MACHINE_CACHE_REFRESH_RETRY: Duration = Duration::from_secs(5);
 // Max allowed discovery failures before an error is returned to the machine without calling carbide-api. Public so unit tests can access it.
 pub const MAX_DISCOVERY_FAILS: u32 = 5;
-/// How many entries to keep. After that we evict the entry used the longest ago.
-const MACHINE_CACHE_SIZE: usize = 1000;
-/// If the cache key comes out shorter than this something went wrong, don't use it.
-const MIN_KEY_LEN: usize = 10;
+/// How many entries to keep, unless `carbide-cache-size` says otherwise. After that we evict
+/// the entry used the longest ago.
+pub const MACHINE_CACHE_SIZE: usize = 1000;
+/// Number of independently locked parts of the cache. Capacity is split evenly between them,
+/// so eviction is least-recently-used per shard rather than over the whole cache.
+pub(crate) const CACHE_SHARDS: usize = 16;
+
+/// Set once MACHINE_CACHE is built, its sizes are only read then
+static CACHE_STARTED: AtomicBool = AtomicBool::new(false);
 
 lazy_static! {
-    static ref MACHINE_CACHE: Mutex<LruCache<String, CacheEntry>> = Mutex::new(LruCache::new(
-        std::num::NonZeroUsize::new(MACHINE_CACHE_SIZE).unwrap()
-    ));
+    static ref MACHINE_CACHE: MachineCache = {
+        CACHE_STARTED.store(true, Ordering::Release);
+        let config = CONFIG.load();
+        MachineCache::new(
+            config.cache_size,
+            config.cache_ttl,
+            config.negative_cache_ttl,
+            config.cache_refresh_ahead,
+            config.cache_max_stale,
+            config.cache_identity_reuse,
+        )
+    };
+}
+
+struct MachineCache {
+    shards: Vec<Mutex<LruCache<CacheKey, CacheEntry>>>,
+    /// The last machine resolved for a key whatever its vendor class, see `identity_key`.
+    /// Empty when `identity_reuse` is 0.
+    identities: Vec<Mutex<LruCache<CacheKey, CacheEntry>>>,
+    hasher: RandomState,
+    ttl: Duration,
+    negative_ttl: Duration,
+    refresh_ahead: Duration,
+    max_stale: Duration,
+    identity_reuse: Duration,
 }
 
 #[derive(Debug, Clone)]
 pub struct CacheEntry {
     pub timestamp: Instant,
     pub status: CacheEntryStatus,
+    /// When refreshing this machine from carbide-api last failed, see `refresh_failed`
+    pub refresh_failed: Option<Instant>,
 }
 
 #[derive(Debug, Clone)]
 pub enum CacheEntryStatus {
-    ValidEntry(Box<Machine>),
+    ValidEntry(Arc<Machine>),
     DiscoveryFailing(u32),
     DiscoveryFailed,
 }
 
+/// Identifies a cache entry: what the client sent that can change carbide-api's answer.
+///
+/// Fixed size and `Copy` so building one for every packet doesn't allocate. The option 82
+/// strings and the vendor id only need comparing, so they are kept as 64-bit FNV-1a hashes.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct CacheKey {
+    pub(crate) mac_address: [u8; 6],
+    pub(crate) link_address: IpAddr,
+    pub(crate) circuit_id: u64,
+    pub(crate) remote_id: u64,
+    pub(crate) vendor_id: u64,
+}
+
+impl CacheKey {
+    /// Returns None if the packet doesn't identify a client well enough to cache the
+    /// answer for it.
+    pub fn new(
+        mac_address: MacAddress,
+        link_address: IpAddr,        // relay address
+        circuit_id: &Option<String>, // vlan id
+        remote_id: &Option<String>,
+        vendor_id: &str,
+    ) -> Option<CacheKey> {
+        let mac_bytes = mac_address.bytes();
+        if mac_bytes == [0; 6] || mac_bytes == [0xff; 6] {
+            log::debug!("Unexpected MAC address {mac_address}, not caching");
+            return None;
+        }
+        if link_address.is_unspecified() {
+            log::debug!("Missing link address for {mac_address}, not caching");
+            return None;
+        }
+        Some(CacheKey {
+            mac_address: mac_bytes,
+            link_address,
+            circuit_id: circuit_id.as_deref().map_or(0, fnv1a),
+            remote_id: remote_id.as_deref().map_or(0, fnv1a),
+            vendor_id: fnv1a(vendor_id),
+        })
+    }
+}
+
+impl fmt::Display for CacheKey {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "{}_{}_{:016x}_{:016x}_{:016x}",
+            MacAddress::new(self.mac_address),
+            self.link_address,
+            self.circuit_id,
+            self.remote_id,
+            self.vendor_id
+        )
+    }
+}
+
 /// Fetch an entry from the cache.
 ///
-/// Result is owned by the caller, it is a clone of cached item.
-/// Takes a global lock on the cache.
+/// Result is owned by the caller. It is a copy of the cached entry, but a valid entry
+/// shares its `Machine` with the cache.
+/// Takes the lock of one shard of the cache.
 /// Returns None if we don't have that item in cache, or if we did but
 /// it's no longer valid (e.g. too old).
-pub fn get(
-    mac_address: MacAddress,
-    link_address: IpAddr,
-    circuit_id: &Option<String>,
-    remote_id: &Option<String>,
-    vendor_id: &str,
-) -> Option<CacheEntry> {
-    let key = &key(mac_address, link_address, circuit_id, remote_id, vendor_id);
-    if key.len() < MIN_KEY_LEN {
-        log::debug!("Unexpected cache key, skipping: '{key}'");
-        return None;
-    }
-    let mut cache = MACHINE_CACHE.lock().unwrap();
-    if let Some(entry) = cache.get(key) {
-        if !entry.has_expired() {
+pub fn get(key: &CacheKey) -> Option<CacheEntry> {
+    let mut shard = MACHINE_CACHE.shard(key).lock().unwrap();
+    if let Some(entry) = shard.get(key) {
+        if !MACHINE_CACHE.has_expired(entry) {
+            metrics::record_cache_lookup(match entry.status {
+                CacheEntryStatus::ValidEntry(_) => CacheLookup::Hit,
+                CacheEntryStatus::DiscoveryFailing(_) => CacheLookup::Miss,
+                CacheEntryStatus::DiscoveryFailed => CacheLookup::NegativeHit,
+            });
             return Some(entry.clone());
         } else {
-            log::debug!("removed expired cached response for {mac_address:?}");
-            let _removed = cache.pop_entry(key);
+            log::debug!("removed expired cached response for {key}");
+            let _removed = shard.pop_entry(key);
         }
     }
+    metrics::record_cache_lookup(CacheLookup::Miss);
     None
 }
 
+/// How many entries the cache holds when `carbide-cache-size` is `size`
+///
+/// Every shard gets the same share, so this is `size` rounded up to a multiple of
+/// `CACHE_SHARDS`.
+pub(crate) fn capacity(size: usize) -> usize {
+    size.div_ceil(CACHE_SHARDS).max(1) * CACHE_SHARDS
+}
+
+/// Whether a machine from `get` should be refreshed from carbide-api
+///
+/// True in the last `carbide-cache-refresh-ahead-secs` of its TTL, and for as long after it as
+/// it is still served. Not within `MACHINE_CACHE_REFRESH_RETRY` of a failed refresh, so while
+/// carbide-api keeps failing, packets don't each start another one.
+pub fn needs_refresh(entry: &CacheEntry) -> bool {
+    MACHINE_CACHE.needs_refresh(entry)
+}
+
+/// Refreshing the machine cached for `key` failed. It is still served until it expires.
+pub fn refresh_failed(key: &CacheKey) {
+    let mut shard = MACHINE_CACHE.shard(key).lock().unwrap();
+    if let Some(entry) = shard.peek_mut(key)
+        && matches!(entry.status, CacheEntryStatus::ValidEntry(_))
+    {
+        entry.refresh_failed = Some(Instant::now());
+    }
+}
+
 /// Insert or update an item in the cache
-pub fn put(
-    mac_address: MacAddress,
-    link_address: IpAddr,       // relay address
-    circuit_id: Option<String>, // vlan id
-    remote_id: Option<String>,
-    vendor_id: &str,
-    status: CacheEntryStatus,
-) {
-    let key = key(
-        mac_address,
-        link_address,
-        &circuit_id,
-        &remote_id,
-        vendor_id,
-    );
+pub fn put(key: CacheKey, status: CacheEntryStatus) {
     let new_entry = CacheEntry {
         timestamp: Instant::now(),
         status,
+        refresh_failed: None,
     };
-    MACHINE_CACHE.lock().unwrap().put(key, new_entry);
+    MACHINE_CACHE
+        .shard(&key)
+        .lock()
+        .unwrap()
+        .put(key, new_entry.clone());
+    MACHINE_CACHE.remember_identity(&key, &new_entry);
+    replication::cache_put(key, new_entry);
+}
+
+/// A machine resolved for `key` in the last `carbide-cache-identity-reuse-secs`, whatever the
+/// vendor class it was resolved with
+///
+/// The entry keeps the time carbide-api answered, and should go in with `put_identity` once
+/// the machine is rebuilt for this vendor class, so reuse never outlives the window.
+pub(crate) fn get_identity(key: &CacheKey) -> Option<CacheEntry> {
+    MACHINE_CACHE.identity(key)
+}
+
+/// Insert a machine rebuilt from `get_identity`, timestamp and all
+pub(crate) fn put_identity(key: CacheKey, entry: CacheEntry) {
+    MACHINE_CACHE
+        .shard(&key)
+        .lock()
+        .unwrap()
+        .put(key, entry.clone());
+    replication::cache_put(key, entry);
+}
+
+/// Copy out every entry which hasn't expired, for the snapshot
+///
+/// Takes each shard's lock in turn. Within a shard, entries come least recently used first,
+/// so putting them back in this order keeps the LRU order.
+pub(crate) fn entries() -> Vec<(CacheKey, CacheEntry)> {
+    let mut entries = Vec::new();
+    for shard in &MACHINE_CACHE.shards {
+        let shard = shard.lock().unwrap();
+        entries.extend(
+            shard
+                .iter()
+                .rev()
+                .filter(|(_, entry)| !MACHINE_CACHE.has_expired(entry))
+                .map(|(key, entry)| (*key, entry.clone())),
+        );
+    }
+    entries
+}
+
+/// Put an entry from the snapshot back, timestamp and all
+///
+/// Returns false, leaving the cache alone, if the entry has expired since or we already have
+/// something newer for the key.
+pub(crate) fn restore(key: CacheKey, entry: CacheEntry) -> bool {
+    if MACHINE_CACHE.has_expired(&entry) {
+        return false;
+    }
+    let mut shard = MACHINE_CACHE.shard(&key).lock().unwrap();
+    if shard.contains(&key) {
+        return false;
+    }
+    shard.put(key, entry.clone());
+    drop(shard);
+    MACHINE_CACHE.remember_identity(&key, &entry);
+    true
+}
+
+/// Put an entry from the HA peer in, timestamp and all
+///
+/// Returns false, leaving the cache alone, if the entry has expired or we already have
+/// something at least as new for the key.
+pub(crate) fn replace(key: CacheKey, entry: CacheEntry) -> bool {
+    MACHINE_CACHE.replace(key, entry)
+}
+
+/// Which entries `invalidate` drops. Each field which is set has to match.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct CacheMatch {
+    pub mac_address: Option<[u8; 6]>,
+    pub link_address: Option<IpAddr>,
+    /// FNV-1a hash, as in `CacheKey`
+    pub circuit_id: Option<u64>,
+}
+
+impl CacheMatch {
+    fn matches(&self, key: &CacheKey) -> bool {
+        self.mac_address
+            .is_none_or(|mac_address| key.mac_address == mac_address)
+            && self
+                .link_address
+                .is_none_or(|link_address| key.link_address == link_address)
+            && self
+                .circuit_id
+                .is_none_or(|circuit_id| key.circuit_id == circuit_id)
+    }
+}
+
+/// Drop every entry, without telling the HA peer. Returns how many were dropped.
+pub(crate) fn flush() -> usize {
+    MACHINE_CACHE.flush()
+}
+
+/// Drop every entry because the config their responses were built from changed
+///
+/// Cached machines keep the next-server, filename and option servers of the config they were
+/// fetched under, and Kea attaches option sets built from them. Does nothing before the cache
+/// is first used, so setting these at load doesn't build it early. The HA peer gets its own
+/// config change.
+pub(crate) fn response_config_changed() {
+    if CACHE_STARTED.load(Ordering::Acquire) {
+        let flushed = flush();
+        log::info!("response config changed, flushed {flushed} entries from the machine cache");
+    }
+}
+
+/// Drop the entries `matching`, without telling the HA peer. Returns how many were dropped.
+pub(crate) fn invalidate(matching: &CacheMatch) -> usize {
+    MACHINE_CACHE.invalidate(|key| matching.matches(key))
+}
+
+/// Which entries `carbide_cache_invalidate` drops. Each field which is set has to match.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct CacheInvalidation {
+    /// Absent matches any MAC address, otherwise it must be 6 bytes
+    pub mac_address: ByteView,
+    /// The relay's address, or the link selection sub-option if it sent one. 0 matches any.
+    pub link_address: u32,
+    /// Absent matches any circuit id, or none
+    pub circuit_id: ByteView,
+}
+
+/// What's in the cache, for `carbide-cache-stats`
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct CacheStats {
+    pub capacity: u64,
+    /// Machines, including those being served past their TTL
+    pub valid: u64,
+    /// Failed discoveries which are still retried
+    pub failing: u64,
+    /// Discoveries which failed too often to retry until the negative TTL is up
+    pub failed: u64,
+    /// Lookups since the hook was loaded, as in carbide-dhcp.cache_lookups
+    pub hits: u64,
+    pub misses: u64,
+    pub negative_hits: u64,
+}
+
+/// Drop every entry, so every client's next packet asks carbide-api
+///
+/// Returns how many entries were dropped.
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_cache_flush() -> u64 {
+    let flushed = flush();
+    log::info!("flushed {flushed} entries from the machine cache");
+    replication::cache_flushed();
+    flushed as u64
+}
+
+/// Drop every entry matching `request`, see `CacheInvalidation`
+///
+/// Returns how many entries were dropped. Drops nothing if `request` is null, has a MAC address
+/// which isn't 6 bytes or matches everything; that's what `carbide_cache_flush` is for.
+///
+/// # Safety
+///
+/// `request` must be a null pointer or a valid `CacheInvalidation`, see `ByteView`.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn carbide_cache_invalidate(request: *const CacheInvalidation) -> u64 {
+    let Some(request) = (unsafe { request.as_ref() }) else {
+        return 0;
+    };
+    let mac_address = match unsafe { request.mac_address.as_bytes() } {
+        None => None,
+        Some(bytes) => match <[u8; 6]>::try_from(bytes) {
+            Ok(mac_address) => Some(mac_address),
+            Err(_) => return 0,
+        },
+    };
+    let link_address =
+        (request.link_address != 0).then(|| IpAddr::V4(Ipv4Addr::from(request.link_address)));
+    let circuit_id = unsafe { request.circuit_id.as_bytes() }.map(fnv1a);
+    if mac_address.is_none() && link_address.is_none() && circuit_id.is_none() {
+        return 0;
+    }
+
+    let matching = CacheMatch {
+        mac_address,
+        link_address,
+        circuit_id,
+    };
+    let invalidated = invalidate(&matching);
+    log::info!(
+        "invalidated {invalidated} entries from the machine cache, mac={:?} link={link_address:?}",
+        mac_address.map(MacAddress::new)
+    );
+    replication::cache_invalidated(matching);
+    invalidated as u64
+}
+
+/// Count what's in the cache. Takes each shard's lock in turn.
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_cache_stats() -> CacheStats {
+    CacheStats {
+        hits: metrics::cache_lookups(CacheLookup::Hit),
+        misses: metrics::cache_lookups(CacheLookup::Miss),
+        negative_hits: metrics::cache_lookups(CacheLookup::NegativeHit),
+        ..MACHINE_CACHE.stats()
+    }
 }
 
 //
 // Internals
 //
 
-// Unique identifier for this entry
-fn key(
-    mac_address: MacAddress,
-    link_address: IpAddr,
-    circuit_id: &Option<String>,
-    remote_id: &Option<String>,
-    vendor_id: &str,
-) -> String {
-    format!(
-        "{}_{}_{}_{}_{}",
-        mac_address,
-        link_address,
-        match circuit_id {
-            Some(cid) => cid.as_str(),
-            None => "",
-        },
-        match remote_id {
-            Some(rid) => rid.as_str(),
-            None => "",
-        },
-        vendor_id,
-    )
+// 64-bit FNV-1a, cheap and good enough to tell option 82 strings apart
+fn fnv1a(s: impl AsRef<[u8]>) -> u64 {
+    const OFFSET_BASIS: u64 = 0xcbf2_9ce4_8422_2325;
+    const PRIME: u64 = 0x0000_0100_0000_01b3;
+    s.as_ref().iter().fold(OFFSET_BASIS, |hash, &byte| {
+        (hash ^ u64::from(byte)).wrapping_mul(PRIME)
+    })
 }
 
-impl CacheEntry {
-    fn has_expired(&self) -> bool {
-        match &self.status {
+impl MachineCache {
+    fn new(
+        size: usize,
+        ttl: Duration,
+        negative_ttl: Duration,
+        refresh_ahead: Duration,
+        max_stale: Duration,
+        identity_reuse: Duration,
+    ) -> Self {
+        let shard_size =
+            NonZeroUsize::new(size.div_ceil(CACHE_SHARDS)).unwrap_or(NonZeroUsize::MIN);
+        let new_shards = || {
+            (0..CACHE_SHARDS)
+                .map(|_| Mutex::new(LruCache::new(shard_size)))
+                .collect()
+        };
+        Self {
+            shards: new_shards(),
+            identities: if identity_reuse.is_zero() {
+                Vec::new()
+            } else {
+                new_shards()
+            },
+            hasher: RandomState::new(),
+            ttl,
+            negative_ttl,
+            refresh_ahead,
+            max_stale,
+            // Never older than what the cache itself would serve
+            identity_reuse: identity_reuse.min(ttl),
+        }
+    }
+
+    fn shard(&self, key: &CacheKey) -> &Mutex<LruCache<CacheKey, CacheEntry>> {
+        &self.shards[self.hasher.hash_one(key) as usize % CACHE_SHARDS]
+    }
+
+    fn identity_shard(&self, key: &CacheKey) -> &Mutex<LruCache<CacheKey, CacheEntry>> {
+        &self.identities[self.hasher.hash_one(key) as usize % CACHE_SHARDS]
+    }
+
+    fn remember_identity(&self, key: &CacheKey, entry: &CacheEntry) {
+        if self.identities.is_empty() || !matches!(entry.status, CacheEntryStatus::ValidEntry(_)) {
+            return;
+        }
+        let key = identity_key(key);
+        let mut shard = self.identity_shard(&key).lock().unwrap();
+        if shard
+            .peek(&key)
+            .is_some_and(|current| current.timestamp >= entry.timestamp)
+        {
+            return;
+        }
+        shard.put(key, entry.clone());
+    }
+
+    fn identity(&self, key: &CacheKey) -> Option<CacheEntry> {
+        if self.identities.is_empty() {
+            return None;
+        }
+        let key = identity_key(key);
+        let mut shard = self.identity_shard(&key).lock().unwrap();
+        let entry = shard.get(&key)?.clone();
+        if entry.timestamp.elapsed() >= self.identity_reuse {
+            shard.pop(&key);
+            return None;
+        }
+        Some(entry)
+    }
+
+    fn has_expired(&self, entry: &CacheEntry) -> bool {
+        match &entry.status {
             CacheEntryStatus::ValidEntry(_machine) => {
-                self.timestamp.elapsed() >= MACHINE_CACHE_TIMEOUT
+                entry.timestamp.elapsed() >= self.ttl.saturating_add(self.max_stale)
+            }
+            _ => entry.timestamp.elapsed() >= self.negative_ttl,
+        }
+    }
+
+    fn flush(&self) -> usize {
+        for shard in &self.identities {
+            shard.lock().unwrap().clear();
+        }
+        self.shards
+            .iter()
+            .map(|shard| {
+                let mut shard = shard.lock().unwrap();
+                let flushed = shard.len();
+                shard.clear();
+                flushed
+            })
+            .sum()
+    }
+
+    fn replace(&self, key: CacheKey, entry: CacheEntry) -> bool {
+        if self.has_expired(&entry) {
+            return false;
+        }
+        let mut shard = self.shard(&key).lock().unwrap();
+        if shard
+            .peek(&key)
+            .is_some_and(|current| current.timestamp >= entry.timestamp)
+        {
+            return false;
+        }
+        shard.put(key, entry.clone());
+        drop(shard);
+        self.remember_identity(&key, &entry);
+        true
+    }
+
+    fn invalidate(&self, matches: impl Fn(&CacheKey) -> bool) -> usize {
+        // The index is keyed on the same fields, except the vendor class
+        for shard in &self.identities {
+            pop_matching(shard, &matches);
+        }
+        self.shards
+            .iter()
+            .map(|shard| pop_matching(shard, &matches))
+            .sum()
+    }
+
+    // Only what the cache itself knows, the lookup counts are in metrics.rs
+    fn stats(&self) -> CacheStats {
+        let mut stats = CacheStats::default();
+        for shard in &self.shards {
+            let shard = shard.lock().unwrap();
+            stats.capacity += shard.cap().get() as u64;
+            for (_, entry) in shard.iter().filter(|(_, entry)| !self.has_expired(entry)) {
+                match entry.status {
+                    CacheEntryStatus::ValidEntry(_) => stats.valid += 1,
+                    CacheEntryStatus::DiscoveryFailing(_) => stats.failing += 1,
+                    CacheEntryStatus::DiscoveryFailed => stats.failed += 1,
+                }
             }
-            _ => self.timestamp.elapsed() >= MACHINE_DISC_FAILED_CACHE_TIMEOUT,
         }
+        stats
+    }
+
+    fn needs_refresh(&self, entry: &CacheEntry) -> bool {
+        match &entry.status {
+            CacheEntryStatus::ValidEntry(_machine) => {
+                entry.timestamp.elapsed() >= self.ttl.saturating_sub(self.refresh_ahead)
+                    && entry
+                        .refresh_failed
+                        .is_none_or(|failed| failed.elapsed() >= MACHINE_CACHE_REFRESH_RETRY)
+            }
+            _ => false,
+        }
+    }
+}
+
+// Drop the entries of one shard `matches`, returns how many
+fn pop_matching(
+    shard: &Mutex<LruCache<CacheKey, CacheEntry>>,
+    matches: &impl Fn(&CacheKey) -> bool,
+) -> usize {
+    let mut shard = shard.lock().unwrap();
+    let keys: Vec<CacheKey> = shard
+        .iter()
+        .map(|(key, _)| *key)
+        .filter(|key| matches(key))
+        .collect();
+    for key in &keys {
+        shard.pop(key);
+    }
+    keys.len()
+}
+
+// The key in the identity index, the same one whatever vendor class the client sends
+fn identity_key(key: &CacheKey) -> CacheKey {
+    CacheKey {
+        vendor_id: 0,
+        ..*key
     }
 }
 
@@ -173,3 +664,272 @@ impl CacheEntryStatus {
         }
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use std::net::Ipv4Addr;
+
+    use super::*;
+    use crate::discovery::Discovery;
+    use crate::mock_api_server;
+
+    const MAC_BYTES: [u8; 6] = [2, 66, 172, 20, 0, 42];
+    const RELAY: IpAddr = IpAddr::V4(Ipv4Addr::new(172, 20, 0, 11));
+
+    #[test]
+    fn test_cache_key_rejects_unusable_packets() {
+        let mac = MacAddress::new(MAC_BYTES);
+        let circuit_id = Some("eth0".to_string());
+        assert!(CacheKey::new(mac, RELAY, &circuit_id, &None, "PXEClient").is_some());
+        assert!(CacheKey::new(MacAddress::new([0; 6]), RELAY, &circuit_id, &None, "").is_none());
+        assert!(CacheKey::new(MacAddress::new([0xff; 6]), RELAY, &circuit_id, &None, "").is_none());
+        assert!(
+            CacheKey::new(
+                mac,
+                IpAddr::V4(Ipv4Addr::UNSPECIFIED),
+                &circuit_id,
+                &None,
+                ""
+            )
+            .is_none()
+        );
+    }
+
+    #[test]
+    fn test_cache_key_tells_fields_apart() {
+        let mac = MacAddress::new(MAC_BYTES);
+        let eth0 = Some("eth0".to_string());
+        let eth1 = Some("eth1".to_string());
+        let empty = Some(String::new());
+        let key = CacheKey::new(mac, RELAY, &eth0, &None, "").unwrap();
+
+        assert_eq!(key, CacheKey::new(mac, RELAY, &eth0, &None, "").unwrap());
+        assert_ne!(key, CacheKey::new(mac, RELAY, &eth1, &None, "").unwrap());
+        // Same string as remote id rather than circuit id
+        assert_ne!(key, CacheKey::new(mac, RELAY, &None, &eth0, "").unwrap());
+        // Present but empty is not the same as missing
+        assert_ne!(
+            CacheKey::new(mac, RELAY, &empty, &None, "").unwrap(),
+            CacheKey::new(mac, RELAY, &None, &None, "").unwrap()
+        );
+        assert_ne!(
+            key,
+            CacheKey::new(mac, RELAY, &eth0, &None, "PXEClient").unwrap()
+        );
+    }
+
+    // Every shard gets the same share, and at least one entry
+    #[test]
+    fn test_cache_capacity() {
+        assert_eq!(capacity(0), CACHE_SHARDS);
+        assert_eq!(capacity(1), CACHE_SHARDS);
+        assert_eq!(capacity(CACHE_SHARDS), CACHE_SHARDS);
+        assert_eq!(capacity(1000), 1008);
+        assert_eq!(capacity(1008), 1008);
+    }
+
+    // Fresh, then refreshed while still served, then served stale, then gone
+    #[test]
+    fn test_cache_refresh_window() {
+        let cache = MachineCache::new(
+            1,
+            Duration::from_secs(60),
+            Duration::from_secs(300),
+            Duration::from_secs(10),
+            Duration::from_secs(30),
+            Duration::ZERO,
+        );
+        let mac_address = MacAddress::new(MAC_BYTES);
+        let discovery = Discovery {
+            relay_address: Ipv4Addr::new(172, 20, 0, 11),
+            mac_address,
+            _client_system: None,
+            vendor_class: None,
+            link_select_address: None,
+            circuit_id: None,
+            remote_id: None,
+            desired_address: None,
+        };
+        let record = mock_api_server::dhcp_record(&mac_address.to_string());
+        let machine = Arc::new(Machine::new(record, discovery, None));
+        let aged = |secs, status: &CacheEntryStatus| CacheEntry {
+            timestamp: Instant::now() - Duration::from_secs(secs),
+            status: status.clone(),
+            refresh_failed: None,
+        };
+        let valid = CacheEntryStatus::ValidEntry(machine);
+
+        for (age, needs_refresh, expired) in [
+            (0, false, false),
+            (55, true, false),
+            (75, true, false),
+            (95, true, true),
+        ] {
+            let entry = aged(age, &valid);
+            assert_eq!(cache.needs_refresh(&entry), needs_refresh, "age {age}");
+            assert_eq!(cache.has_expired(&entry), expired, "age {age}");
+        }
+        // A refresh which just failed isn't tried again right away
+        let mut refresh_failed = aged(55, &valid);
+        refresh_failed.refresh_failed = Some(Instant::now());
+        assert!(!cache.needs_refresh(&refresh_failed));
+        refresh_failed.refresh_failed = Some(Instant::now() - MACHINE_CACHE_REFRESH_RETRY);
+        assert!(cache.needs_refresh(&refresh_failed));
+        // Failures are never refreshed, they go to carbide-api when they expire
+        let failing = aged(55, &CacheEntryStatus::DiscoveryFailing(1));
+        assert!(!cache.needs_refresh(&failing));
+        assert!(!cache.has_expired(&failing));
+    }
+
+    #[test]
+    fn test_cache_invalidate_and_stats() {
+        let cache = MachineCache::new(
+            64,
+            Duration::from_secs(60),
+            Duration::from_secs(300),
+            Duration::ZERO,
+            Duration::ZERO,
+            Duration::ZERO,
+        );
+        let other_relay = IpAddr::V4(Ipv4Addr::new(172, 20, 1, 11));
+        let eth0 = Some("eth0".to_string());
+        let eth1 = Some("eth1".to_string());
+        let keys = [
+            CacheKey::new(MacAddress::new(MAC_BYTES), RELAY, &eth0, &None, "").unwrap(),
+            CacheKey::new(MacAddress::new(MAC_BYTES), RELAY, &eth1, &None, "").unwrap(),
+            CacheKey::new(MacAddress::new(MAC_BYTES), other_relay, &eth0, &None, "").unwrap(),
+            CacheKey::new(
+                MacAddress::new([2, 66, 172, 20, 0, 43]),
+                RELAY,
+                &None,
+                &None,
+                "",
+            )
+            .unwrap(),
+        ];
+        for key in keys {
+            cache.shard(&key).lock().unwrap().put(
+                key,
+                CacheEntry {
+                    timestamp: Instant::now(),
+                    status: CacheEntryStatus::DiscoveryFailing(1),
+                    refresh_failed: None,
+                },
+            );
+        }
+        assert_eq!(cache.stats().failing, 4);
+
+        // Same MAC and circuit id, behind either relay
+        let eth0_hash = fnv1a("eth0");
+        assert_eq!(
+            cache.invalidate(|key| key.mac_address == MAC_BYTES && key.circuit_id == eth0_hash),
+            2
+        );
+        assert_eq!(cache.invalidate(|key| key.link_address == other_relay), 0);
+        assert_eq!(cache.stats().failing, 2);
+        assert_eq!(cache.flush(), 2);
+        assert_eq!(cache.stats().failing, 0);
+    }
+
+    // A machine is found again under another vendor class, within the window only
+    #[test]
+    fn test_cache_identity_reuse() {
+        let cache = MachineCache::new(
+            64,
+            Duration::from_secs(60),
+            Duration::from_secs(300),
+            Duration::ZERO,
+            Duration::ZERO,
+            Duration::from_secs(30),
+        );
+        let mac_address = MacAddress::new(MAC_BYTES);
+        let pxe = CacheKey::new(mac_address, RELAY, &None, &None, "PXEClient").unwrap();
+        let ipxe = CacheKey::new(mac_address, RELAY, &None, &None, "iPXE").unwrap();
+        let other_relay = CacheKey::new(
+            mac_address,
+            IpAddr::V4(Ipv4Addr::new(172, 20, 1, 11)),
+            &None,
+            &None,
+            "iPXE",
+        )
+        .unwrap();
+        let discovery = Discovery {
+            relay_address: Ipv4Addr::new(172, 20, 0, 11),
+            mac_address,
+            _client_system: None,
+            vendor_class: None,
+            link_select_address: None,
+            circuit_id: None,
+            remote_id: None,
+            desired_address: None,
+        };
+        let record = mock_api_server::dhcp_record(&mac_address.to_string());
+        let valid = CacheEntryStatus::ValidEntry(Arc::new(Machine::new(record, discovery, None)));
+        let aged = |secs, status: &CacheEntryStatus| CacheEntry {
+            timestamp: Instant::now() - Duration::from_secs(secs),
+            status: status.clone(),
+            refresh_failed: None,
+        };
+
+        // Failures aren't an identity
+        cache.remember_identity(&pxe, &aged(0, &CacheEntryStatus::DiscoveryFailing(1)));
+        assert!(cache.identity(&ipxe).is_none());
+
+        cache.remember_identity(&pxe, &aged(10, &valid));
+        assert!(cache.identity(&ipxe).is_some());
+        assert!(cache.identity(&other_relay).is_none());
+        // An older answer doesn't replace a newer one
+        cache.remember_identity(&pxe, &aged(40, &valid));
+        assert!(cache.identity(&ipxe).is_some());
+
+        assert_eq!(cache.invalidate(|key| key.mac_address == MAC_BYTES), 0);
+        assert!(cache.identity(&ipxe).is_none());
+        // Too old to reuse
+        cache.remember_identity(&pxe, &aged(40, &valid));
+        assert!(cache.identity(&ipxe).is_none());
+
+        let off = MachineCache::new(
+            64,
+            Duration::from_secs(60),
+            Duration::from_secs(300),
+            Duration::ZERO,
+            Duration::ZERO,
+            Duration::ZERO,
+        );
+        off.remember_identity(&pxe, &aged(0, &valid));
+        assert!(off.identity(&ipxe).is_none());
+    }
+
+    // An entry from the HA peer only replaces an older one, and keeps its age
+    #[test]
+    fn test_cache_replace_keeps_newer() {
+        let cache = MachineCache::new(
+            64,
+            Duration::from_secs(60),
+            Duration::from_secs(300),
+            Duration::ZERO,
+            Duration::ZERO,
+            Duration::ZERO,
+        );
+        let key = CacheKey::new(MacAddress::new(MAC_BYTES), RELAY, &None, &None, "").unwrap();
+        let aged = |secs, status| CacheEntry {
+            timestamp: Instant::now() - Duration::from_secs(secs),
+            status,
+            refresh_failed: None,
+        };
+
+        assert!(cache.replace(key, aged(20, CacheEntryStatus::DiscoveryFailing(1))));
+        assert!(cache.replace(key, aged(10, CacheEntryStatus::DiscoveryFailing(2))));
+        assert!(!cache.replace(key, aged(30, CacheEntryStatus::DiscoveryFailed)));
+        assert!(!cache.replace(key, aged(400, CacheEntryStatus::DiscoveryFailed)));
+        assert!(matches!(
+            cache
+                .shard(&key)
+                .lock()
+                .unwrap()
+                .peek(&key)
+                .map(|entry| &entry.status),
+            Some(CacheEntryStatus::DiscoveryFailing(2))
+        ));
+    }
+}
@@ -14,16 +14,24 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+use std::collections::HashMap;
 use std::ffi::{CStr, c_char};
 use std::net::{IpAddr, Ipv4Addr};
+use std::sync::{Arc, Mutex};
 
 use derive_builder::Builder;
+use lazy_static::lazy_static;
 use mac_address::MacAddress;
+use opentelemetry::Context;
+use opentelemetry::trace::FutureExt;
+use tokio::sync::OnceCell;
 
+use crate::cache::CacheKey;
 use crate::machine::Machine;
-use crate::metrics::set_service_healthy;
+use crate::metrics::{ApiRequestInFlight, PipelineStage, StageTimer, set_service_healthy};
+use crate::trace::{self, PacketTrace};
 use crate::vendor_class::VendorClass;
-use crate::{CONFIG, CarbideDhcpContext, cache, tls};
+use crate::{CONFIG, CarbideDhcpContext, admission, api_client, cache};
 
 /// Enumerates results of setting discovery options on the Builder
 #[repr(C)]
@@ -38,6 +46,10 @@ pub enum DiscoveryBuilderResult {
     FetchMachineError = 6,
     InvalidCircuitId = 7,
     TooManyFailuresError = 8,
+    /// carbide-api is failing, see admission.rs
+    ApiUnavailable = 9,
+    /// carbide-api took longer than `carbide-api-deadline-ms`
+    ApiDeadlineExceeded = 10,
 }
 
 #[unsafe(no_mangle)]
@@ -57,6 +69,8 @@ pub extern "C" fn discovery_builder_result_as_str(result: DiscoveryBuilderResult
             DiscoveryBuilderResult::FetchMachineError => "FetchMachineError\0",
             DiscoveryBuilderResult::InvalidCircuitId => "InvalidCircuitId\0",
             DiscoveryBuilderResult::TooManyFailuresError => "TooManyFailuresError\0",
+            DiscoveryBuilderResult::ApiUnavailable => "ApiUnavailable\0",
+            DiscoveryBuilderResult::ApiDeadlineExceeded => "ApiDeadlineExceeded\0",
         }
         .as_bytes(),
     )
@@ -91,6 +105,109 @@ pub struct Discovery {
 #[repr(C)]
 pub struct DiscoveryBuilderFFI(());
 
+/// Bytes borrowed from the packet, usually an option's data
+///
+/// A null `ptr` means the packet didn't have it. Present but empty is a non-null `ptr` with
+/// `len` 0.
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct ByteView {
+    pub ptr: *const u8,
+    pub len: usize,
+}
+
+impl ByteView {
+    /// # Safety
+    ///
+    /// A non-null `ptr` must point to `len` readable bytes.
+    pub(crate) unsafe fn as_bytes(&self) -> Option<&[u8]> {
+        if self.ptr.is_null() {
+            None
+        } else {
+            Some(unsafe { std::slice::from_raw_parts(self.ptr, self.len) })
+        }
+    }
+
+    /// # Safety
+    ///
+    /// As `as_bytes`
+    unsafe fn to_utf8_string(
+        self,
+        name: &str,
+        invalid: DiscoveryBuilderResult,
+    ) -> Result<Option<String>, DiscoveryBuilderResult> {
+        match unsafe { self.as_bytes() }.map(std::str::from_utf8) {
+            None => Ok(None),
+            Some(Ok(string)) => Ok(Some(string.to_owned())),
+            Some(Err(error)) => {
+                log::error!("Invalid UTF-8 byte string for {name}: {error}");
+                Err(invalid)
+            }
+        }
+    }
+}
+
+/// Everything pkt4_receive reads from the packet, in one go
+///
+/// The views point into Kea's packet and are only read during the call they are passed to.
+/// Strings are copied once, into the `Discovery`. Addresses are IPv4, as big endian ints,
+/// with 0 meaning the packet didn't have one.
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct DiscoveryRequest {
+    /// giaddr
+    pub relay_address: u32,
+    pub mac_address: ByteView,
+    /// Option 82 sub-option 5
+    pub link_select_address: u32,
+    /// Option 82 sub-option 1
+    pub circuit_id: ByteView,
+    /// Option 82 sub-option 2
+    pub remote_id: ByteView,
+    /// Option 60
+    pub vendor_class: ByteView,
+    /// Option 50
+    pub desired_address: u32,
+    /// Option 93, only if `has_client_system`
+    pub client_system: u16,
+    pub has_client_system: bool,
+    /// From `carbide_trace_start`, null if the packet isn't traced
+    pub trace: *const PacketTrace,
+}
+
+impl Discovery {
+    /// # Safety
+    ///
+    /// The views in `request` must be valid, see `ByteView`.
+    pub(crate) unsafe fn from_request(
+        request: &DiscoveryRequest,
+    ) -> Result<Self, DiscoveryBuilderResult> {
+        let mac_address: [u8; 6] = unsafe { request.mac_address.as_bytes() }
+            .and_then(|bytes| bytes.try_into().ok())
+            .ok_or(DiscoveryBuilderResult::InvalidMacAddress)?;
+        let address = |addr: u32| (addr != 0).then_some(Ipv4Addr::from(addr));
+
+        unsafe {
+            Ok(Discovery {
+                relay_address: Ipv4Addr::from(request.relay_address),
+                mac_address: MacAddress::new(mac_address),
+                _client_system: request.has_client_system.then_some(request.client_system),
+                vendor_class: request
+                    .vendor_class
+                    .to_utf8_string("vendor_class", DiscoveryBuilderResult::InvalidVendorClass)?,
+                link_select_address: address(request.link_select_address),
+                circuit_id: request
+                    .circuit_id
+                    .to_utf8_string("circuit_id", DiscoveryBuilderResult::InvalidCircuitId)?,
+                remote_id: request
+                    .remote_id
+                    .to_utf8_string("remote_id", DiscoveryBuilderResult::InvalidCircuitId)?,
+                desired_address: address(request.desired_address).map(|addr| addr.to_string()),
+            })
+        }
+    }
+}
+
 /// Allocate a new struct to fill in the discovery information from the DHCP packet in Kea
 ///
 /// This is an "opaque" pointer to rust data, which must be freed by rust data, and to keep the FFI
@@ -99,13 +216,18 @@ pub struct DiscoveryBuilderFFI(());
 ///
 /// The returned object must either be consumed by calling
 /// `discovery_fetch_machine`, or freed by calling `discovery_builder_free`.
+///
+/// The builder functions are only built for the tests, and the benches with the
+/// `bench-hooks` feature. pkt4_receive uses `discovery_fetch_machine_for`.
+#[cfg(any(test, feature = "bench-hooks"))]
 #[unsafe(no_mangle)]
 #[allow(clippy::box_default)] // the Builder does not and cannot implement default, but clippy wants it to because they named the generated function "default".
 pub extern "C" fn discovery_builder_allocate() -> *mut DiscoveryBuilderFFI {
     Box::into_raw(Box::new(DiscoveryBuilder::default())) as _
 }
 
-unsafe fn marshal_discovery_ffi<F>(
+#[cfg(any(test, feature = "bench-hooks"))]
+pub(crate) unsafe fn marshal_discovery_ffi<F>(
     builder: *mut DiscoveryBuilderFFI,
     f: F,
 ) -> DiscoveryBuilderResult
@@ -130,6 +252,7 @@ where
 /// This function is only safe to be called on a `ctx` which is either a null pointer
 /// or a valid `DiscoveryBuilderFFI` object.
 ///
+#[cfg(any(test, feature = "bench-hooks"))]
 #[unsafe(no_mangle)]
 pub unsafe extern "C" fn discovery_set_client_system(
     ctx: *mut DiscoveryBuilderFFI,
@@ -150,6 +273,7 @@ pub unsafe extern "C" fn discovery_set_client_system(
 /// This function is only safe to be called on a `ctx` which is either a null pointer
 /// or a valid `DiscoveryBuilderFFI` object.
 ///
+#[cfg(any(test, feature = "bench-hooks"))]
 #[unsafe(no_mangle)]
 pub unsafe extern "C" fn discovery_set_vendor_class(
     ctx: *mut DiscoveryBuilderFFI,
@@ -178,6 +302,7 @@ pub unsafe extern "C" fn discovery_set_vendor_class(
 /// This function is only safe to be called on a `ctx` which is either a null pointer
 /// or a valid `DiscoveryBuilderFFI` object.
 ///
+#[cfg(any(test, feature = "bench-hooks"))]
 #[unsafe(no_mangle)]
 pub unsafe extern "C" fn discovery_set_link_select(
     ctx: *mut DiscoveryBuilderFFI,
@@ -191,6 +316,7 @@ pub unsafe extern "C" fn discovery_set_link_select(
     }
 }
 
+#[cfg(any(test, feature = "bench-hooks"))]
 #[unsafe(no_mangle)]
 pub unsafe extern "C" fn discovery_set_desired_address(
     ctx: *mut DiscoveryBuilderFFI,
@@ -219,6 +345,7 @@ pub unsafe extern "C" fn discovery_set_desired_address(
 /// This function is only safe to be called on a `ctx` which is either a null pointer
 /// or a valid `DiscoveryBuilderFFI` object.
 ///
+#[cfg(any(test, feature = "bench-hooks"))]
 #[unsafe(no_mangle)]
 pub unsafe extern "C" fn discovery_set_circuit_id(
     ctx: *mut DiscoveryBuilderFFI,
@@ -247,6 +374,7 @@ pub unsafe extern "C" fn discovery_set_circuit_id(
 /// This function is only safe to be called on a `ctx` which is either a null pointer
 /// or a valid `DiscoveryBuilderFFI` object.
 ///
+#[cfg(any(test, feature = "bench-hooks"))]
 #[unsafe(no_mangle)]
 pub unsafe extern "C" fn discovery_set_remote_id(
     ctx: *mut DiscoveryBuilderFFI,
@@ -275,6 +403,7 @@ pub unsafe extern "C" fn discovery_set_remote_id(
 /// This function is only safe to be called on a `ctx` which is either a null pointer
 /// or a valid `DiscoveryBuilderFFI` object.
 ///
+#[cfg(any(test, feature = "bench-hooks"))]
 #[unsafe(no_mangle)]
 pub unsafe extern "C" fn discovery_set_relay(
     ctx: *mut DiscoveryBuilderFFI,
@@ -298,6 +427,7 @@ pub unsafe extern "C" fn discovery_set_relay(
 /// `raw_parts` and `size` must describe a valid memory holding 6 bytes which make
 /// up a MAC address.
 ///
+#[cfg(any(test, feature = "bench-hooks"))]
 #[unsafe(no_mangle)]
 pub unsafe extern "C" fn discovery_set_mac_address(
     ctx: *mut DiscoveryBuilderFFI,
@@ -332,19 +462,18 @@ pub unsafe extern "C" fn discovery_set_mac_address(
 ///
 /// This function is only safe to be called on a `ctx` which is either a null pointer
 /// or a valid `DiscoveryBuilderFFI` object.
+#[cfg(any(test, feature = "bench-hooks"))]
 #[unsafe(no_mangle)]
 pub unsafe extern "C" fn discovery_fetch_machine(
     ctx: *mut DiscoveryBuilderFFI,
     machine_ptr_out: *mut *mut Machine,
 ) -> DiscoveryBuilderResult {
-    let url = &CONFIG
-        .read()
-        .unwrap() // TODO(ajf): don't unwrap
-        .api_endpoint;
+    let config = CONFIG.load();
 
-    unsafe { discovery_fetch_machine_at(ctx, machine_ptr_out, url) }
+    unsafe { discovery_fetch_machine_at(ctx, machine_ptr_out, &config.api_endpoint) }
 }
 
+#[cfg(any(test, feature = "bench-hooks"))]
 unsafe fn discovery_fetch_machine_at(
     ctx: *mut DiscoveryBuilderFFI,
     machine_ptr_out: *mut *mut Machine,
@@ -357,146 +486,402 @@ unsafe fn discovery_fetch_machine_at(
         *machine_ptr_out = std::ptr::null_mut();
 
         marshal_discovery_ffi(ctx, |builder| {
-            let discovery = match builder.build() {
-                Ok(discovery) => discovery,
-                Err(err) => {
-                    log::info!("Error compiling the discovery builder object: {err}");
-                    return DiscoveryBuilderResult::BuilderError;
-                }
-            };
+            fetch_machine(lookup(builder), machine_ptr_out, url)
+        })
+    }
+}
 
-            let mac_address = discovery.mac_address;
-            let circuit_id = discovery.circuit_id.clone();
-            let remote_id = discovery.remote_id.clone();
-            let desired_address = discovery.desired_address.clone();
-            let addr_for_dhcp = IpAddr::V4(
-                discovery
-                    .link_select_address
-                    .unwrap_or(discovery.relay_address),
-            );
+/// As `discovery_fetch_machine`, for a discovery read straight from the packet rather than
+/// built up with the `discovery_set_*` functions
+///
+/// # Safety
+///
+/// `request` must be a null pointer or a valid `DiscoveryRequest`, see `ByteView`.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn discovery_fetch_machine_for(
+    request: *const DiscoveryRequest,
+    machine_ptr_out: *mut *mut Machine,
+) -> DiscoveryBuilderResult {
+    let config = CONFIG.load();
 
-            // try to parse request vendor class identifier
-            let vendor_class = match discovery.vendor_class {
-                Some(ref vendor_class) => match vendor_class.parse::<VendorClass>() {
-                    Ok(vc) => Some(vc),
-                    Err(err) => {
-                        log::warn!("error parsing vendor class: {vendor_class} {err:?}");
-                        return DiscoveryBuilderResult::InvalidVendorClass;
-                    }
-                },
-                None => None,
-            };
-            let vendor_id = match &vendor_class {
-                Some(vc) => vc.id.as_str(),
-                None => "",
-            };
+    unsafe { discovery_fetch_machine_for_at(request, machine_ptr_out, &config.api_endpoint) }
+}
 
-            let desired_ip = match &desired_address {
-                Some(di) => di.as_str(),
-                None => "",
-            };
+unsafe fn discovery_fetch_machine_for_at(
+    request: *const DiscoveryRequest,
+    machine_ptr_out: *mut *mut Machine,
+    url: &str,
+) -> DiscoveryBuilderResult {
+    unsafe {
+        if machine_ptr_out.is_null() {
+            return DiscoveryBuilderResult::InvalidMachinePointer;
+        }
+        *machine_ptr_out = std::ptr::null_mut();
+        if request.is_null() {
+            return DiscoveryBuilderResult::InvalidDiscoveryBuilderPointer;
+        }
 
-            let mut cache_entry_status = cache::CacheEntryStatus::DiscoveryFailing(0);
-            if let Some(cache_entry) = cache::get(
-                mac_address,
-                addr_for_dhcp,
-                &circuit_id,
-                &remote_id,
-                vendor_id,
-            ) {
-                // We return the cached response if it's a positive cache entry, or an error if it's a negative one.
-                match cache_entry.status {
-                    cache::CacheEntryStatus::ValidEntry(machine) => {
-                        log::info!(
-                            "returning cached response for ({mac_address}, {addr_for_dhcp}, {circuit_id:?}, {vendor_id} {desired_ip})."
-                        );
-                        *machine_ptr_out = Box::into_raw(machine);
-                        return DiscoveryBuilderResult::Success;
-                    }
-                    cache::CacheEntryStatus::DiscoveryFailing(count) => {
-                        log::info!(
-                            "retrying carbide-api for ({mac_address}, {addr_for_dhcp}, {circuit_id:?}, {vendor_id} {desired_ip}). failure count: {count}."
-                        );
-                        cache_entry_status = cache_entry.status;
-                    }
-                    cache::CacheEntryStatus::DiscoveryFailed => {
-                        log::info!(
-                            "too many failures for ({mac_address}, {addr_for_dhcp}, {circuit_id:?}, {vendor_id} {desired_ip})."
-                        );
-                        return DiscoveryBuilderResult::TooManyFailuresError;
-                    }
-                }
+        // The stages below, and the RPC, are part of the packet's trace
+        let _trace = trace::packet_context((*request).trace).map(Context::attach);
+        match Discovery::from_request(&*request) {
+            Ok(discovery) => fetch_machine(lookup_discovery(discovery), machine_ptr_out, url),
+            Err(err) => err,
+        }
+    }
+}
+
+// Finish a lookup, waiting on carbide-api if it missed the cache
+unsafe fn fetch_machine(
+    lookup: Lookup,
+    machine_ptr_out: *mut *mut Machine,
+    url: &str,
+) -> DiscoveryBuilderResult {
+    let result = match lookup {
+        Lookup::Done(result) => result,
+        Lookup::Refresh(machine, fetch) => {
+            fetch.refresh(url.to_string());
+            Ok(machine)
+        }
+        // Schedule the API connection and machine retrieval on the tokio runtime and wait
+        // for it. This is required because tonic is async but this code generally is not.
+        Lookup::Fetch(fetch) => {
+            CarbideDhcpContext::run_on_runtime(fetch.run(url.to_string()).with_current_context())
+                .unwrap_or_else(|| {
+                    log::error!("discovery task panicked, api_url={url}");
+                    Err(DiscoveryBuilderResult::FetchMachineError)
+                })
+        }
+    };
+
+    match result {
+        Ok(machine) => {
+            unsafe { *machine_ptr_out = Arc::into_raw(machine) as *mut Machine };
+            DiscoveryBuilderResult::Success
+        }
+        Err(err) => err,
+    }
+}
+
+/// Where a discovery stands after looking at the packet and the cache
+pub(crate) enum Lookup {
+    /// Answered from the cache, or rejected, without talking to carbide-api
+    Done(Result<Arc<Machine>, DiscoveryBuilderResult>),
+    /// Answered from the cache, but the entry is about to expire or has, see
+    /// `cache::needs_refresh`. The fetch should go ahead in the background.
+    Refresh(Arc<Machine>, Fetch),
+    /// Needs a round trip to carbide-api
+    Fetch(Fetch),
+}
+
+/// A discovery that missed the cache, or is refreshing it
+pub(crate) struct Fetch {
+    discovery: Discovery,
+    vendor_class: Option<VendorClass>,
+    addr_for_dhcp: IpAddr,
+    /// None if the packet can't be cached, see `CacheKey::new`
+    cache_key: Option<CacheKey>,
+    /// What to cache if the fetch fails. Left alone if this is a `ValidEntry`, so a failed
+    /// refresh keeps answering from the machine we have.
+    cache_entry_status: cache::CacheEntryStatus,
+}
+
+/// Build the discovery and answer it from the cache if we can
+#[cfg(any(test, feature = "bench-hooks"))]
+pub(crate) fn lookup(builder: &DiscoveryBuilder) -> Lookup {
+    match builder.build() {
+        Ok(discovery) => lookup_discovery(discovery),
+        Err(err) => {
+            log::info!("Error compiling the discovery builder object: {err}");
+            Lookup::Done(Err(DiscoveryBuilderResult::BuilderError))
+        }
+    }
+}
+
+/// Answer the discovery from the cache if we can
+pub(crate) fn lookup_discovery(discovery: Discovery) -> Lookup {
+    let mac_address = discovery.mac_address;
+    let addr_for_dhcp = IpAddr::V4(
+        discovery
+            .link_select_address
+            .unwrap_or(discovery.relay_address),
+    );
+
+    // try to parse request vendor class identifier
+    let vendor_class = match discovery.vendor_class {
+        Some(ref vendor_class) => match vendor_class.parse::<VendorClass>() {
+            Ok(vc) => Some(vc),
+            Err(err) => {
+                log::warn!("error parsing vendor class: {vendor_class} {err:?}");
+                return Lookup::Done(Err(DiscoveryBuilderResult::InvalidVendorClass));
+            }
+        },
+        None => None,
+    };
+    let vendor_id = match &vendor_class {
+        Some(vc) => vc.id.as_str(),
+        None => "",
+    };
+
+    let circuit_id = &discovery.circuit_id;
+    let desired_ip = match &discovery.desired_address {
+        Some(di) => di.as_str(),
+        None => "",
+    };
+
+    let cache_timer = StageTimer::start(PipelineStage::CacheLookup);
+    let cache_key = CacheKey::new(
+        mac_address,
+        addr_for_dhcp,
+        circuit_id,
+        &discovery.remote_id,
+        vendor_id,
+    );
+    let mut cache_entry_status = cache::CacheEntryStatus::DiscoveryFailing(0);
+    let cache_entry = cache_key.as_ref().and_then(cache::get);
+    drop(cache_timer);
+    if let Some(cache_entry) = cache_entry {
+        // We return the cached response if it's a positive cache entry, or an error if it's a negative one.
+        let needs_refresh = cache::needs_refresh(&cache_entry);
+        match cache_entry.status {
+            cache::CacheEntryStatus::ValidEntry(machine) if needs_refresh => {
+                log::info!(
+                    "returning cached response for ({mac_address}, {addr_for_dhcp}, {circuit_id:?}, {vendor_id} {desired_ip}), refreshing it."
+                );
+                return Lookup::Refresh(
+                    machine.clone(),
+                    Fetch {
+                        discovery,
+                        vendor_class,
+                        addr_for_dhcp,
+                        cache_key,
+                        cache_entry_status: cache::CacheEntryStatus::ValidEntry(machine),
+                    },
+                );
+            }
+            cache::CacheEntryStatus::ValidEntry(machine) => {
+                log::info!(
+                    "returning cached response for ({mac_address}, {addr_for_dhcp}, {circuit_id:?}, {vendor_id} {desired_ip})."
+                );
+                return Lookup::Done(Ok(machine));
+            }
+            cache::CacheEntryStatus::DiscoveryFailing(count) => {
+                log::info!(
+                    "retrying carbide-api for ({mac_address}, {addr_for_dhcp}, {circuit_id:?}, {vendor_id} {desired_ip}). failure count: {count}."
+                );
+                cache_entry_status = cache_entry.status;
             }
+            cache::CacheEntryStatus::DiscoveryFailed => {
+                log::info!(
+                    "too many failures for ({mac_address}, {addr_for_dhcp}, {circuit_id:?}, {vendor_id} {desired_ip})."
+                );
+                return Lookup::Done(Err(DiscoveryBuilderResult::TooManyFailuresError));
+            }
+        }
+    } else if let Some(key) = cache_key
+        && let Some(identity) = cache::get_identity(&key)
+        && let cache::CacheEntryStatus::ValidEntry(resolved) = identity.status
+    {
+        // Another stage of the same boot, e.g. iPXE after firmware PXE. Same record, but the
+        // filename and options follow the vendor class this packet sent.
+        log::info!(
+            "reusing machine resolved {:?} ago for ({mac_address}, {addr_for_dhcp}, {circuit_id:?}, {vendor_id} {desired_ip}).",
+            identity.timestamp.elapsed()
+        );
+        let machine = Arc::new(Machine::from_record(
+            resolved.record.clone(),
+            discovery,
+            vendor_class,
+        ));
+        cache::put_identity(
+            key,
+            cache::CacheEntry {
+                timestamp: identity.timestamp,
+                status: cache::CacheEntryStatus::ValidEntry(machine.clone()),
+                refresh_failed: None,
+            },
+        );
+        return Lookup::Done(Ok(machine));
+    }
+
+    Lookup::Fetch(Fetch {
+        discovery,
+        vendor_class,
+        addr_for_dhcp,
+        cache_key,
+        cache_entry_status,
+    })
+}
+
+type FetchResult = Result<Arc<Machine>, DiscoveryBuilderResult>;
 
-            // Spawn a tokio runtime and schedule the API connection and machine retrieval to an async
-            // thread. This is required because tonic is async but this code generally is not.
-            //
-            // TODO(ajf): how to reason about FFI code with async.
-            //
-            let runtime: &tokio::runtime::Runtime = CarbideDhcpContext::get_tokio_runtime();
-
-            let forge_client_config = tls::build_forge_client_config();
-
-            match runtime.block_on(Machine::try_fetch(
-                discovery,
-                url,
-                vendor_class.clone(),
-                &forge_client_config,
-            )) {
-                Ok(machine) => {
-                    // If any DHCP record had been invalidated after the KEA process started,
-                    // KEAs internal cache (not the Rust cache) might be in inconsistent state.
-                    // Since we don't have any API to invalidate the KEA cache we restart
-                    // the process. This will happen very rarely, since Interface deletions
-                    // in Forge are not common.
-                    // See https://nvbugspro.nvidia.com/bug/4792034 for details
-                    if let Some(last_invalidation) = machine.inner.last_invalidation_time.as_ref() {
-                        let startup_time = CONFIG.read().unwrap().startup_time;
-
-                        if let Ok(last_invalidation) =
-                            chrono::DateTime::<chrono::Utc>::try_from(*last_invalidation)
-                            && last_invalidation >= startup_time
-                        {
-                            log::error!(
-                                "Restarting KEA since invalidation was reported by Carbide. Startup: {}. Last_Invalidation: {}",
-                                startup_time.to_rfc3339(),
-                                last_invalidation.to_rfc3339()
-                            );
-                            // Setting service status to unhealty, in case if gracefull shutdown fails, other process would need to restart it
-                            // on failed probe
-                            set_service_healthy(false);
-                            // Try to gracefully shutdown dhcp server, this would call all webhooks and properly shutdown hook library
+lazy_static! {
+    /// Fetches waiting on carbide-api, by cache key.
+    ///
+    /// A client sends several packets in quick succession, and under multi-threaded Kea more
+    /// than one of them can miss the cache before the first answer is in. Those share one RPC.
+    static ref IN_FLIGHT: Mutex<HashMap<CacheKey, Arc<OnceCell<FetchResult>>>> =
+        Mutex::new(HashMap::new());
+}
+
+impl Fetch {
+    /// Ask carbide-api at `url` for the machine and cache the answer, good or bad.
+    ///
+    /// If the same fetch is already in flight, wait for that one and return its answer
+    /// instead. Only the fetch which made the RPC updates the cache, so a failure is
+    /// counted once however many packets were waiting on it.
+    ///
+    /// Must run on the tokio runtime.
+    pub(crate) async fn run(self, url: String) -> FetchResult {
+        // Nothing to share a fetch on without a key, and nothing would be cached either
+        let Some(key) = self.cache_key else {
+            return self.fetch(url).await;
+        };
+        let cell = IN_FLIGHT.lock().unwrap().entry(key).or_default().clone();
+
+        let mut fetched_here = false;
+        let result = cell
+            .get_or_init(|| {
+                fetched_here = true;
+                self.fetch(url)
+            })
+            .await
+            .clone();
+
+        if fetched_here {
+            // The answer is in the cache now, later misses should make a new RPC
+            let mut in_flight = IN_FLIGHT.lock().unwrap();
+            if in_flight
+                .get(&key)
+                .is_some_and(|current| Arc::ptr_eq(current, &cell))
+            {
+                in_flight.remove(&key);
+            }
+        } else {
+            log::info!("shared in-flight carbide-api response for {key}");
+        }
+        result
+    }
+
+    /// Run the fetch in the background to refresh a cached machine, unless one is in flight
+    /// for it already.
+    ///
+    /// Every packet for the machine asks for this until the refresh lands, which the
+    /// in-flight check (and `run`, when two get past it at once) turns into one RPC. A failed
+    /// refresh is marked on the cache entry, so the next waits `cache::MACHINE_CACHE_REFRESH_RETRY`.
+    pub(crate) fn refresh(self, url: String) {
+        let key = self.cache_key;
+        if let Some(key) = key
+            && IN_FLIGHT.lock().unwrap().contains_key(&key)
+        {
+            return;
+        }
+        CarbideDhcpContext::get_tokio_runtime().spawn(async move {
+            if self.run(url).await.is_err()
+                && let Some(key) = key
+            {
+                cache::refresh_failed(&key);
+            }
+        });
+    }
+
+    async fn fetch(self, url: String) -> FetchResult {
+        let Fetch {
+            discovery,
+            vendor_class,
+            addr_for_dhcp,
+            cache_key,
+            cache_entry_status,
+        } = self;
+        let mac_address = discovery.mac_address;
+
+        // Neither of these is the machine's fault, so they don't count towards its failures
+        let admission = admission::admit(&url).inspect_err(|_| {
+            log::warn!(
+                "carbide-api is unavailable, not asking it about mac={mac_address} addr={addr_for_dhcp} api_url={url}"
+            );
+        })?;
+        let _in_flight = ApiRequestInFlight::start();
+        let client = api_client::get(&url);
+        let fetched = admission.run(async {
+            // Usually just hands back the open connection. Done separately so the TLS
+            // handshake, when there is one, shows up as its own stage.
+            let connected = {
+                let _timer = StageTimer::start(PipelineStage::ApiConnect);
+                client.connection().await.map(|_| ())
+            };
+            match connected {
+                Ok(()) => {
+                    let timer = StageTimer::start(PipelineStage::ApiCall);
+                    Machine::try_fetch(discovery, &client, vendor_class)
+                        .with_context(timer.context())
+                        .await
+                }
+                // Whatever stopped us connecting, carbide-api didn't get to answer
+                Err(error) => Err(tonic::Status::unavailable(format!(
+                    "unable to connect to Carbide: {}",
+                    error.message()
+                ))),
+            }
+        });
+        let Some(fetched) = fetched.await else {
+            log::error!(
+                "carbide-api took too long to answer for mac={mac_address} addr={addr_for_dhcp} api_url={url}"
+            );
+            return Err(DiscoveryBuilderResult::ApiDeadlineExceeded);
+        };
+        match fetched {
+            Ok(machine) => {
+                // If any DHCP record had been invalidated after the KEA process started,
+                // KEAs internal cache (not the Rust cache) might be in inconsistent state.
+                // Since we don't have any API to invalidate the KEA cache we restart
+                // the process. This will happen very rarely, since Interface deletions
+                // in Forge are not common.
+                // See https://nvbugspro.nvidia.com/bug/4792034 for details
+                if let Some(last_invalidation) = machine.record.last_invalidation {
+                    let startup_time = CONFIG.load().startup_time;
+
+                    if last_invalidation >= startup_time {
+                        log::error!(
+                            "Restarting KEA since invalidation was reported by Carbide. Startup: {}. Last_Invalidation: {}",
+                            startup_time.to_rfc3339(),
+                            last_invalidation.to_rfc3339()
+                        );
+                        // Setting service status to unhealty, in case if gracefull shutdown fails, other process would need to restart it
+                        // on failed probe
+                        set_service_healthy(false);
+                        // Try to gracefully shutdown dhcp server, this would call all webhooks and properly shutdown hook library
+                        unsafe {
                             libc::kill(libc::getpid(), libc::SIGTERM);
                         }
                     }
+                }
 
-                    cache::put(
-                        mac_address,
-                        addr_for_dhcp,
-                        circuit_id,
-                        remote_id,
-                        vendor_id,
-                        cache::CacheEntryStatus::ValidEntry(Box::new(machine.clone())),
-                    );
-                    *machine_ptr_out = Box::into_raw(Box::new(machine));
-                    DiscoveryBuilderResult::Success
+                let machine = Arc::new(machine);
+                if let Some(key) = cache_key {
+                    cache::put(key, cache::CacheEntryStatus::ValidEntry(machine.clone()));
                 }
-                Err(e_str) => {
-                    log::error!(
-                        "Error getting info back from the machine discovery: mac={mac_address} addr={addr_for_dhcp} err={e_str} api_url={url}"
-                    );
-                    cache::put(
-                        mac_address,
-                        addr_for_dhcp,
-                        circuit_id,
-                        remote_id,
-                        vendor_id,
-                        cache_entry_status.increment_fails(),
-                    );
-                    DiscoveryBuilderResult::FetchMachineError
+                Ok(machine)
+            }
+            Err(status) => {
+                log::error!(
+                    "Error getting info back from the machine discovery: mac={mac_address} addr={addr_for_dhcp} code={:?} err={} api_url={url}",
+                    status.code(),
+                    status.message()
+                );
+                // The connection itself might be what failed, so don't keep using it. An
+                // answer, like NotFound for an unknown MAC, shows it works.
+                if admission::is_outage(&status) {
+                    api_client::reset(&url);
+                }
+                // On a failed refresh the cached machine is still good until it expires
+                if let Some(key) = cache_key
+                    && !matches!(cache_entry_status, cache::CacheEntryStatus::ValidEntry(_))
+                {
+                    cache::put(key, cache_entry_status.increment_fails());
                 }
+                Err(DiscoveryBuilderResult::FetchMachineError)
             }
-        })
+        }
     }
 }
 
@@ -510,6 +895,7 @@ unsafe fn discovery_fetch_machine_at(
 /// This does not forget the memory afterwards, so the opaque pointer in the C code is now
 /// unusable.
 ///
+#[cfg(any(test, feature = "bench-hooks"))]
 #[unsafe(no_mangle)]
 pub unsafe extern "C" fn discovery_builder_free(ctx: *mut DiscoveryBuilderFFI) {
     unsafe {
@@ -521,6 +907,7 @@ pub unsafe extern "C" fn discovery_builder_free(ctx: *mut DiscoveryBuilderFFI) {
 mod tests {
     use std::ptr::null_mut;
     use std::thread;
+    use std::time::Duration;
 
     use super::*;
     use crate::mock_api_server;
@@ -545,8 +932,7 @@ mod tests {
     // Test the success case of calling API server and test the cache.
     #[test]
     fn test_discovery_fetch_machine_success() {
-        // Start the mock API server, spawning a task to run hyper.
-        // We call block_on in discovery_fetch_machine_at, which allows hyper to make progress.
+        // Start the mock API server, spawning a task to run hyper on the runtime's worker threads.
         let rt: &tokio::runtime::Runtime = CarbideDhcpContext::get_tokio_runtime();
         let api_server = rt.block_on(mock_api_server::MockAPIServer::start());
 
@@ -598,6 +984,135 @@ mod tests {
         }
     }
 
+    fn view(bytes: &[u8]) -> ByteView {
+        ByteView {
+            ptr: bytes.as_ptr(),
+            len: bytes.len(),
+        }
+    }
+
+    const NO_VIEW: ByteView = ByteView {
+        ptr: std::ptr::null(),
+        len: 0,
+    };
+
+    // A discovery read straight from the packet ends up the same as a built one
+    #[test]
+    fn test_discovery_fetch_machine_for_request() {
+        let rt: &tokio::runtime::Runtime = CarbideDhcpContext::get_tokio_runtime();
+        let api_server = rt.block_on(mock_api_server::MockAPIServer::start());
+
+        let mac_address = [2, 66, 172, 20, 17, 1];
+        let request = DiscoveryRequest {
+            relay_address: u32::from_be_bytes([172, 20, 17, 254]),
+            mac_address: view(&mac_address),
+            link_select_address: u32::from_be_bytes([172, 20, 17, 0]),
+            circuit_id: view(b"Ethernet12"),
+            remote_id: view(b""),
+            vendor_class: view(b"PXEClient:Arch:00007:UNDI:003000"),
+            desired_address: u32::from_be_bytes([172, 20, 17, 1]),
+            client_system: 7,
+            has_client_system: true,
+            trace: std::ptr::null(),
+        };
+
+        let mut out = null_mut();
+        let res = unsafe {
+            discovery_fetch_machine_for_at(&request, &mut out, api_server.local_http_addr())
+        };
+        assert_eq!(res, DiscoveryBuilderResult::Success);
+        let machine = unsafe { Arc::from_raw(out) };
+        assert!(mock_api_server::matches_mock_response(&machine));
+
+        let discovery = &machine.discovery_info;
+        assert_eq!(discovery.mac_address, MacAddress::new(mac_address));
+        assert_eq!(discovery.relay_address, Ipv4Addr::new(172, 20, 17, 254));
+        assert_eq!(
+            discovery.link_select_address,
+            Some(Ipv4Addr::new(172, 20, 17, 0))
+        );
+        assert_eq!(discovery.circuit_id.as_deref(), Some("Ethernet12"));
+        // Present but empty is kept apart from missing
+        assert_eq!(discovery.remote_id.as_deref(), Some(""));
+        assert_eq!(discovery.desired_address.as_deref(), Some("172.20.17.1"));
+        assert_eq!(discovery._client_system, Some(7));
+
+        // Missing options
+        let request = DiscoveryRequest {
+            link_select_address: 0,
+            circuit_id: NO_VIEW,
+            remote_id: NO_VIEW,
+            vendor_class: NO_VIEW,
+            desired_address: 0,
+            has_client_system: false,
+            ..request
+        };
+        let discovery = unsafe { Discovery::from_request(&request) }.unwrap();
+        assert_eq!(discovery.link_select_address, None);
+        assert_eq!(discovery.circuit_id, None);
+        assert_eq!(discovery.remote_id, None);
+        assert_eq!(discovery.vendor_class, None);
+        assert_eq!(discovery.desired_address, None);
+        assert_eq!(discovery._client_system, None);
+
+        let bad_mac = DiscoveryRequest {
+            mac_address: view(&mac_address[..5]),
+            ..request
+        };
+        assert_eq!(
+            unsafe { Discovery::from_request(&bad_mac) }.unwrap_err(),
+            DiscoveryBuilderResult::InvalidMacAddress
+        );
+        let bad_circuit_id = DiscoveryRequest {
+            circuit_id: view(&[0xff, 0xfe]),
+            ..request
+        };
+        assert_eq!(
+            unsafe { Discovery::from_request(&bad_circuit_id) }.unwrap_err(),
+            DiscoveryBuilderResult::InvalidCircuitId
+        );
+    }
+
+    // Concurrent cache misses for the same client share one backend call
+    #[test]
+    fn test_discovery_fetch_machine_coalesces_in_flight() {
+        let rt: &tokio::runtime::Runtime = CarbideDhcpContext::get_tokio_runtime();
+        let mut api_server = rt.block_on(mock_api_server::MockAPIServer::start());
+        // Slow enough that every thread misses the cache while the first call is in flight
+        api_server.set_response_delay(Duration::from_millis(200));
+
+        let endpoint_url = api_server.local_http_addr();
+        thread::scope(|s| {
+            for _ in 0..8 {
+                s.spawn(move || {
+                    let builder_ffi = discovery_builder_allocate();
+                    unsafe {
+                        marshal_discovery_ffi(builder_ffi, |builder| {
+                            builder.relay_address([172, 20, 0, 15].into());
+                            builder.mac_address(MacAddress::new([2, 66, 172, 20, 15, 1]));
+                            builder.circuit_id("eth0");
+                            DiscoveryBuilderResult::Success
+                        });
+                    }
+                    let mut out = null_mut();
+                    let res =
+                        unsafe { discovery_fetch_machine_at(builder_ffi, &mut out, endpoint_url) };
+                    assert_eq!(res, DiscoveryBuilderResult::Success);
+                    let machine = unsafe { &*out };
+                    assert!(mock_api_server::matches_mock_response(machine));
+                    unsafe {
+                        discovery_builder_free(builder_ffi);
+                    }
+                });
+            }
+        });
+
+        assert_eq!(
+            api_server.calls_for(mock_api_server::ENDPOINT_DISCOVER_DHCP),
+            1
+        );
+    }
+
     // Run many basic discovery_fetch_machine tests concurrently
     #[test]
     fn test_discovery_fetch_machine_multi_threading() {
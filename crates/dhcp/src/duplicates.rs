@@ -0,0 +1,296 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2026 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/// Drop copies of a packet we are still handling
+///
+/// A client which retries quickly, or a relay which forwards the same DISCOVER along several
+/// paths, hands Kea the same (xid, chaddr, giaddr, message type) more than once. The message
+/// type is part of it because a client sends its REQUEST with the xid of its DISCOVER, and
+/// that can come in while the DISCOVER is still being handled. pkt4_receive calls
+/// `carbide_packet_begin` before reading anything else from the packet, and a copy which
+/// arrives while the first one is still being handled is dropped with
+/// `DropReason::DuplicateInFlight`. The client gets its answer from the first.
+///
+/// The first packet is in flight until Kea is done with it and the `InFlightPacket` handle in
+/// its callout context is freed, or for at most `carbide-duplicate-window-ms`, so a packet Kea
+/// lost track of can't hold back the client's retries. 0 turns this off.
+///
+/// The table is split into shards like the cache, and holds at most
+/// `carbide-duplicate-table-size` packets. Past that new packets go through untracked.
+///
+use std::collections::HashMap;
+use std::hash::{BuildHasher, RandomState};
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+use lazy_static::lazy_static;
+
+use crate::CONFIG;
+use crate::discovery::ByteView;
+
+/// Default for `carbide-duplicate-window-ms`
+pub const DEFAULT_DUPLICATE_WINDOW: Duration = Duration::from_secs(2);
+/// Default for `carbide-duplicate-table-size`
+pub const DEFAULT_DUPLICATE_TABLE_SIZE: usize = 4096;
+const DUPLICATE_SHARDS: usize = 16;
+/// chaddr is a 16 byte field in the DHCP header
+const MAX_CHADDR: usize = 16;
+
+lazy_static! {
+    static ref IN_FLIGHT_PACKETS: DuplicateTable = {
+        let config = CONFIG.load();
+        DuplicateTable::new(config.duplicate_table_size, config.duplicate_window)
+    };
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+struct PacketKey {
+    xid: u32,
+    chaddr: [u8; MAX_CHADDR],
+    chaddr_len: u8,
+    giaddr: u32,
+    message_type: u8,
+}
+
+impl PacketKey {
+    fn new(xid: u32, chaddr: &[u8], giaddr: u32, message_type: u8) -> PacketKey {
+        let chaddr_len = chaddr.len().min(MAX_CHADDR);
+        let mut key = PacketKey {
+            xid,
+            chaddr: [0; MAX_CHADDR],
+            chaddr_len: chaddr_len as u8,
+            giaddr,
+            message_type,
+        };
+        key.chaddr[..chaddr_len].copy_from_slice(&chaddr[..chaddr_len]);
+        key
+    }
+}
+
+/// A packet tracked by `carbide_packet_begin`, until `carbide_packet_end`
+pub struct InFlightPacket {
+    key: PacketKey,
+    started: Instant,
+}
+
+struct DuplicateTable {
+    shards: Vec<Mutex<HashMap<PacketKey, Instant>>>,
+    hasher: RandomState,
+    shard_capacity: usize,
+    window: Duration,
+}
+
+impl DuplicateTable {
+    fn new(capacity: usize, window: Duration) -> DuplicateTable {
+        DuplicateTable {
+            shards: (0..DUPLICATE_SHARDS)
+                .map(|_| Mutex::new(HashMap::new()))
+                .collect(),
+            hasher: RandomState::new(),
+            shard_capacity: capacity.div_ceil(DUPLICATE_SHARDS).max(1),
+            window,
+        }
+    }
+
+    fn shard(&self, key: &PacketKey) -> &Mutex<HashMap<PacketKey, Instant>> {
+        let index = self.hasher.hash_one(key) as usize % self.shards.len();
+        &self.shards[index]
+    }
+
+    /// Err if the same packet is already in flight, otherwise the packet to pass to `end`,
+    /// None when it isn't tracked
+    fn begin(&self, key: PacketKey, now: Instant) -> Result<Option<InFlightPacket>, ()> {
+        if self.window.is_zero() {
+            return Ok(None);
+        }
+        let mut shard = self.shard(&key).lock().unwrap();
+        let window = self.window;
+        if shard
+            .get(&key)
+            .is_some_and(|started| now.saturating_duration_since(*started) < window)
+        {
+            return Err(());
+        }
+        if shard.len() >= self.shard_capacity && !shard.contains_key(&key) {
+            shard.retain(|_, started| now.saturating_duration_since(*started) < window);
+            if shard.len() >= self.shard_capacity {
+                return Ok(None);
+            }
+        }
+        shard.insert(key, now);
+        Ok(Some(InFlightPacket { key, started: now }))
+    }
+
+    fn end(&self, packet: &InFlightPacket) {
+        let mut shard = self.shard(&packet.key).lock().unwrap();
+        // Not if a later copy took over after the window ran out
+        if shard.get(&packet.key) == Some(&packet.started) {
+            shard.remove(&packet.key);
+        }
+    }
+}
+
+/// Start handling a packet, unless a copy of it is still in flight
+///
+/// Returns false for a copy, which should be dropped. Otherwise `packet_out` gets the handle
+/// to pass to `carbide_packet_end` once Kea is done with the packet. It is null when the
+/// packet isn't tracked, which `carbide_packet_end` accepts too. `message_type` is the value
+/// of the DHCP message type option, 0 when there is none.
+///
+/// # Safety
+///
+/// `chaddr` must be a valid view, and `packet_out` a valid pointer.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn carbide_packet_begin(
+    xid: u32,
+    chaddr: ByteView,
+    giaddr: u32,
+    message_type: u8,
+    packet_out: *mut *mut InFlightPacket,
+) -> bool {
+    unsafe {
+        *packet_out = std::ptr::null_mut();
+        let chaddr = chaddr.as_bytes().unwrap_or_default();
+        match IN_FLIGHT_PACKETS.begin(
+            PacketKey::new(xid, chaddr, giaddr, message_type),
+            Instant::now(),
+        ) {
+            Ok(Some(packet)) => {
+                *packet_out = Box::into_raw(Box::new(packet));
+                true
+            }
+            Ok(None) => true,
+            Err(()) => false,
+        }
+    }
+}
+
+/// Done with a packet from `carbide_packet_begin`, copies of it are let through again
+///
+/// # Safety
+///
+/// `packet` must be null or a handle from `carbide_packet_begin`, and must not be used
+/// afterwards.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn carbide_packet_end(packet: *mut InFlightPacket) {
+    if packet.is_null() {
+        return;
+    }
+    let packet = unsafe { Box::from_raw(packet) };
+    IN_FLIGHT_PACKETS.end(&packet);
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const MAC: [u8; 6] = [2, 66, 172, 20, 0, 42];
+    const DHCPDISCOVER: u8 = 1;
+    const DHCPREQUEST: u8 = 3;
+
+    // A copy is dropped while the first is in flight, and let through after
+    #[test]
+    fn test_duplicate_in_flight() {
+        let table = DuplicateTable::new(64, Duration::from_secs(2));
+        let start = Instant::now();
+        let key = PacketKey::new(0x1234, &MAC, 0xac140001, DHCPDISCOVER);
+
+        let first = table.begin(key, start).unwrap().unwrap();
+        assert!(table.begin(key, start).is_err());
+        // Another xid, or the same one through another relay, is another packet
+        assert!(
+            table
+                .begin(
+                    PacketKey::new(0x1235, &MAC, 0xac140001, DHCPDISCOVER),
+                    start
+                )
+                .unwrap()
+                .is_some()
+        );
+        assert!(
+            table
+                .begin(
+                    PacketKey::new(0x1234, &MAC, 0xac140002, DHCPDISCOVER),
+                    start
+                )
+                .unwrap()
+                .is_some()
+        );
+
+        table.end(&first);
+        assert!(table.begin(key, start).unwrap().is_some());
+    }
+
+    // The REQUEST a client sends with its DISCOVER's xid isn't a copy of the DISCOVER
+    #[test]
+    fn test_duplicate_request_after_discover() {
+        let table = DuplicateTable::new(64, Duration::from_secs(2));
+        let start = Instant::now();
+        let discover = PacketKey::new(0x1234, &MAC, 0xac140001, DHCPDISCOVER);
+        let request = PacketKey::new(0x1234, &MAC, 0xac140001, DHCPREQUEST);
+
+        let _discover = table.begin(discover, start).unwrap().unwrap();
+        let _request = table.begin(request, start).unwrap().unwrap();
+        assert!(table.begin(discover, start).is_err());
+        assert!(table.begin(request, start).is_err());
+    }
+
+    // A packet which never ended stops holding back copies after the window
+    #[test]
+    fn test_duplicate_window() {
+        let table = DuplicateTable::new(64, Duration::from_secs(2));
+        let start = Instant::now();
+        let key = PacketKey::new(0x1234, &MAC, 0xac140001, DHCPDISCOVER);
+
+        let stuck = table.begin(key, start).unwrap().unwrap();
+        assert!(table.begin(key, start + Duration::from_secs(1)).is_err());
+        let later = table
+            .begin(key, start + Duration::from_secs(2))
+            .unwrap()
+            .unwrap();
+
+        // The stuck one ending doesn't let copies of the later one through
+        table.end(&stuck);
+        assert!(table.begin(key, start + Duration::from_secs(3)).is_err());
+        table.end(&later);
+        assert!(table.begin(key, start + Duration::from_secs(3)).is_ok());
+
+        let off = DuplicateTable::new(64, Duration::ZERO);
+        assert!(off.begin(key, start).unwrap().is_none());
+        assert!(off.begin(key, start).unwrap().is_none());
+    }
+
+    // A full table lets new packets through untracked
+    #[test]
+    fn test_duplicate_table_full() {
+        let table = DuplicateTable::new(1, Duration::from_secs(2));
+        let start = Instant::now();
+        let keys: Vec<_> = (0..64)
+            .map(|xid| PacketKey::new(xid, &MAC, 0xac140001, DHCPDISCOVER))
+            .collect();
+        let tracked = keys
+            .iter()
+            .filter(|key| table.begin(**key, start).unwrap().is_some())
+            .count();
+        assert!(tracked <= DUPLICATE_SHARDS);
+        let duplicates = keys
+            .iter()
+            .filter(|key| table.begin(**key, start).is_err())
+            .count();
+        assert_eq!(duplicates, tracked);
+    }
+}
@@ -1,49 +1,13 @@
 #include "callouts.h"
 #include "carbide_rust.h"
 
+using namespace isc::data;
+
 isc::log::Logger logger("carbide-callouts");
 
 const int IPV4_ADDR_SIZEB = 4;
 
-void CDHCPOptionsHandler<Option>::resetOption(boost::any param) {
-  switch (option) {
-  case DHO_SUBNET_MASK:
-    option_val.reset(new OptionInt<uint32_t>(
-        Option::V4, option,
-        machine_get_interface_subnet_mask(boost::any_cast<Machine *>(param))));
-    break;
-  case DHO_BROADCAST_ADDRESS:
-    option_val.reset(new OptionInt<uint32_t>(
-        Option::V4, option,
-        machine_get_broadcast_address(boost::any_cast<Machine *>(param))));
-    break;
-  case DHO_HOST_NAME: {
-    char *hostname =
-        machine_get_interface_hostname(boost::any_cast<Machine *>(param));
-    option_val.reset(new OptionString(Option::V4, option, hostname));
-    machine_free_fqdn(hostname);
-  } break;
-  case DHO_BOOT_FILE_NAME: {
-    // if client does not support netboot we get a null pointer
-    const char *filename =
-        machine_get_filename(boost::any_cast<Machine *>(param));
-    if (filename) {
-      option_val.reset(new OptionString(Option::V4, option, filename));
-      machine_free_filename(filename);
-    }
-  } break;
-  case DHO_VENDOR_CLASS_IDENTIFIER:
-    option_val.reset(new OptionString(Option::V4, DHO_VENDOR_CLASS_IDENTIFIER,
-                                      boost::any_cast<char *>(param)));
-    break;
-  default:
-    LOG_ERROR(logger, "LOG_CARBIDE_PKT4_SEND: packet send error: Option [%1] "
-                      "is not implemented for reset.")
-        .arg(option);
-  }
-}
-
-Option4AddrLst::AddressContainer getAddresses(std::string ips) {
+Option4AddrLst::AddressContainer getAddresses(const std::string &ips) {
   std::stringstream ss(ips);
   std::vector<isc::asiolink::IOAddress> out;
   char delim = ',';
@@ -56,291 +20,337 @@ Option4AddrLst::AddressContainer getAddresses(std::string ips) {
   return out;
 }
 
-void CDHCPOptionsHandler<Option>::resetAndAddOption(boost::any param) {
-  switch (option) {
-  case DHO_ROUTERS:
-    response4_ptr->addOption(OptionPtr(new Option4AddrLst(
-        option, isc::asiolink::IOAddress(machine_get_interface_router(
-                    boost::any_cast<Machine *>(param))))));
-    break;
-  case DHO_NAME_SERVERS:
-    response4_ptr->addOption(OptionPtr(new Option4AddrLst(
-        option, getAddresses(boost::any_cast<std::string>(param)))));
-    break;
-  case DHO_DOMAIN_NAME_SERVERS:
-    response4_ptr->addOption(OptionPtr(new Option4AddrLst(
-        option, getAddresses(boost::any_cast<std::string>(param)))));
-    break;
-  case DHO_NTP_SERVERS:
-    response4_ptr->addOption(OptionPtr(new Option4AddrLst(
-        option, getAddresses(boost::any_cast<std::string>(param)))));
-    break;
-  case DHO_MQTT_SERVER:
-    response4_ptr->addOption(OptionPtr(new OptionString(
-        Option::V4, option, boost::any_cast<std::string>(param))));
-    break;
-  case DHO_SUBNET_MASK:
-  case DHO_BROADCAST_ADDRESS:
-  case DHO_HOST_NAME:
-  case DHO_BOOT_FILE_NAME:
-  case DHO_VENDOR_CLASS_IDENTIFIER:
-    resetOption(param);
-    if (option_val) {
-      response4_ptr->addOption(option_val);
-    }
-    break;
-  case DHO_INTERFACE_MTU:
-	response4_ptr->delOption(DHO_INTERFACE_MTU);
-	response4_ptr->addOption(OptionPtr(new OptionInt<uint16_t>(Option::V4, DHO_INTERFACE_MTU, boost::any_cast<uint16_t>(param))));
-	break;
-  default:
-    LOG_ERROR(logger, "LOG_CARBIDE_PKT4_SEND: packet send error: Option [%1] "
-                      "is not implemented for addandreset.")
-        .arg(option);
+/*
+ * Options built from a server list string in the config. The strings only
+ * change when the hook is reloaded, so build each option once and attach the
+ * same one to every response. Nothing modifies an option once it's been added
+ * to a packet, so sharing them between packet threads is fine.
+ */
+struct StaticOption {
+  std::string source;
+  OptionPtr option;
+};
+
+OptionPtr build_static_option(uint16_t option, const std::string &value) {
+  if (option == DHO_MQTT_SERVER) {
+    return OptionPtr(new OptionString(Option::V4, option, value));
   }
+  return OptionPtr(new Option4AddrLst(option, getAddresses(value)));
+}
+
+OptionPtr get_static_option(uint16_t option, const char *value) {
+  static std::mutex mutex;
+  static std::map<uint16_t, StaticOption> options;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  StaticOption &cached = options[option];
+  if (!cached.option || cached.source != value) {
+    // Build first, so a bad value throws without touching the cached one
+    OptionPtr built = build_static_option(option, value);
+    cached.source = value;
+    cached.option = built;
+  }
+  return cached.option;
 }
 
 /*
- * The main function which updates the option in response4_ptr.
- * Currently as per implementation only Option and OptionUint16 templates are
- * implemented.
+ * Options pkt4_receive reads for the discovery. Logged when present, and an
+ * error logged when missing, except option 82 which may be.
  */
-template <typename T>
-void update_option(CalloutHandle &handle, Pkt4Ptr response4_ptr,
-                   const int option, boost::any param) {
-  try {
-    CDHCPOptionsHandler<T> option_handler(handle, response4_ptr, option);
-    option_handler.resetAndAddOption(param);
-  } catch (exception &e) {
-    LOG_ERROR(logger, "LOG_CARBIDE_PKT4_SEND: packet send Exception for option "
-                      "[%1]. Exception: %2")
-        .arg(option)
-        .arg(e.what());
-    handle.setStatus(CalloutHandle::NEXT_STEP_DROP);
+OptionPtr get_discovery_option(const Pkt4Ptr &query4_ptr, uint16_t option) {
+  OptionPtr option_val = query4_ptr->getOption(option);
+  if (option_val) {
+    LOG_DEBUG(logger, DBG_CARBIDE_PACKET_DUMP, isc::log::LOG_CARBIDE_GENERIC)
+        .arg(option_val->toText());
+  } else if (option != DHO_DHCP_AGENT_OPTIONS) {
+    // TODO: Does this mean we rather should return an error here?
+    LOG_ERROR(logger, "LOG_CARBIDE_PKT4_RECEIVE: Missing option [%1] in packet")
+        .arg(option);
   }
+  return option_val;
 }
 
-DiscoveryBuilderResult update_discovery_parameters_option82(
-    DiscoveryBuilderFFI *discovery, int option,
-    boost::shared_ptr<OptionCustom> option_val) {
-  switch (option) {
-  case RAI_OPTION_LINK_SELECTION: {
-    OptionPtr link_select = option_val->getOption(RAI_OPTION_LINK_SELECTION);
-    if (link_select) {
-      OptionBuffer link_select_buf = link_select->getData();
-      if (link_select_buf.size() == sizeof(uint32_t)) {
-        uint32_t option_select =
-            isc::asiolink::IOAddress::fromBytes(AF_INET, &link_select_buf[0])
-                .toUint32();
-        // Update link select address.
-        return discovery_set_link_select(discovery, option_select);
-      }
-    }
-    break;
-  }
-  case RAI_OPTION_AGENT_CIRCUIT_ID: {
-    OptionPtr circuit_id_opt =
-        option_val->getOption(RAI_OPTION_AGENT_CIRCUIT_ID);
-    if (circuit_id_opt) {
-      OptionBuffer circuit_id = circuit_id_opt->getData();
-      std::string circuit_value(circuit_id.begin(), circuit_id.end());
-      LOG_INFO(logger, "LOG_CARBIDE_PKT4_RECEIVE: CIRCUIT ID [%1] in packet")
-          .arg(circuit_value);
-      return discovery_set_circuit_id(discovery, circuit_value.c_str());
-    }
-    break;
-  }
-  case RAI_OPTION_REMOTE_ID: {
-    OptionPtr remote_id_opt = option_val->getOption(RAI_OPTION_REMOTE_ID);
-    if (remote_id_opt) {
-      OptionBuffer remote_id = remote_id_opt->getData();
-      std::string remote_value(remote_id.begin(), remote_id.end());
-      LOG_INFO(logger, "LOG_CARBIDE_PKT4_RECEIVE: REMOTE ID [%1] in packet")
-          .arg(remote_value);
-      return discovery_set_remote_id(discovery, remote_value.c_str());
-    }
-    break;
-  }
+/*
+ * The option's data, without copying it, so the option must outlive the view.
+ * A missing option gives a null view.
+ */
+ByteView option_view(const OptionPtr &option) {
+  if (!option) {
+    return ByteView{nullptr, 0};
   }
+  const OptionBuffer &data = option->getData();
+  // Present but empty is not the same as missing, so it still gets a pointer
+  static const uint8_t empty = 0;
+  return ByteView{data.empty() ? &empty : data.data(), data.size()};
+}
 
-  return DiscoveryBuilderResult::Success;
+std::string option_text(const OptionPtr &option) {
+  const OptionBuffer &data = option->getData();
+  return std::string(data.begin(), data.end());
 }
 
-DiscoveryBuilderResult
-update_discovery_parameters(DiscoveryBuilderFFI *discovery, int option,
-                            boost::shared_ptr<OptionCustom> option_val) {
+// The IPv4 address an option holds, or 0 if it doesn't hold one
+uint32_t option_address(const OptionPtr &option) {
+  if (!option) {
+    return 0;
+  }
+  const OptionBuffer &data = option->getData();
+  if (data.size() != IPV4_ADDR_SIZEB) {
+    return 0;
+  }
+  return isc::asiolink::IOAddress::fromBytes(AF_INET, data.data()).toUint32();
+}
 
-  DiscoveryBuilderResult ret_val;
-  switch (option) {
-  case DHO_DHCP_AGENT_OPTIONS:
-    ret_val = update_discovery_parameters_option82(
-        discovery, RAI_OPTION_LINK_SELECTION, option_val);
-    if (ret_val != DiscoveryBuilderResult::Success) {
-      LOG_ERROR(
-          logger,
-          "LOG_CARBIDE_PKT4_RECEIVE: Failed in handling link select address.");
-      return ret_val;
-    }
+/*
+ * Encoders for the options we add to responses. Each takes the option code and
+ * the machine's response fields, and returns nullptr when the machine has
+ * nothing to put in that option.
+ */
+using OptionEncoder = OptionPtr (*)(uint16_t option,
+                                    const MachineResponse &machine);
 
-    ret_val = update_discovery_parameters_option82(
-        discovery, RAI_OPTION_AGENT_CIRCUIT_ID, option_val);
-    if (ret_val != DiscoveryBuilderResult::Success) {
-      LOG_ERROR(logger,
-                "LOG_CARBIDE_PKT4_RECEIVE: Failed in handling circuit_id.");
-      return ret_val;
-    }
+template <uint32_t MachineResponse::*Field>
+OptionPtr encode_address(uint16_t option, const MachineResponse &machine) {
+  return OptionPtr(
+      new Option4AddrLst(option, isc::asiolink::IOAddress(machine.*Field)));
+}
 
-    ret_val = update_discovery_parameters_option82(
-        discovery, RAI_OPTION_REMOTE_ID, option_val);
-    if (ret_val != DiscoveryBuilderResult::Success) {
-      LOG_ERROR(logger,
-                "LOG_CARBIDE_PKT4_RECEIVE: Failed in handling remote_id.");
-      return ret_val;
-    }
-    break;
-  }
+template <uint32_t MachineResponse::*Field>
+OptionPtr encode_uint32(uint16_t option, const MachineResponse &machine) {
+  return OptionPtr(new OptionInt<uint32_t>(Option::V4, option, machine.*Field));
+}
 
-  return DiscoveryBuilderResult::Success;
+template <uint16_t MachineResponse::*Field>
+OptionPtr encode_uint16(uint16_t option, const MachineResponse &machine) {
+  return OptionPtr(new OptionInt<uint16_t>(Option::V4, option, machine.*Field));
 }
 
-DiscoveryBuilderResult
-update_discovery_parameters(DiscoveryBuilderFFI *discovery, int option,
-                            boost::shared_ptr<OptionString> option_val) {
-  switch (option) {
-  case DHO_VENDOR_CLASS_IDENTIFIER:
-    return discovery_set_vendor_class(discovery,
-                                      option_val->getValue().c_str());
+template <const char *MachineResponse::*Field>
+OptionPtr encode_string(uint16_t option, const MachineResponse &machine) {
+  const char *value = machine.*Field;
+  if (value == nullptr || value[0] == '\0') {
+    return OptionPtr();
   }
-
-  return DiscoveryBuilderResult::Success;
+  return OptionPtr(new OptionString(Option::V4, option, value));
 }
 
-DiscoveryBuilderResult
-update_discovery_parameters(DiscoveryBuilderFFI *discovery, int option,
-                            boost::shared_ptr<OptionUint16Array> option_val) {
-  switch (option) {
-  case DHO_SYSTEM: {
-    const auto &architectures = option_val->getValues();
-    if (!architectures.empty()) {
-      return discovery_set_client_system(discovery, architectures.front());
-    }
-    break;
-  }
+// Server lists come from the config, so they're shared between machines
+template <const char *MachineResponse::*Field>
+OptionPtr encode_server_list(uint16_t option, const MachineResponse &machine) {
+  const char *value = machine.*Field;
+  if (value == nullptr) {
+    return OptionPtr();
   }
-
-  return DiscoveryBuilderResult::Success;
+  return get_static_option(option, value);
 }
 
-template <typename T>
-DiscoveryBuilderResult
-update_discovery_parameters(Pkt4Ptr query4_ptr, DiscoveryBuilderFFI *discovery,
-                            int option) {
-  boost::shared_ptr<T> option_val =
-      boost::dynamic_pointer_cast<T>(query4_ptr->getOption(option));
-  if (option_val) {
-    LOG_INFO(logger, isc::log::LOG_CARBIDE_GENERIC).arg(option_val->toText());
-    return update_discovery_parameters(discovery, option, option_val);
-  } else {
-    if (option != DHO_DHCP_AGENT_OPTIONS) {
-      // TODO: Does this mean we rather should return an error here?
-      LOG_ERROR(logger,
-                "LOG_CARBIDE_PKT4_RECEIVE: Missing option [%1] in packet")
-          .arg(option);
-    }
+OptionPtr encode_vendor_options(uint16_t option,
+                                const MachineResponse &machine) {
+  OptionPtr option_vendor(new Option(Option::V4, option));
+
+  // Option 6 set to 0x8 tells iPXE not to wait for Proxy PXE since we don't
+  // care about that.
+  option_vendor->addOption(
+      OptionPtr(new OptionInt<uint32_t>(Option::V4, 6, 0x8)));
+
+  // Option 70 we're using to set the UUID of the machine
+  if (machine.uuid[0] != '\0') {
+    option_vendor->addOption(
+        OptionPtr(new OptionString(Option::V4, 70, machine.uuid)));
   }
 
-  return DiscoveryBuilderResult::Success;
+  return option_vendor;
 }
 
-void set_options(CalloutHandle &handle, Pkt4Ptr response4_ptr,
-                 Machine *machine) {
-  // Router Address
-  update_option<Option>(handle, response4_ptr, DHO_ROUTERS, machine);
+struct OptionDescriptor {
+  uint16_t option;
+  OptionEncoder encode;
+};
 
-  // DNS servers
-  char *machine_nameservers = machine_get_nameservers(machine);
-  std::string nameservers(machine_nameservers);
-  update_option<Option>(handle, response4_ptr, DHO_NAME_SERVERS, nameservers);
-  update_option<Option>(handle, response4_ptr, DHO_DOMAIN_NAME_SERVERS,
-                        nameservers);
-  machine_free_nameservers(machine_nameservers);
+/*
+ * Every option carbide sets in a response, and where its value comes from. To
+ * add an option, add a MachineResponse field on the Rust side and a line here.
+ */
+constexpr OptionDescriptor OPTION_TABLE[] = {
+    {DHO_ROUTERS, encode_address<&MachineResponse::router>},
+    {DHO_NAME_SERVERS, encode_server_list<&MachineResponse::nameservers>},
+    {DHO_DOMAIN_NAME_SERVERS,
+     encode_server_list<&MachineResponse::nameservers>},
+    {DHO_NTP_SERVERS, encode_server_list<&MachineResponse::ntpservers>},
+    {DHO_MQTT_SERVER, encode_server_list<&MachineResponse::mqtt_server>},
+    {DHO_INTERFACE_MTU, encode_uint16<&MachineResponse::mtu>},
+    {DHO_SUBNET_MASK, encode_uint32<&MachineResponse::subnet_mask>},
+    {DHO_BROADCAST_ADDRESS, encode_uint32<&MachineResponse::broadcast_address>},
+    // The RFC says this is the short name, but whatever.
+    {DHO_HOST_NAME, encode_string<&MachineResponse::hostname>},
+    // Null if the client does not support netboot
+    {DHO_BOOT_FILE_NAME, encode_string<&MachineResponse::filename>},
+    {DHO_VENDOR_CLASS_IDENTIFIER, encode_string<&MachineResponse::client_type>},
+    {DHO_VENDOR_ENCAPSULATED_OPTIONS, encode_vendor_options},
+};
 
-  // NTP server
-  char *machine_ntpservers = machine_get_ntpservers(machine);
-  std::string ntpservers(machine_ntpservers);
-  update_option<Option>(handle, response4_ptr, DHO_NTP_SERVERS, ntpservers);
-  machine_free_nameservers(machine_ntpservers);
+/*
+ * The options carbide adds to a machine's responses. Built the first time the
+ * machine answers a packet and attached to it (see machine_set_option_set), so
+ * its later responses, and renewals while it's cached, reuse them.
+ */
+struct MachineOptionSet {
+  std::vector<OptionPtr> options;
+};
+
+void free_option_set(void *option_set) {
+  delete static_cast<MachineOptionSet *>(option_set);
+}
 
-  // MQTT server
-  char *machine_mqtt_server = machine_get_mqtt_server(machine);
-  if (machine_mqtt_server != nullptr) {
-    std::string mqtt_server(machine_mqtt_server);
-    update_option<Option>(handle, response4_ptr, DHO_MQTT_SERVER, mqtt_server);
-    machine_free_nameservers(machine_mqtt_server);
+/*
+ * Run the machine through the option table. Returns nullptr if an option could
+ * not be built, e.g. a server list with a bad address in it.
+ */
+MachineOptionSet *build_option_set(const MachineResponse &machine) {
+  std::unique_ptr<MachineOptionSet> option_set(new MachineOptionSet());
+  option_set->options.reserve(std::size(OPTION_TABLE));
+
+  for (const OptionDescriptor &descriptor : OPTION_TABLE) {
+    try {
+      OptionPtr option = descriptor.encode(descriptor.option, machine);
+      if (option) {
+        option_set->options.push_back(option);
+      }
+    } catch (const std::exception &e) {
+      LOG_ERROR(logger, "LOG_CARBIDE_PKT4_SEND: packet send Exception for "
+                        "option [%1]. Exception: %2")
+          .arg(descriptor.option)
+          .arg(e.what());
+      return nullptr;
+    }
   }
 
-  // Set Interface MTU
-  uint16_t mtu = machine_get_interface_mtu(machine);
-  update_option<Option>(handle, response4_ptr, DHO_INTERFACE_MTU, mtu);
+  return option_set.release();
+}
 
-  // Set subnet-mask
-  update_option<Option>(handle, response4_ptr, DHO_SUBNET_MASK, machine);
+/*
+ * Get the machine's option set, building it if this is its first response.
+ * Returns nullptr if an option could not be built, in which case the packet
+ * has been set to be dropped.
+ */
+const MachineOptionSet *get_option_set(CalloutHandle &handle, Machine *machine,
+                                       const MachineResponse &response) {
+  void *attached = machine_get_option_set(machine);
+  if (attached) {
+    return static_cast<const MachineOptionSet *>(attached);
+  }
 
-  // Set broadcast address
-  update_option<Option>(handle, response4_ptr, DHO_BROADCAST_ADDRESS, machine);
+  MachineOptionSet *option_set = build_option_set(response);
+  if (!option_set) {
+    handle.setStatus(CalloutHandle::NEXT_STEP_DROP);
+    return nullptr;
+  }
+  if (!machine_set_option_set(machine, option_set, free_option_set)) {
+    // Another packet thread attached one first, and ours has been freed
+    return static_cast<const MachineOptionSet *>(
+        machine_get_option_set(machine));
+  }
+  return option_set;
+}
 
-  // Set hostname, the RFC says this is the short name, but whatever.
-  update_option<Option>(handle, response4_ptr, DHO_HOST_NAME, machine);
+/*
+ * What lease4_offer and leases4_committed need to unpark a packet once its discovery is done.
+ * Owned by the Rust side until the callback runs, which deletes it.
+ */
+struct ParkedQuery {
+  ParkingLotHandlePtr parking_lot;
+  Pkt4Ptr query4_ptr;
+};
 
-  // Set filename
-  update_option<Option>(handle, response4_ptr, DHO_BOOT_FILE_NAME, machine);
+void unpark_query(void *user_data) {
+  std::unique_ptr<ParkedQuery> parked(static_cast<ParkedQuery *>(user_data));
+  try {
+    parked->parking_lot->unpark(parked->query4_ptr);
+  } catch (const std::exception &e) {
+    LOG_ERROR(logger, "LOG_CARBIDE_LEASES4_COMMITTED: failed to unpark packet: %1")
+        .arg(e.what());
+  }
+}
 
-  char *machine_client_type = machine_get_client_type(machine);
-  if (strlen(machine_client_type) > 0) {
-    update_option<Option>(handle, response4_ptr, DHO_VENDOR_CLASS_IDENTIFIER,
-                          machine_client_type);
+/*
+ * One line about a packet for INFO level logging. The full toText() dump is
+ * only built at DBG_CARBIDE_PACKET_DUMP.
+ */
+std::string packet_summary(const Pkt4Ptr &pkt) {
+  std::string summary = pkt->getName();
+  summary += " ";
+  summary += pkt->getLabel();
+  summary += " giaddr=";
+  summary += pkt->getGiaddr().toText();
+  if (!pkt->getYiaddr().isV4Zero()) {
+    summary += " yiaddr=";
+    summary += pkt->getYiaddr().toText();
   }
-  machine_free_client_type(machine_client_type);
+  return (summary);
 }
 
-void set_vendor_options(Pkt4Ptr response4_ptr, Machine *machine) {
-  OptionPtr option_vendor(
-      new Option(Option::V4, DHO_VENDOR_ENCAPSULATED_OPTIONS));
-  LOG_INFO(logger, isc::log::LOG_CARBIDE_GENERIC).arg(option_vendor->toText());
+uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
 
-  // Option 6 set to 0x8 tells iPXE not to wait for Proxy PXE since we don't
-  // care about that.
-  OptionPtr vendor_option_6 = option_vendor->getOption(6);
-  if (vendor_option_6) {
-    option_vendor->delOption(6);
+template <typename T>
+bool get_context(CalloutHandle &handle, const std::string &name, T &value) {
+  try {
+    handle.getContext(name, value);
+    return true;
+  } catch (const NoSuchCalloutContext &) {
+    return false;
   }
-  vendor_option_6.reset(new OptionInt<uint32_t>(Option::V4, 6, 0x8));
-  option_vendor->addOption(vendor_option_6);
+}
 
-  // Option 70 we're using to set the UUID of the machine
-  OptionPtr vendor_option_70 = option_vendor->getOption(70);
-  if (vendor_option_70) {
-    option_vendor->delOption(70);
+/*
+ * The machine, if we have it before the lease is allocated. In async mode
+ * that's only when its discovery is done already, e.g. it was a cache hit, and
+ * otherwise Kea allocates as usual and pkt4_send sets the address.
+ */
+boost::shared_ptr<Machine> selection_machine(CalloutHandle &handle) {
+  boost::shared_ptr<Machine> machine;
+  if (get_context(handle, "machine", machine) && machine) {
+    return machine;
   }
-  char *machine_uuid = machine_get_uuid(machine);
-  if (strlen(machine_uuid) > 0) {
-    vendor_option_70.reset(new OptionString(Option::V4, 70, machine_uuid));
-    option_vendor->addOption(vendor_option_70);
+  boost::shared_ptr<const PendingDiscovery> pending;
+  if (get_context(handle, "pending_discovery", pending) && pending) {
+    Machine *peeked = pending_discovery_peek(pending.get());
+    if (peeked) {
+      machine.reset(peeked, [](Machine *ptr) { machine_free(ptr); });
+    }
   }
+  return machine;
+}
 
-  response4_ptr->addOption(option_vendor);
-  machine_free_uuid(machine_uuid);
+// The arguments of the control channel command a command callout was called for
+ConstElementPtr command_arguments(CalloutHandle &handle) {
+  ConstElementPtr command;
+  handle.getArgument("command", command);
+  ConstElementPtr arguments;
+  isc::config::parseCommand(arguments, command);
+  return arguments;
+}
+
+ElementPtr count_element(uint64_t count) {
+  return Element::create(static_cast<int64_t>(count));
+}
+
+ConstElementPtr command_success(const std::string &text,
+                                const ConstElementPtr &arguments) {
+  return isc::config::createAnswer(isc::config::CONTROL_RESULT_SUCCESS, text,
+                                   arguments);
 }
 
 extern "C" {
 int pkt4_receive(CalloutHandle &handle) {
+  auto parse_start = std::chrono::steady_clock::now();
   Pkt4Ptr query4_ptr;
 
   handle.getArgument("query4", query4_ptr);
 
-  LOG_INFO(logger, isc::log::LOG_CARBIDE_PKT4_RECEIVE)
-      .arg(query4_ptr->toText());
-
   /*
    * Call to increment total requests counter
    */
@@ -357,63 +367,127 @@ int pkt4_receive(CalloutHandle &handle) {
     /*
      * Call to increment drooped requests counter
      */
-    carbide_increment_dropped_requests("NonRelayedPacket");
+    carbide_increment_dropped_requests(DropReason::NonRelayedPacket);
     return 0;
   }
 
-  LOG_INFO(logger, "LOG_CARBIDE_PKT4_RECEIVE: Packet type name: %1")
-	  .arg(query4_ptr->getName());
-
-  // Initialize a discovery builder object
-  // Since the object needs to be freed using a Rust function, we wrap it in
-  // a unique_ptr with a custom deleter
-  std::unique_ptr<DiscoveryBuilderFFI, void (*)(DiscoveryBuilderFFI *)>
-      discovery(discovery_builder_allocate(), discovery_builder_free);
+  const auto &mac = query4_ptr->getHWAddr()->hwaddr_;
+  uint32_t relay_address = query4_ptr->getGiaddr().toUint32();
 
   /*
-   * Extract the DHO_DHCP_AGENT_OPTIONS (82) from request and check if Suboption
-   * 5: RAI_OPTION_LINK_SELECTION (RFC3527) and 1: RAI_OPTION_AGENT_CIRCUIT_ID
-   * (RFC3527) are present or not.
+   * A client or relay sending more than its share is dropped here, before we
+   * spend anything else on it. See rate_limit.rs.
    */
-  DiscoveryBuilderResult builder_result =
-      update_discovery_parameters<OptionCustom>(query4_ptr, discovery.get(),
-                                                DHO_DHCP_AGENT_OPTIONS);
+  DropReason rate_limited;
+  if (!carbide_rate_limit(ByteView{mac.data(), mac.size()}, relay_address,
+                          &rate_limited)) {
+    LOG_DEBUG(logger, DBG_CARBIDE_PACKET_DETAIL,
+              "LOG_CARBIDE_PKT4_RECEIVE: Rate limited, dropping %1")
+        .arg(query4_ptr->getLabel());
+    handle.setStatus(CalloutHandle::NEXT_STEP_DROP);
+    carbide_increment_dropped_requests(rate_limited);
+    return 0;
+  }
+
   /*
-   * Extract the vendor class, which has some interesting bits
-   * like HTTPClient / PXEClient
-   *
-   * TODO(ajf): find out where this option format is documented
-   * at all so maybe we can build a type around it.
+   * A retransmission, or the same packet through another relay path, while we
+   * are still handling the first copy is dropped before any more work. The
+   * first copy stays in flight until Kea frees its handle context.
    */
-  if (builder_result == DiscoveryBuilderResult::Success) {
-    builder_result = update_discovery_parameters<OptionString>(
-        query4_ptr, discovery.get(), DHO_VENDOR_CLASS_IDENTIFIER);
+  InFlightPacket *in_flight = nullptr;
+  if (!carbide_packet_begin(query4_ptr->getTransid(),
+                            ByteView{mac.data(), mac.size()}, relay_address,
+                            query4_ptr->getType(), &in_flight)) {
+    LOG_DEBUG(logger, DBG_CARBIDE_PACKET_DETAIL,
+              "LOG_CARBIDE_PKT4_RECEIVE: Dropping copy of in flight packet %1")
+        .arg(query4_ptr->getLabel());
+    handle.setStatus(CalloutHandle::NEXT_STEP_DROP);
+    carbide_increment_dropped_requests(DropReason::DuplicateInFlight);
+    return 0;
+  }
+  if (in_flight) {
+    boost::shared_ptr<InFlightPacket> in_flight_ptr(
+        in_flight, [](InFlightPacket *ptr) { carbide_packet_end(ptr); });
+    handle.setContext("in_flight_packet", in_flight_ptr);
   }
 
-  if (builder_result == DiscoveryBuilderResult::Success) {
-    OptionPtr opt = query4_ptr->getOption(DHO_DHCP_REQUESTED_ADDRESS);
-    if (opt) {
-      OptionBuffer buf = opt->getData();
-      auto bufSize = buf.size();
+  LOG_INFO(logger, isc::log::LOG_CARBIDE_PKT4_RECEIVE)
+      .arg(packet_summary(query4_ptr));
+  LOG_DEBUG(logger, DBG_CARBIDE_PACKET_DUMP, isc::log::LOG_CARBIDE_PKT4_DUMP)
+      .arg(query4_ptr->toText());
 
-      if (bufSize == IPV4_ADDR_SIZEB) {
-        uint32_t temp = 0;
-        memcpy(&temp, buf.data(), IPV4_ADDR_SIZEB);
-        uint32_t v4 = htonl(temp);
+  /*
+   * Everything the discovery needs from the packet goes in one request. The
+   * strings are views into the options, which the packet keeps alive until the
+   * discovery call below returns.
+   */
+  DiscoveryRequest request{};
+  request.relay_address = relay_address;
+  request.mac_address = ByteView{mac.data(), mac.size()};
 
-        isc::asiolink::IOAddress addr(v4);
+  /*
+   * Extract the DHO_DHCP_AGENT_OPTIONS (82) from request and check if Suboption
+   * 5: RAI_OPTION_LINK_SELECTION (RFC3527), 1: RAI_OPTION_AGENT_CIRCUIT_ID
+   * and 2: RAI_OPTION_REMOTE_ID (RFC3046) are present or not.
+   */
+  OptionPtr agent_options =
+      get_discovery_option(query4_ptr, DHO_DHCP_AGENT_OPTIONS);
+  if (agent_options) {
+    request.link_select_address =
+        option_address(agent_options->getOption(RAI_OPTION_LINK_SELECTION));
+
+    OptionPtr circuit_id =
+        agent_options->getOption(RAI_OPTION_AGENT_CIRCUIT_ID);
+    if (circuit_id) {
+      LOG_DEBUG(logger, DBG_CARBIDE_PACKET_DETAIL,
+                "LOG_CARBIDE_PKT4_RECEIVE: CIRCUIT ID [%1] in packet")
+          .arg(option_text(circuit_id));
+    }
+    request.circuit_id = option_view(circuit_id);
 
-        auto desired = addr.toText();
+    OptionPtr remote_id = agent_options->getOption(RAI_OPTION_REMOTE_ID);
+    if (remote_id) {
+      LOG_DEBUG(logger, DBG_CARBIDE_PACKET_DETAIL,
+                "LOG_CARBIDE_PKT4_RECEIVE: REMOTE ID [%1] in packet")
+          .arg(option_text(remote_id));
+    }
+    request.remote_id = option_view(remote_id);
+  }
 
-        discovery_set_desired_address(discovery.get(), desired.c_str());
+  /*
+   * One packet in carbide-trace-sample-one-in is traced until pkt4_send, see
+   * trace.rs. Its span ends as dropped if Kea frees the context before that.
+   */
+  PacketTrace *trace = carbide_trace_start(
+      query4_ptr->getTransid(), request.mac_address, relay_address);
+  if (trace) {
+    boost::shared_ptr<PacketTrace> trace_ptr(
+        trace, [](PacketTrace *ptr) { carbide_trace_free(ptr); });
+    handle.setContext("packet_trace", trace_ptr);
+    request.trace = trace;
+  }
 
-        LOG_INFO(logger,
+  /*
+   * Extract the vendor class, which has some interesting bits
+   * like HTTPClient / PXEClient
+   *
+   * TODO(ajf): find out where this option format is documented
+   * at all so maybe we can build a type around it.
+   */
+  request.vendor_class = option_view(
+      get_discovery_option(query4_ptr, DHO_VENDOR_CLASS_IDENTIFIER));
+
+  OptionPtr requested = query4_ptr->getOption(DHO_DHCP_REQUESTED_ADDRESS);
+  if (requested) {
+    request.desired_address = option_address(requested);
+    if (request.desired_address != 0) {
+      LOG_DEBUG(logger, DBG_CARBIDE_PACKET_DETAIL,
                 "LOG_CARBIDE_PKT4_RECEIVE: Desired Address [%1] set")
-          .arg(desired);
-      } else {
-        LOG_ERROR(logger, "LOG_CARBIDE_PKT4_RECEIVE: Desired addr buf len wrong: [%1]")
-          .arg(bufSize);
-      }
+          .arg(isc::asiolink::IOAddress(request.desired_address).toText());
+    } else {
+      LOG_ERROR(logger,
+                "LOG_CARBIDE_PKT4_RECEIVE: Desired addr buf len wrong: [%1]")
+          .arg(requested->getData().size());
     }
   }
 
@@ -422,47 +496,55 @@ int pkt4_receive(CalloutHandle &handle) {
    * packet, which will tell us what the booting architecture is
    * in order to figure out which filname to give back
    */
-  if (builder_result == DiscoveryBuilderResult::Success) {
-    builder_result = update_discovery_parameters<OptionUint16Array>(
-        query4_ptr, discovery.get(), DHO_SYSTEM);
+  boost::shared_ptr<OptionUint16Array> system =
+      boost::dynamic_pointer_cast<OptionUint16Array>(
+          get_discovery_option(query4_ptr, DHO_SYSTEM));
+  if (system && !system->getValues().empty()) {
+    request.client_system = system->getValues().front();
+    request.has_client_system = true;
   }
 
+  carbide_observe_stage(PipelineStage::ParseQuery, elapsed_ns(parse_start));
+
   /*
-   * There's helper functions for the basic stuff like mac
-   * address and relay address
+   * In async mode we don't wait for carbide-api here. The discovery carries on
+   * in the background while Kea allocates the lease, and lease4_offer /
+   * leases4_committed / pkt4_send pick up the result.
    */
-  if (builder_result == DiscoveryBuilderResult::Success) {
-    builder_result = discovery_set_relay(discovery.get(),
-                                         query4_ptr->getGiaddr().toUint32());
-  }
-
-  if (builder_result == DiscoveryBuilderResult::Success) {
-    auto mac = query4_ptr->getHWAddr()->hwaddr_;
-    builder_result =
-        discovery_set_mac_address(discovery.get(), mac.data(), mac.size());
+  DiscoveryBuilderResult builder_result;
+  bool async_discovery = carbide_get_config_async_discovery();
+  if (async_discovery) {
+    const PendingDiscovery *pending = nullptr;
+    builder_result = discovery_start_for(&request, &pending);
+    if (builder_result == DiscoveryBuilderResult::Success) {
+      boost::shared_ptr<const PendingDiscovery> pendingPtr(
+          pending,
+          [](const PendingDiscovery *ptr) { pending_discovery_free(ptr); });
+      handle.setContext("pending_discovery", pendingPtr);
+      return 0;
+    }
   }
 
   Machine *machine = nullptr;
-  if (builder_result == DiscoveryBuilderResult::Success) {
+  if (!async_discovery) {
     /*
-     * We've been building up a object for the dhcp client options
-     * we care about, so now we call the function to turn that
-     * object into a dhcp machine object from the carbide API.
+     * Turn the dhcp client options we care about into a dhcp
+     * machine object from the carbide API.
      */
-    builder_result = discovery_fetch_machine(discovery.get(), &machine);
+    builder_result = discovery_fetch_machine_for(&request, &machine);
   }
 
   if (builder_result != DiscoveryBuilderResult::Success || machine == nullptr) {
     LOG_ERROR(logger,
               "LOG_CARBIDE_PKT4_RECV: Error while executing machine discovery "
-              "in discovery_fetch_machine: %1, machine_ptr=%2")
+              "in discovery_fetch_machine_for: %1, machine_ptr=%2")
         .arg(discovery_builder_result_as_str(builder_result))
         .arg(machine);
     handle.setStatus(CalloutHandle::NEXT_STEP_DROP);
     /*
      * Call to increment drooped requests counter
      */
-    carbide_increment_dropped_requests(discovery_builder_result_as_str(builder_result));
+    carbide_increment_discovery_dropped_requests(builder_result);
     return 1;
   }
 
@@ -479,6 +561,143 @@ int pkt4_receive(CalloutHandle &handle) {
   return 0;
 }
 
+/*
+ * carbide-api has already picked the machine's address, so pick the subnet it
+ * is in rather than the one Kea would go by the relay for.
+ */
+int subnet4_select(CalloutHandle &handle) {
+  boost::shared_ptr<Machine> machine = selection_machine(handle);
+  if (!machine) {
+    return 0;
+  }
+  isc::asiolink::IOAddress address(
+      machine_get_response(machine.get()).interface_address);
+  if (address.isV4Zero()) {
+    return 0;
+  }
+
+  Subnet4Ptr subnet;
+  handle.getArgument("subnet4", subnet);
+  if (subnet && subnet->inRange(address)) {
+    return 0;
+  }
+
+  const Subnet4Collection *subnets = nullptr;
+  handle.getArgument("subnet4collection", subnets);
+  if (subnets) {
+    for (const Subnet4Ptr &candidate : *subnets) {
+      if (candidate->inRange(address)) {
+        handle.setArgument("subnet4", candidate);
+        return 0;
+      }
+    }
+  }
+
+  LOG_DEBUG(logger, DBG_CARBIDE_PACKET_DETAIL,
+            "LOG_CARBIDE_SUBNET4_SELECT: No subnet configured for [%1]")
+      .arg(address.toText());
+  return 0;
+}
+
+/*
+ * Give the lease the machine's address instead of whatever the allocation
+ * engine found free, so the lease Kea commits matches the yiaddr pkt4_send
+ * sets. Left alone if the address is leased already, whichever client has it.
+ */
+int lease4_select(CalloutHandle &handle) {
+  boost::shared_ptr<Machine> machine = selection_machine(handle);
+  if (!machine) {
+    return 0;
+  }
+  isc::asiolink::IOAddress address(
+      machine_get_response(machine.get()).interface_address);
+
+  Lease4Ptr lease4;
+  Subnet4Ptr subnet;
+  handle.getArgument("lease4", lease4);
+  handle.getArgument("subnet4", subnet);
+  if (!lease4 || address.isV4Zero() || lease4->addr_ == address) {
+    return 0;
+  }
+  // A lease outside its subnet would be refused when it's committed
+  if (!subnet || !subnet->inRange(address)) {
+    return 0;
+  }
+  // Nor can it take an address another lease has, Kea would try to add a
+  // second lease for it
+  Lease4Ptr existing = LeaseMgrFactory::instance().getLease4(address);
+  if (existing) {
+    LOG_DEBUG(logger, DBG_CARBIDE_PACKET_DETAIL,
+              "LOG_CARBIDE_LEASE4_SELECT: [%1] is leased to [%2], keeping [%3]")
+        .arg(address.toText())
+        .arg(existing->hwaddr_ ? existing->hwaddr_->toText(false) : "unknown")
+        .arg(lease4->addr_.toText());
+    return 0;
+  }
+  lease4->addr_ = address;
+  return 0;
+}
+
+/*
+ * Park the packet until its async discovery is done, rather than letting the
+ * packet thread run on to pkt4_send and block there.
+ */
+void park_until_discovered(CalloutHandle &handle) {
+  boost::shared_ptr<const PendingDiscovery> pending;
+  if (!get_context(handle, "pending_discovery", pending) || !pending) {
+    return;
+  }
+
+  /*
+   * Whoever unparks the packet runs the rest of its processing. In
+   * multi-threaded mode Kea hands that to its thread pool, otherwise it would
+   * run on the tokio thread which completed the discovery, so only park when
+   * multi-threading is on. pkt4_send waits for the result either way.
+   */
+  if (!isc::util::MultiThreadingMgr::instance().getMode()) {
+    static std::once_flag warned;
+    std::call_once(warned, [] {
+      LOG_WARN(logger, "LOG_CARBIDE_LEASES4_COMMITTED: carbide-async-discovery "
+                       "needs Kea multi-threading, packets wait on carbide-api "
+                       "in pkt4_send instead of being parked");
+    });
+    return;
+  }
+
+  Pkt4Ptr query4_ptr;
+  handle.getArgument("query4", query4_ptr);
+
+  ParkingLotHandlePtr parking_lot = handle.getParkingLotHandlePtr();
+  parking_lot->reference(query4_ptr);
+  // Set before registering, the discovery might complete and unpark before we
+  // get to return.
+  handle.setStatus(CalloutHandle::NEXT_STEP_PARK);
+
+  ParkedQuery *parked = new ParkedQuery{parking_lot, query4_ptr};
+  if (!pending_discovery_notify(pending.get(), unpark_query, parked)) {
+    // Already done or already parked, carry on without parking
+    delete parked;
+    parking_lot->dereference(query4_ptr);
+    handle.setStatus(CalloutHandle::NEXT_STEP_CONTINUE);
+  }
+}
+
+/*
+ * Kea doesn't call leases4_committed for a DISCOVER, the offer is parked here
+ * instead. Only registered where Kea has this hook point (2.6 and later), on
+ * older versions a DISCOVER whose discovery is still running holds its packet
+ * thread in pkt4_send.
+ */
+int lease4_offer(CalloutHandle &handle) {
+  park_until_discovered(handle);
+  return 0;
+}
+
+int leases4_committed(CalloutHandle &handle) {
+  park_until_discovered(handle);
+  return 0;
+}
+
 int pkt4_send(CalloutHandle &handle) {
   Pkt4Ptr query4_ptr, response4_ptr;
 
@@ -487,10 +706,29 @@ int pkt4_send(CalloutHandle &handle) {
 
   /*
    * Load the machine from the context.  It should have been set in
-   * pkt4_receive.
+   * pkt4_receive, or still be on its way if the discovery is async.
    */
   boost::shared_ptr<Machine> machine;
-  handle.getContext("machine", machine);
+  boost::shared_ptr<const PendingDiscovery> pending;
+  if (get_context(handle, "pending_discovery", pending) && pending) {
+    Machine *fetched = nullptr;
+    DiscoveryBuilderResult result =
+        pending_discovery_wait(pending.get(), &fetched);
+    if (result != DiscoveryBuilderResult::Success || fetched == nullptr) {
+      LOG_ERROR(logger,
+                "LOG_CARBIDE_PKT4_SEND: Error while executing machine "
+                "discovery in discovery_start_for: %1, machine_ptr=%2")
+          .arg(discovery_builder_result_as_str(result))
+          .arg(fetched);
+      handle.setStatus(CalloutHandle::NEXT_STEP_DROP);
+      carbide_increment_discovery_dropped_requests(result);
+      return 1;
+    }
+    machine.reset(fetched, [](Machine *ptr) { machine_free(ptr); });
+    handle.setContext("machine", machine);
+  } else {
+    handle.getContext("machine", machine);
+  }
   if (!machine) {
     LOG_ERROR(logger, isc::log::LOG_CARBIDE_PKT4_SEND)
         .arg("Missing machine object from handle context");
@@ -498,27 +736,133 @@ int pkt4_send(CalloutHandle &handle) {
     return 1;
   }
 
+  auto build_start = std::chrono::steady_clock::now();
+
   /*
-   * Fetch the interface address for this machine (i.e. this is the address
-   * assigned to the DHCP-ing host.
+   * Everything we need from the machine in one call. The strings in it belong
+   * to the machine, which the handle context keeps alive until we're done.
    */
-  response4_ptr->setYiaddr(
-      isc::asiolink::IOAddress(machine_get_interface_address(machine.get())));
+  MachineResponse response = machine_get_response(machine.get());
 
-  set_options(handle, response4_ptr, machine.get());
+  /*
+   * Set the interface address for this machine (i.e. this is the address
+   * assigned to the DHCP-ing host.
+   */
+  response4_ptr->setYiaddr(isc::asiolink::IOAddress(response.interface_address));
 
   // Set next-server (Siaddr) - server address
-  response4_ptr->setSiaddr(
-      isc::asiolink::IOAddress(machine_get_next_server(machine.get())));
+  response4_ptr->setSiaddr(isc::asiolink::IOAddress(response.next_server));
 
   /*
-   * Encapsulate some PXE options in the vendor encapsulated
+   * Our options, including some PXE options in the vendor encapsulated, replace
+   * any Kea added.
    */
-  set_vendor_options(response4_ptr, machine.get());
+  const MachineOptionSet *option_set =
+      get_option_set(handle, machine.get(), response);
+  if (!option_set) {
+    return 0;
+  }
+  for (const OptionPtr &option : option_set->options) {
+    response4_ptr->delOption(option->getType());
+    response4_ptr->addOption(option);
+  }
+  carbide_observe_stage(PipelineStage::BuildResponse, elapsed_ns(build_start));
+
+  boost::shared_ptr<PacketTrace> trace;
+  if (get_context(handle, "packet_trace", trace) && trace) {
+    carbide_trace_sent(trace.get());
+  }
 
   LOG_INFO(logger, isc::log::LOG_CARBIDE_PKT4_SEND)
+      .arg(packet_summary(response4_ptr));
+  LOG_DEBUG(logger, DBG_CARBIDE_PACKET_DUMP, isc::log::LOG_CARBIDE_PKT4_DUMP)
       .arg(response4_ptr->toText());
 
   return 0;
 }
+
+/*
+ * Control channel commands, registered in loader.cc. They let operators and
+ * carbide-api make the cache forget machines which changed, so the TTLs can be
+ * long without serving stale answers.
+ */
+int carbide_cache_flush_command(CalloutHandle &handle) {
+  ElementPtr arguments = Element::createMap();
+  arguments->set("flushed", count_element(carbide_cache_flush()));
+  handle.setArgument("response",
+                     command_success("carbide cache flushed", arguments));
+  return 0;
+}
+
+/*
+ * Drop the entries matching all of the "mac-address", "link-address" and
+ * "circuit-id" arguments given, at least one of which must be. The link
+ * address is the relay's, or the link selection sub-option when it sends one.
+ */
+int carbide_cache_invalidate_command(CalloutHandle &handle) {
+  ConstElementPtr response;
+  try {
+    ConstElementPtr arguments = command_arguments(handle);
+    if (!arguments || arguments->getType() != Element::map) {
+      isc_throw(isc::BadValue, "arguments must be a map");
+    }
+
+    CacheInvalidation request{ByteView{nullptr, 0}, 0, ByteView{nullptr, 0}};
+    std::vector<uint8_t> mac_address;
+    ConstElementPtr mac_arg = arguments->get("mac-address");
+    if (mac_arg) {
+      mac_address = HWAddr::fromText(mac_arg->stringValue()).hwaddr_;
+      if (mac_address.size() != 6) {
+        isc_throw(isc::BadValue, "mac-address must be 6 bytes");
+      }
+      request.mac_address = ByteView{mac_address.data(), mac_address.size()};
+    }
+    ConstElementPtr link_arg = arguments->get("link-address");
+    if (link_arg) {
+      isc::asiolink::IOAddress link_address(link_arg->stringValue());
+      if (!link_address.isV4() || link_address.isV4Zero()) {
+        isc_throw(isc::BadValue, "link-address must be an IPv4 address");
+      }
+      request.link_address = link_address.toUint32();
+    }
+    std::string circuit_id;
+    ConstElementPtr circuit_arg = arguments->get("circuit-id");
+    if (circuit_arg) {
+      circuit_id = circuit_arg->stringValue();
+      request.circuit_id =
+          ByteView{reinterpret_cast<const uint8_t *>(circuit_id.data()),
+                   circuit_id.size()};
+    }
+    if (!mac_arg && !link_arg && !circuit_arg) {
+      isc_throw(isc::BadValue, "nothing to match, use carbide-cache-flush to "
+                               "drop every entry");
+    }
+
+    ElementPtr result = Element::createMap();
+    result->set("invalidated",
+                count_element(carbide_cache_invalidate(&request)));
+    response = command_success("carbide cache entries invalidated", result);
+  } catch (const std::exception &ex) {
+    response = isc::config::createAnswer(isc::config::CONTROL_RESULT_ERROR,
+                                         ex.what());
+  }
+  handle.setArgument("response", response);
+  return 0;
+}
+
+int carbide_cache_stats_command(CalloutHandle &handle) {
+  CacheStats stats = carbide_cache_stats();
+
+  ElementPtr arguments = Element::createMap();
+  arguments->set("capacity", count_element(stats.capacity));
+  arguments->set("valid", count_element(stats.valid));
+  arguments->set("failing", count_element(stats.failing));
+  arguments->set("failed", count_element(stats.failed));
+  arguments->set("hits", count_element(stats.hits));
+  arguments->set("misses", count_element(stats.misses));
+  arguments->set("negative-hits", count_element(stats.negative_hits));
+  handle.setArgument("response",
+                     command_success("carbide cache statistics", arguments));
+  return 0;
+}
 }
@@ -13,6 +13,7 @@ extern const isc::log::MessageID LOG_CARBIDE_INITIALIZATION;
 extern const isc::log::MessageID LOG_CARBIDE_INVALID_HANDLE;
 extern const isc::log::MessageID LOG_CARBIDE_INVALID_NEXTSERVER_IPV4;
 extern const isc::log::MessageID LOG_CARBIDE_LEASE4_SELECT;
+extern const isc::log::MessageID LOG_CARBIDE_PKT4_DUMP;
 extern const isc::log::MessageID LOG_CARBIDE_PKT4_RECEIVE;
 extern const isc::log::MessageID LOG_CARBIDE_PKT4_SEND;
 
@@ -38,11 +38,21 @@ pub unsafe extern "C" fn load(a: *mut libc::c_void) -> libc::c_int {
         }
     };
 
-    unsafe { shim_load(a) }
+    let loaded = unsafe { shim_load(a) };
+    if loaded == 0 {
+        // Needs the hook parameters, which shim_load has just passed on
+        crate::prewarm::start(crate::snapshot::start());
+        crate::replication::start();
+        crate::trace::start();
+    }
+    loaded
 }
 
 #[unsafe(no_mangle)]
 pub unsafe extern "C" fn unload() -> libc::c_int {
+    crate::snapshot::stop();
+    crate::replication::stop();
+    crate::trace::stop();
     unsafe { shim_unload() }
 }
 
@@ -1,4 +1,5 @@
 #include <hooks/hooks.h>
+#include <hooks/server_hooks.h>
 #include <log/logger.h>
 #include <log/macros.h>
 #include <asiolink/io_address.h>
@@ -28,6 +29,18 @@ extern "C" {
 
 		LOG_INFO(loader_logger, isc::log::LOG_CARBIDE_INITIALIZATION);
 
+		// Must come before anything that starts the Rust runtime (e.g. carbide-metrics-endpoint)
+		ConstElementPtr runtime_worker_threads = handle->getParameter("carbide-runtime-worker-threads");
+		if (runtime_worker_threads) {
+			if (runtime_worker_threads->getType() != Element::integer ||
+			    runtime_worker_threads->intValue() < 1) {
+				LOG_ERROR(loader_logger, isc::log::LOG_CARBIDE_GENERIC)
+				    .arg("carbide-runtime-worker-threads must be a positive integer");
+				return (1);
+			}
+			carbide_set_config_runtime_worker_threads(runtime_worker_threads->intValue());
+		}
+
 		ConstElementPtr next_server  = handle->getParameter("carbide-provisioning-server-ipv4");
 		if (next_server) {
 			if(next_server->getType() != Element::string) {
@@ -108,9 +121,106 @@ extern "C" {
             }
         }
 
+        ConstElementPtr cache_snapshot_path = handle->getParameter("carbide-cache-snapshot-path");
+        if (cache_snapshot_path) {
+            if(cache_snapshot_path->getType() != Element::string) {
+                LOG_ERROR(loader_logger, isc::log::LOG_CARBIDE_GENERIC)
+                    .arg("carbide-cache-snapshot-path must be a string");
+                return (1);
+            } else {
+                carbide_set_config_cache_snapshot_path(cache_snapshot_path->stringValue().c_str());
+            }
+        }
+
+        const std::pair<const char *, void (*)(const char *)> string_parameters[] = {
+            {"carbide-cache-replication-listen", carbide_set_config_cache_replication_listen},
+            {"carbide-cache-replication-peer", carbide_set_config_cache_replication_peer},
+            {"carbide-cache-replication-secret", carbide_set_config_cache_replication_secret},
+            {"carbide-trace-otlp-endpoint", carbide_set_config_trace_otlp_endpoint},
+        };
+        for (const auto &[name, setter] : string_parameters) {
+            ConstElementPtr value = handle->getParameter(name);
+            if (value) {
+                if(value->getType() != Element::string) {
+                    LOG_ERROR(loader_logger, isc::log::LOG_CARBIDE_GENERIC)
+                        .arg(std::string(name) + " must be a string");
+                    return (1);
+                }
+                setter(value->stringValue().c_str());
+            }
+        }
+
+        // Read when the cache and batcher are first used, so these only matter at load time
+        const std::pair<const char *, void (*)(uint32_t)> integer_parameters[] = {
+            {"carbide-cache-size", carbide_set_config_cache_size},
+            {"carbide-cache-ttl-secs", carbide_set_config_cache_ttl_secs},
+            {"carbide-negative-cache-ttl-secs", carbide_set_config_negative_cache_ttl_secs},
+            {"carbide-cache-refresh-ahead-secs", carbide_set_config_cache_refresh_ahead_secs},
+            {"carbide-cache-max-stale-secs", carbide_set_config_cache_max_stale_secs},
+            {"carbide-cache-identity-reuse-secs", carbide_set_config_cache_identity_reuse_secs},
+            {"carbide-cache-snapshot-interval-secs", carbide_set_config_cache_snapshot_interval_secs},
+            {"carbide-discovery-batch-window-us", carbide_set_config_discovery_batch_window_us},
+            {"carbide-discovery-batch-max", carbide_set_config_discovery_batch_max},
+            {"carbide-cache-prewarm-batch", carbide_set_config_cache_prewarm_batch},
+            {"carbide-api-max-in-flight", carbide_set_config_api_max_in_flight},
+            {"carbide-api-deadline-ms", carbide_set_config_api_deadline_ms},
+            {"carbide-api-breaker-failures", carbide_set_config_api_breaker_failures},
+            {"carbide-api-breaker-cooldown-secs", carbide_set_config_api_breaker_cooldown_secs},
+            {"carbide-duplicate-window-ms", carbide_set_config_duplicate_window_ms},
+            {"carbide-duplicate-table-size", carbide_set_config_duplicate_table_size},
+            {"carbide-rate-limit-client-per-sec", carbide_set_config_rate_limit_client_per_sec},
+            {"carbide-rate-limit-client-burst", carbide_set_config_rate_limit_client_burst},
+            {"carbide-rate-limit-relay-per-sec", carbide_set_config_rate_limit_relay_per_sec},
+            {"carbide-rate-limit-relay-burst", carbide_set_config_rate_limit_relay_burst},
+            {"carbide-trace-sample-one-in", carbide_set_config_trace_sample_one_in},
+        };
+        for (const auto &[name, setter] : integer_parameters) {
+            ConstElementPtr value = handle->getParameter(name);
+            if (value) {
+                if(value->getType() != Element::integer ||
+                   value->intValue() < 0 || value->intValue() > UINT32_MAX) {
+                    LOG_ERROR(loader_logger, isc::log::LOG_CARBIDE_GENERIC)
+                        .arg(std::string(name) + " must be a non-negative integer");
+                    return (1);
+                }
+                setter(value->intValue());
+            }
+        }
+
+        const std::pair<const char *, void (*)(bool)> boolean_parameters[] = {
+            {"carbide-async-discovery", carbide_set_config_async_discovery},
+            {"carbide-cache-prewarm", carbide_set_config_cache_prewarm},
+            {"carbide-cache-prewarm-wait-ready", carbide_set_config_cache_prewarm_wait_ready},
+        };
+        for (const auto &[name, setter] : boolean_parameters) {
+            ConstElementPtr value = handle->getParameter(name);
+            if (value) {
+                if(value->getType() != Element::boolean) {
+                    LOG_ERROR(loader_logger, isc::log::LOG_CARBIDE_GENERIC)
+                        .arg(std::string(name) + " must be a boolean");
+                    return (1);
+                }
+                setter(value->boolValue());
+            }
+        }
+
 		handle->registerCallout("pkt4_receive", pkt4_receive);
+		handle->registerCallout("subnet4_select", subnet4_select);
+		handle->registerCallout("lease4_select", lease4_select);
+		// Older Kea has no lease4_offer, a DISCOVER then waits on its packet thread
+		if (ServerHooks::getServerHooks().findIndex("lease4_offer") >= 0) {
+			handle->registerCallout("lease4_offer", lease4_offer);
+		} else if (carbide_get_config_async_discovery()) {
+			LOG_WARN(loader_logger, isc::log::LOG_CARBIDE_GENERIC)
+				.arg("no lease4_offer hook point, DISCOVER packets won't be parked");
+		}
+		handle->registerCallout("leases4_committed", leases4_committed);
 		handle->registerCallout("pkt4_send", pkt4_send);
 
+		handle->registerCommandCallout("carbide-cache-flush", carbide_cache_flush_command);
+		handle->registerCommandCallout("carbide-cache-invalidate", carbide_cache_invalidate_command);
+		handle->registerCommandCallout("carbide-cache-stats", carbide_cache_stats_command);
+
 		return 0;
 	}
 
@@ -59,25 +59,34 @@ impl log::Log for KeaLogger {
     }
 
     fn log(&self, record: &Record) {
-        if self.enabled(record.metadata()) {
-            let text = CString::new(format!(
-                "{}:{}:{} - {}",
-                record.file().unwrap_or("<no file>"),
-                record.line().unwrap_or(0),
-                record.target(),
-                record.args()
-            ))
-            .unwrap();
+        // Nothing is formatted unless Kea would print it
+        if !self.enabled(record.metadata()) {
+            return;
+        }
+
+        let text = CString::new(format!(
+            "{}:{}:{} - {}",
+            record.file().unwrap_or("<no file>"),
+            record.line().unwrap_or(0),
+            record.target(),
+            record.args()
+        ))
+        .unwrap_or_else(|err| {
+            // Keep what we can of a message with a NUL in it
+            let mut bytes = err.into_vec();
+            bytes.retain(|b| *b != 0);
+            CString::new(bytes).unwrap()
+        });
 
-            unsafe {
-                use Level::*;
-                match record.metadata().level() {
-                    Trace => kea_log_generic_debug(KEA_DEBUGLEVEL_TRACE, text.into_raw()),
-                    Debug => kea_log_generic_debug(KEA_DEBUGLEVEL_DEBUG, text.into_raw()),
-                    Info => kea_log_generic_info(text.into_raw()),
-                    Warn => kea_log_generic_warn(text.into_raw()),
-                    Error => kea_log_generic_error(text.into_raw()),
-                }
+        // Kea copies the message, so it's ours to free
+        unsafe {
+            use Level::*;
+            match record.metadata().level() {
+                Trace => kea_log_generic_debug(KEA_DEBUGLEVEL_TRACE, text.as_ptr()),
+                Debug => kea_log_generic_debug(KEA_DEBUGLEVEL_DEBUG, text.as_ptr()),
+                Info => kea_log_generic_info(text.as_ptr()),
+                Warn => kea_log_generic_warn(text.as_ptr()),
+                Error => kea_log_generic_error(text.as_ptr()),
             }
         }
     }
@@ -15,37 +15,77 @@
  * limitations under the License.
  */
 use std::ffi::CStr;
+use std::future::Future;
 use std::net::{Ipv4Addr, SocketAddr};
+use std::path::PathBuf;
+use std::sync::Arc;
 use std::sync::atomic::AtomicI64;
-use std::sync::{Arc, RwLock};
 use std::thread;
+use std::time::Duration;
 
+use arc_swap::ArcSwap;
 use forge_tls::default as tls_default;
 use libc::c_char;
 use metrics_endpoint::HealthController;
 use once_cell::sync::Lazy;
-use opentelemetry::metrics::Counter;
 use rpc::forge_tls_client::ForgeClientConfig;
 use tokio::runtime::{Builder, Runtime};
+use tokio::sync::oneshot;
 
-mod cache;
-mod discovery;
+mod admission;
+mod api_client;
+mod batch;
+// pub for benches/cache_key.rs and benches/ffi.rs
+pub mod cache;
+// pub for benches/ffi.rs
+pub mod discovery;
+mod duplicates;
 mod kea;
 mod kea_logger;
-mod machine;
+// pub for benches/ffi.rs
+pub mod machine;
+mod pending_discovery;
+mod prewarm;
+mod rate_limit;
+mod replication;
+mod snapshot;
 mod vendor_class;
 
 // Should be #[cfg(test)] but tests/integration_test.rs also uses it
 mod metrics;
 pub mod mock_api_server;
 mod tls;
+mod trace;
 
-static CONFIG: Lazy<RwLock<CarbideDhcpContext>> =
-    Lazy::new(|| RwLock::new(CarbideDhcpContext::default()));
+/// The current config, read with `CONFIG.load()`
+///
+/// Packet threads read it on every packet, so it's an immutable snapshot behind one atomic
+/// pointer rather than a lock. The `carbide_set_config_*` calls publish a new snapshot with
+/// `update_config`, which readers pick up on their next load.
+static CONFIG: Lazy<ArcSwap<CarbideDhcpContext>> =
+    Lazy::new(|| ArcSwap::from_pointee(CarbideDhcpContext::default()));
+
+/// Publish a copy of the config with `update` applied
+///
+/// `update` can run more than once if another update lands at the same time. Cached machines
+/// are flushed if anything their responses are built from changed, see `ResponseFields`.
+fn update_config(update: impl Fn(&mut CarbideDhcpContext)) {
+    let previous = CONFIG.rcu(|current| {
+        let mut next = CarbideDhcpContext::clone(current);
+        update(&mut next);
+        next
+    });
+    if !previous.same_response_fields(&CONFIG.load()) {
+        cache::response_config_changed();
+    }
+}
 
 static LOGGER: kea_logger::KeaLogger = kea_logger::KeaLogger;
 
-#[derive(Debug)]
+/// How many threads the tokio runtime gets unless `carbide-runtime-worker-threads` says otherwise
+const DEFAULT_RUNTIME_WORKER_THREADS: usize = 4;
+
+#[derive(Debug, Clone)]
 pub struct CarbideDhcpContext {
     api_endpoint: String,
     nameservers: String,
@@ -56,6 +96,36 @@ pub struct CarbideDhcpContext {
     forge_client_cert_path: String,
     forge_client_key_path: String,
     metrics_endpoint: Option<SocketAddr>,
+    runtime_worker_threads: usize,
+    async_discovery: bool,
+    cache_size: usize,
+    cache_ttl: Duration,
+    negative_cache_ttl: Duration,
+    cache_refresh_ahead: Duration,
+    cache_max_stale: Duration,
+    cache_snapshot_path: Option<PathBuf>,
+    cache_snapshot_interval: Duration,
+    cache_prewarm: bool,
+    cache_prewarm_batch: usize,
+    cache_prewarm_wait_ready: bool,
+    cache_identity_reuse: Duration,
+    cache_replication_listen: Option<SocketAddr>,
+    cache_replication_peer: Option<SocketAddr>,
+    cache_replication_secret: Option<String>,
+    discovery_batch_window: Duration,
+    discovery_batch_max: usize,
+    api_max_in_flight: usize,
+    api_deadline: Duration,
+    api_breaker_failures: u32,
+    api_breaker_cooldown: Duration,
+    duplicate_window: Duration,
+    duplicate_table_size: usize,
+    rate_limit_client_per_sec: u32,
+    rate_limit_client_burst: u32,
+    rate_limit_relay_per_sec: u32,
+    rate_limit_relay_burst: u32,
+    trace_otlp_endpoint: Option<String>,
+    trace_sample_one_in: u32,
     metrics: Option<CarbideDhcpMetrics>,
     health_controller: Option<HealthController>,
     startup_time: chrono::DateTime<chrono::Utc>,
@@ -63,8 +133,6 @@ pub struct CarbideDhcpContext {
 
 #[derive(Debug, Clone)]
 pub struct CarbideDhcpMetrics {
-    total_requests_counter: Counter<u64>,
-    dropped_requests_counter: Counter<u64>,
     forge_client_config: ForgeClientConfig,
     certificate_expiration_value: Arc<AtomicI64>,
 }
@@ -84,6 +152,36 @@ impl Default for CarbideDhcpContext {
             mqtt_server: None,
             provisioning_server_ipv4: None,
             metrics_endpoint: None,
+            runtime_worker_threads: DEFAULT_RUNTIME_WORKER_THREADS,
+            async_discovery: false,
+            cache_size: cache::MACHINE_CACHE_SIZE,
+            cache_ttl: cache::MACHINE_CACHE_TIMEOUT,
+            negative_cache_ttl: cache::MACHINE_DISC_FAILED_CACHE_TIMEOUT,
+            cache_refresh_ahead: cache::MACHINE_CACHE_REFRESH_AHEAD,
+            cache_max_stale: Duration::ZERO,
+            cache_snapshot_path: None,
+            cache_snapshot_interval: snapshot::DEFAULT_SNAPSHOT_INTERVAL,
+            cache_prewarm: false,
+            cache_prewarm_batch: prewarm::DEFAULT_PREWARM_BATCH,
+            cache_prewarm_wait_ready: false,
+            cache_identity_reuse: Duration::ZERO,
+            cache_replication_listen: None,
+            cache_replication_peer: None,
+            cache_replication_secret: None,
+            discovery_batch_window: Duration::ZERO,
+            discovery_batch_max: batch::DEFAULT_BATCH_MAX,
+            api_max_in_flight: admission::DEFAULT_MAX_IN_FLIGHT,
+            api_deadline: admission::DEFAULT_DEADLINE,
+            api_breaker_failures: admission::DEFAULT_BREAKER_FAILURES,
+            api_breaker_cooldown: admission::DEFAULT_BREAKER_COOLDOWN,
+            duplicate_window: duplicates::DEFAULT_DUPLICATE_WINDOW,
+            duplicate_table_size: duplicates::DEFAULT_DUPLICATE_TABLE_SIZE,
+            rate_limit_client_per_sec: 0,
+            rate_limit_client_burst: rate_limit::DEFAULT_CLIENT_BURST,
+            rate_limit_relay_per_sec: 0,
+            rate_limit_relay_burst: rate_limit::DEFAULT_RELAY_BURST,
+            trace_otlp_endpoint: None,
+            trace_sample_one_in: 0,
             metrics: None,
             health_controller: None,
             startup_time: chrono::Utc::now(),
@@ -92,9 +190,16 @@ impl Default for CarbideDhcpContext {
 }
 
 impl CarbideDhcpContext {
+    /// The runtime all API calls run on.
+    ///
+    /// It has its own pool of worker threads, sized by `carbide-runtime-worker-threads`, so it
+    /// must be configured before the first call here.
     pub fn get_tokio_runtime() -> &'static Runtime {
         static TOKIO: Lazy<Runtime> = Lazy::new(|| {
-            let runtime = Builder::new_current_thread()
+            let worker_threads = CONFIG.load().runtime_worker_threads;
+            let runtime = Builder::new_multi_thread()
+                .worker_threads(worker_threads)
+                .thread_name("carbide-dhcp-rt")
                 .enable_all()
                 .build()
                 .expect("unable to build runtime?");
@@ -106,6 +211,31 @@ impl CarbideDhcpContext {
 
         &TOKIO
     }
+
+    /// Run `future` on the runtime's worker threads and block the calling thread until it is done.
+    ///
+    /// Kea packet threads use this instead of `Runtime::block_on`, so they only wait for the
+    /// result instead of taking turns driving the runtime. Returns None if the task panicked.
+    pub fn run_on_runtime<F>(future: F) -> Option<F::Output>
+    where
+        F: Future + Send + 'static,
+        F::Output: Send + 'static,
+    {
+        let (tx, rx) = oneshot::channel();
+        Self::get_tokio_runtime().spawn(async move {
+            // The receiver only goes away if the waiting thread did, nothing to do then
+            let _ = tx.send(future.await);
+        });
+        rx.blocking_recv().ok()
+    }
+
+    /// Whether a machine's `ResponseFields` come out the same under both configs
+    fn same_response_fields(&self, other: &Self) -> bool {
+        self.nameservers == other.nameservers
+            && self.ntpservers == other.ntpservers
+            && self.mqtt_server == other.mqtt_server
+            && self.provisioning_server_ipv4 == other.provisioning_server_ipv4
+    }
 }
 
 /// Take the config parameter from Kea and configure it as our API endpoint
@@ -118,7 +248,7 @@ impl CarbideDhcpContext {
 pub unsafe extern "C" fn carbide_set_config_api(api: *const c_char) {
     unsafe {
         let config_api = CStr::from_ptr(api).to_str().unwrap().to_owned();
-        CONFIG.write().unwrap().api_endpoint = config_api;
+        update_config(|config| config.api_endpoint = config_api.clone());
     }
 }
 
@@ -131,8 +261,478 @@ pub unsafe extern "C" fn carbide_set_config_api(api: *const c_char) {
 ///
 #[unsafe(no_mangle)]
 pub extern "C" fn carbide_set_config_next_server_ipv4(next_server: u32) {
-    CONFIG.write().unwrap().provisioning_server_ipv4 =
-        Some(Ipv4Addr::from(next_server.to_be_bytes()));
+    update_config(|config| {
+        config.provisioning_server_ipv4 = Some(Ipv4Addr::from(next_server.to_be_bytes()))
+    });
+}
+
+/// Take the number of worker threads for the tokio runtime which runs our API calls.
+///
+/// Must be called before anything starts the runtime, the thread count can't be changed after.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_runtime_worker_threads(worker_threads: u32) {
+    if worker_threads == 0 {
+        log::error!("carbide-runtime-worker-threads must be at least 1, ignoring");
+        return;
+    }
+    update_config(|config| config.runtime_worker_threads = worker_threads as usize);
+}
+
+/// Enable or disable asynchronous discovery, see `pending_discovery`.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_async_discovery(enabled: bool) {
+    update_config(|config| config.async_discovery = enabled);
+}
+
+/// Whether pkt4_receive should use `discovery_start_for` rather than
+/// `discovery_fetch_machine_for`
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_get_config_async_discovery() -> bool {
+    CONFIG.load().async_discovery
+}
+
+/// Take the number of machines to keep in the cache
+///
+/// Must be called before the first packet, the cache is sized when it's first used. The size
+/// is rounded up to a multiple of the cache's 16 shards, see `cache::capacity`.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_cache_size(cache_size: u32) {
+    if cache_size == 0 {
+        log::error!("carbide-cache-size must be at least 1, ignoring");
+        return;
+    }
+    let cache_size = cache_size as usize;
+    if cache_size < cache::CACHE_SHARDS {
+        log::warn!(
+            "carbide-cache-size {cache_size} is less than one entry for each of the {} cache shards, using {}",
+            cache::CACHE_SHARDS,
+            cache::capacity(cache_size)
+        );
+    }
+    update_config(|config| config.cache_size = cache::capacity(cache_size));
+}
+
+/// Take how long, in seconds, a machine fetched from carbide-api stays in the cache
+///
+/// Must be called before the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_cache_ttl_secs(ttl_secs: u32) {
+    update_config(|config| config.cache_ttl = Duration::from_secs(ttl_secs.into()));
+}
+
+/// Take how long, in seconds, a machine can be reused for a packet with another vendor class
+///
+/// 0, the default, asks carbide-api again for each vendor class. Capped at the cache TTL.
+/// Must be called before the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_cache_identity_reuse_secs(reuse_secs: u32) {
+    update_config(|config| config.cache_identity_reuse = Duration::from_secs(reuse_secs.into()));
+}
+
+/// Take how long, in seconds, a failed discovery stays in the cache
+///
+/// Must be called before the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_negative_cache_ttl_secs(ttl_secs: u32) {
+    update_config(|config| config.negative_cache_ttl = Duration::from_secs(ttl_secs.into()));
+}
+
+/// Take how long, in seconds, before its TTL runs out a machine hit in the cache is refreshed
+/// from carbide-api in the background
+///
+/// 0 turns the refresh off unless `carbide-cache-max-stale-secs` is set. Must be called before
+/// the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_cache_refresh_ahead_secs(refresh_secs: u32) {
+    update_config(|config| config.cache_refresh_ahead = Duration::from_secs(refresh_secs.into()));
+}
+
+/// Take how long, in seconds, past its TTL a machine can still be answered from the cache
+/// while it is refreshed in the background
+///
+/// 0, the default, drops a machine as soon as its TTL runs out. Must be called before the first
+/// packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_cache_max_stale_secs(max_stale_secs: u32) {
+    update_config(|config| config.cache_max_stale = Duration::from_secs(max_stale_secs.into()));
+}
+
+/// Take the file to keep the cache snapshot in, see snapshot.rs
+///
+/// An empty path turns the snapshot off, which is the default. Must be called before the hook
+/// finishes loading.
+///
+/// # Safety
+/// Function is unsafe as it dereferences a raw pointer given to it.  Caller is responsible
+/// to validate that the pointer passed to it meets the necessary conditions to be dereferenced.
+///
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn carbide_set_config_cache_snapshot_path(path: *const c_char) {
+    unsafe {
+        let path = CStr::from_ptr(path).to_str().unwrap();
+        update_config(|config| {
+            config.cache_snapshot_path = (!path.is_empty()).then(|| PathBuf::from(path))
+        });
+    }
+}
+
+/// Take how often, in seconds, to write the cache snapshot
+///
+/// 0 only writes it when the hook is unloaded. Must be called before the hook finishes
+/// loading.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_cache_snapshot_interval_secs(interval_secs: u32) {
+    update_config(|config| {
+        config.cache_snapshot_interval = Duration::from_secs(interval_secs.into())
+    });
+}
+
+/// Enable or disable fetching the machines which expired from the snapshot again at load, see
+/// prewarm.rs
+///
+/// Must be called before the hook finishes loading.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_cache_prewarm(enabled: bool) {
+    update_config(|config| config.cache_prewarm = enabled);
+}
+
+/// Take how many machines to prewarm with one FindDhcpRecords call
+///
+/// At most `batch::MAX_BATCH_SIZE`, which carbide-api refuses to go over. Must be called before
+/// the hook finishes loading.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_cache_prewarm_batch(batch_size: u32) {
+    if batch_size == 0 {
+        log::error!("carbide-cache-prewarm-batch must be at least 1, ignoring");
+        return;
+    }
+    let batch_size = if batch_size as usize > batch::MAX_BATCH_SIZE {
+        log::warn!(
+            "carbide-cache-prewarm-batch {batch_size} is more than carbide-api takes, using {}",
+            batch::MAX_BATCH_SIZE
+        );
+        batch::MAX_BATCH_SIZE
+    } else {
+        batch_size as usize
+    };
+    update_config(|config| config.cache_prewarm_batch = batch_size);
+}
+
+/// Whether readiness waits for prewarming to finish
+///
+/// Must be called before the hook finishes loading.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_cache_prewarm_wait_ready(enabled: bool) {
+    update_config(|config| config.cache_prewarm_wait_ready = enabled);
+}
+
+/// Parse an optional socket address parameter, empty for none
+///
+/// Returns Err, having logged it, if it isn't a socket address.
+fn parse_socket_addr(name: &str, value: &str) -> Result<Option<SocketAddr>, ()> {
+    if value.is_empty() {
+        return Ok(None);
+    }
+    value.parse().map(Some).map_err(|err| {
+        log::error!("{name} {value} is not an address and port, ignoring: {err}");
+    })
+}
+
+/// Take the address to receive cache updates from the HA peer on, see replication.rs
+///
+/// Empty doesn't receive any, which is the default. Must be called before the hook finishes
+/// loading.
+///
+/// # Safety
+/// Function is unsafe as it dereferences a raw pointer given to it.  Caller is responsible
+/// to validate that the pointer passed to it meets the necessary conditions to be dereferenced.
+///
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn carbide_set_config_cache_replication_listen(listen: *const c_char) {
+    let listen = unsafe { CStr::from_ptr(listen) }.to_str().unwrap();
+    if let Ok(listen) = parse_socket_addr("carbide-cache-replication-listen", listen) {
+        update_config(|config| config.cache_replication_listen = listen);
+    }
+}
+
+/// Take the address of the HA peer to send cache updates to, see replication.rs
+///
+/// Empty doesn't send any, which is the default. Must be called before the hook finishes
+/// loading.
+///
+/// # Safety
+/// Function is unsafe as it dereferences a raw pointer given to it.  Caller is responsible
+/// to validate that the pointer passed to it meets the necessary conditions to be dereferenced.
+///
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn carbide_set_config_cache_replication_peer(peer: *const c_char) {
+    let peer = unsafe { CStr::from_ptr(peer) }.to_str().unwrap();
+    if let Ok(peer) = parse_socket_addr("carbide-cache-replication-peer", peer) {
+        update_config(|config| config.cache_replication_peer = peer);
+    }
+}
+
+/// Take the secret both HA peers sign cache updates with
+///
+/// Must be called before the hook finishes loading.
+///
+/// # Safety
+/// Function is unsafe as it dereferences a raw pointer given to it.  Caller is responsible
+/// to validate that the pointer passed to it meets the necessary conditions to be dereferenced.
+///
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn carbide_set_config_cache_replication_secret(secret: *const c_char) {
+    let secret = unsafe { CStr::from_ptr(secret) }.to_str().unwrap();
+    update_config(|config| {
+        config.cache_replication_secret = (!secret.is_empty()).then(|| secret.to_string())
+    });
+}
+
+/// Take how long, in microseconds, to gather discoveries into one DiscoverDhcpBatch
+///
+/// 0, the default, sends every discovery on its own. Must be called before the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_discovery_batch_window_us(window_us: u32) {
+    update_config(|config| config.discovery_batch_window = Duration::from_micros(window_us.into()));
+}
+
+/// Take the most discoveries to send in one DiscoverDhcpBatch
+///
+/// At most `batch::MAX_BATCH_SIZE`, which carbide-api refuses to go over. Must be called before
+/// the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_discovery_batch_max(batch_max: u32) {
+    if batch_max == 0 {
+        log::error!("carbide-discovery-batch-max must be at least 1, ignoring");
+        return;
+    }
+    let batch_max = if batch_max as usize > batch::MAX_BATCH_SIZE {
+        log::warn!(
+            "carbide-discovery-batch-max {batch_max} is more than carbide-api takes, using {}",
+            batch::MAX_BATCH_SIZE
+        );
+        batch::MAX_BATCH_SIZE
+    } else {
+        batch_max as usize
+    };
+    update_config(|config| config.discovery_batch_max = batch_max);
+}
+
+/// Take the most discoveries which can wait on carbide-api at once, see admission.rs
+///
+/// Must be called before the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_api_max_in_flight(max_in_flight: u32) {
+    if max_in_flight == 0 {
+        log::error!("carbide-api-max-in-flight must be at least 1, ignoring");
+        return;
+    }
+    update_config(|config| config.api_max_in_flight = max_in_flight as usize);
+}
+
+/// Take how long, in milliseconds, a discovery can wait on carbide-api before it is dropped
+///
+/// 0 waits for as long as the API client keeps trying. Must be called before the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_api_deadline_ms(deadline_ms: u32) {
+    update_config(|config| config.api_deadline = Duration::from_millis(deadline_ms.into()));
+}
+
+/// Take how many carbide-api calls in a row have to fail before discoveries stop calling it
+///
+/// 0 never stops calling it. Must be called before the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_api_breaker_failures(failures: u32) {
+    update_config(|config| config.api_breaker_failures = failures);
+}
+
+/// Take how long, in seconds, to stop calling carbide-api for before trying it again
+///
+/// Must be called before the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_api_breaker_cooldown_secs(cooldown_secs: u32) {
+    update_config(|config| config.api_breaker_cooldown = Duration::from_secs(cooldown_secs.into()));
+}
+
+/// Take how long, in milliseconds, a packet holds back copies of itself, see duplicates.rs
+///
+/// 0 lets every copy through. Must be called before the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_duplicate_window_ms(window_ms: u32) {
+    update_config(|config| config.duplicate_window = Duration::from_millis(window_ms.into()));
+}
+
+/// Take the most packets to look for copies of at once
+///
+/// Must be called before the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_duplicate_table_size(table_size: u32) {
+    if table_size == 0 {
+        log::error!("carbide-duplicate-table-size must be at least 1, ignoring");
+        return;
+    }
+    update_config(|config| config.duplicate_table_size = table_size as usize);
+}
+
+/// Take how many packets per second each MAC address gets handled, see rate_limit.rs
+///
+/// 0 doesn't limit them. Must be called before the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_rate_limit_client_per_sec(per_sec: u32) {
+    update_config(|config| config.rate_limit_client_per_sec = per_sec);
+}
+
+/// Take how many packets a MAC address can send at once before its rate limit applies
+///
+/// Must be called before the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_rate_limit_client_burst(burst: u32) {
+    update_config(|config| config.rate_limit_client_burst = burst);
+}
+
+/// Take how many packets per second each relay gets handled, see rate_limit.rs
+///
+/// 0 doesn't limit them. Must be called before the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_rate_limit_relay_per_sec(per_sec: u32) {
+    update_config(|config| config.rate_limit_relay_per_sec = per_sec);
+}
+
+/// Take how many packets a relay can send at once before its rate limit applies
+///
+/// Must be called before the first packet.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_rate_limit_relay_burst(burst: u32) {
+    update_config(|config| config.rate_limit_relay_burst = burst);
+}
+
+/// Take the OTLP collector to send packet traces to, e.g. `http://localhost:4317`
+///
+/// Empty doesn't trace, which is the default. Must be called before the hook finishes
+/// loading.
+///
+/// # Safety
+/// Function is unsafe as it dereferences a raw pointer given to it.  Caller is responsible
+/// to validate that the pointer passed to it meets the necessary conditions to be dereferenced.
+///
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn carbide_set_config_trace_otlp_endpoint(endpoint: *const c_char) {
+    let endpoint = unsafe { CStr::from_ptr(endpoint) }.to_str().unwrap();
+    update_config(|config| {
+        config.trace_otlp_endpoint = (!endpoint.is_empty()).then(|| endpoint.to_string())
+    });
+}
+
+/// Take one in how many packets to trace
+///
+/// 0, the default, traces none. Must be called before the hook finishes loading.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub extern "C" fn carbide_set_config_trace_sample_one_in(one_in: u32) {
+    update_config(|config| config.trace_sample_one_in = one_in);
 }
 
 /// Take the name servers for configuring nameservers in the dhcp responses
@@ -145,7 +745,7 @@ pub extern "C" fn carbide_set_config_next_server_ipv4(next_server: u32) {
 pub unsafe extern "C" fn carbide_set_config_name_servers(nameservers: *const c_char) {
     unsafe {
         let nameserver_str = CStr::from_ptr(nameservers).to_str().unwrap().to_owned();
-        CONFIG.write().unwrap().nameservers = nameserver_str;
+        update_config(|config| config.nameservers = nameserver_str.clone());
     }
 }
 
@@ -159,7 +759,7 @@ pub unsafe extern "C" fn carbide_set_config_name_servers(nameservers: *const c_c
 pub unsafe extern "C" fn carbide_set_config_mqtt_server(mqttserver: *const c_char) {
     unsafe {
         let mqttserver_str = CStr::from_ptr(mqttserver).to_str().unwrap().to_owned();
-        CONFIG.write().unwrap().mqtt_server = Some(mqttserver_str);
+        update_config(|config| config.mqtt_server = Some(mqttserver_str.clone()));
     }
 }
 
@@ -173,7 +773,7 @@ pub unsafe extern "C" fn carbide_set_config_mqtt_server(mqttserver: *const c_cha
 pub unsafe extern "C" fn carbide_set_config_ntp(ntpservers: *const c_char) {
     unsafe {
         let ntp_str = CStr::from_ptr(ntpservers).to_str().unwrap().to_owned();
-        CONFIG.write().unwrap().ntpservers = ntp_str;
+        update_config(|config| config.ntpservers = ntp_str.clone());
     }
 }
 
@@ -190,7 +790,7 @@ pub unsafe extern "C" fn carbide_set_config_metrics_endpoint(endpoint: *const c_
         match config_metrics_endpoint.parse::<SocketAddr>() {
             Ok(metrics_endpoint) => {
                 log::info!("metrics endpoint: {config_metrics_endpoint}");
-                CONFIG.write().unwrap().metrics_endpoint = Some(metrics_endpoint);
+                update_config(|config| config.metrics_endpoint = Some(metrics_endpoint));
                 // this will initiate metrics server
                 CarbideDhcpContext::get_tokio_runtime();
             }
@@ -211,15 +811,36 @@ pub unsafe extern "C" fn carbide_increment_total_requests() {
     metrics::increment_total_requests();
 }
 
+/// Records how long a stage of handling a packet took, in nanoseconds
+///
+/// Cheap enough to call on every packet. Nothing is recorded without a metrics endpoint.
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn carbide_observe_stage(stage: metrics::PipelineStage, elapsed_ns: u64) {
+    metrics::observe_stage(stage, Duration::from_nanos(elapsed_ns));
+}
+
 /// Increments counter for number of dropped requests
 ///
 /// # Safety
 ///
 /// None
 #[unsafe(no_mangle)]
-pub unsafe extern "C" fn carbide_increment_dropped_requests(reason: *const c_char) {
-    unsafe {
-        let reason_value = CStr::from_ptr(reason).to_str().unwrap().to_owned();
-        metrics::increment_dropped_requests(reason_value);
-    }
+pub unsafe extern "C" fn carbide_increment_dropped_requests(reason: metrics::DropReason) {
+    metrics::increment_dropped_requests(reason);
+}
+
+/// Increments counter for number of dropped requests, because of a failed discovery
+///
+/// # Safety
+///
+/// None
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn carbide_increment_discovery_dropped_requests(
+    result: discovery::DiscoveryBuilderResult,
+) {
+    metrics::increment_dropped_requests(result.into());
 }
@@ -14,73 +14,322 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
-use std::ffi::CString;
+use std::collections::HashSet;
+use std::ffi::{CStr, CString, c_void};
 use std::net::{IpAddr, Ipv4Addr};
 use std::ptr;
+use std::sync::{Arc, Mutex, OnceLock};
 
 use ::rpc::forge as rpc;
-use ::rpc::forge_tls_client::{self, ApiConfig, ForgeClientConfig};
+use ::rpc::forge_api_client::ForgeApiClient;
 use MachineArchitecture::*;
+use chrono::{DateTime, Utc};
 use ipnetwork::IpNetwork;
+use lazy_static::lazy_static;
 
 use crate::CONFIG;
 use crate::discovery::Discovery;
 use crate::vendor_class::{MachineArchitecture, VendorClass};
 
+/// Strings to keep one copy of, past that each machine gets its own
+const MAX_INTERNED: usize = 256;
+
+lazy_static! {
+    /// Strings which are the same for many machines: the servers from Kea's config and the
+    /// vendor class ids clients send
+    static ref INTERNED: Mutex<HashSet<Arc<CStr>>> = Mutex::new(HashSet::new());
+}
+
 /// Machine: a machine that's currently trying to boot something
 ///
-/// This just stores the protobuf DHCP record and the discovery info the client used so we can add
-/// additional constraints (options) to and from the client.
+/// This just stores what carbide-api told us about the machine and the discovery info the client
+/// used so we can add additional constraints (options) to and from the client.
 ///
 #[derive(Debug, Clone)]
 pub struct Machine {
-    pub inner: rpc::DhcpRecord,
+    pub record: Arc<MachineRecord>,
     pub discovery_info: Discovery,
     pub vendor_class: Option<VendorClass>,
+    response: ResponseFields,
+    option_set: OptionSetSlot,
 }
 
 impl Machine {
+    pub fn new(
+        inner: rpc::DhcpRecord,
+        discovery_info: Discovery,
+        vendor_class: Option<VendorClass>,
+    ) -> Self {
+        Machine::from_record(
+            Arc::new(MachineRecord::new(&inner)),
+            discovery_info,
+            vendor_class,
+        )
+    }
+
+    /// The machine for another discovery with the same record, e.g. read back from the
+    /// snapshot or sent with another vendor class. The record is shared, not copied.
+    pub fn from_record(
+        record: Arc<MachineRecord>,
+        discovery_info: Discovery,
+        vendor_class: Option<VendorClass>,
+    ) -> Self {
+        let response = ResponseFields::new(&record, &vendor_class);
+        Machine {
+            record,
+            discovery_info,
+            vendor_class,
+            response,
+            option_set: OptionSetSlot::default(),
+        }
+    }
+
     pub async fn try_fetch(
         discovery: Discovery,
-        carbide_api_url: &str,
+        client: &ForgeApiClient,
         vendor_class: Option<VendorClass>,
-        client_config: &ForgeClientConfig,
-    ) -> Result<Self, String> {
-        let api_config = ApiConfig::new(carbide_api_url, client_config);
-        match forge_tls_client::ForgeTlsClient::retry_build(&api_config).await {
-            Ok(mut client) => {
-                let request = tonic::Request::new(rpc::DhcpDiscovery {
-                    mac_address: discovery.mac_address.to_string(),
-                    relay_address: discovery.relay_address.to_string(),
-                    link_address: discovery.link_select_address.map(|addr| addr.to_string()),
-                    vendor_string: discovery.vendor_class.clone(),
-                    circuit_id: discovery.circuit_id.clone(),
-                    remote_id: discovery.remote_id.clone(),
-                    desired_address: discovery.desired_address.clone(),
-                });
-
-                client
-                    .discover_dhcp(request)
-                    .await
-                    .map(|response| Machine {
-                        inner: response.into_inner(),
-                        discovery_info: discovery,
-                        vendor_class,
-                    })
-                    .map_err(|error| format!("unable to discover machine via Carbide: {error:?}"))
-            }
-            Err(err) => Err(format!("unable to connect to Carbide API: {err:?}")),
-        }
+    ) -> Result<Self, tonic::Status> {
+        let request = discovery_request(&discovery);
+
+        crate::batch::discover_dhcp(client, request)
+            .await
+            .map(|inner| Machine::new(inner, discovery, vendor_class))
     }
 
     pub fn booturl(&self) -> Option<&str> {
-        self.inner.booturl.as_deref()
+        self.record.booturl.as_deref()
+    }
+}
+
+/// What we keep of the DhcpRecord from carbide-api
+///
+/// Only what responses are built from, decoded once when the record comes in. The ids, the
+/// segment and the rest aren't needed after the fetch and aren't kept, so a cached machine
+/// is a fraction of the size of the record.
+///
+/// Addresses are IPv4, as big endian ints, with 0 meaning carbide-api didn't send a usable one.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct MachineRecord {
+    pub interface_address: u32,
+    pub router: u32,
+    pub subnet_mask: u32,
+    pub broadcast_address: u32,
+    pub mtu: u16,
+    pub hostname: CString,
+    /// Where carbide-api wants the machine to boot from, if it said
+    pub booturl: Option<Box<str>>,
+    /// The machine interface id, empty if the record didn't have one
+    pub uuid: CString,
+    /// The last time carbide-api invalidated any DHCP record, see `Fetch::fetch`
+    pub last_invalidation: Option<DateTime<Utc>>,
+}
+
+impl MachineRecord {
+    pub fn new(record: &rpc::DhcpRecord) -> Self {
+        MachineRecord {
+            interface_address: interface_address(record),
+            router: interface_router(record),
+            subnet_mask: interface_subnet_mask(record),
+            broadcast_address: broadcast_address(record),
+            mtu: record.mtu as u16,
+            hostname: c_string(record.fqdn.clone()),
+            booturl: record.booturl.as_deref().map(Box::from),
+            uuid: c_string(uuid(record)),
+            last_invalidation: record
+                .last_invalidation_time
+                .and_then(|time| DateTime::<Utc>::try_from(time).ok()),
+        }
+    }
+}
+
+/// What we ask carbide-api for `discovery`
+pub(crate) fn discovery_request(discovery: &Discovery) -> rpc::DhcpDiscovery {
+    rpc::DhcpDiscovery {
+        mac_address: discovery.mac_address.to_string(),
+        relay_address: discovery.relay_address.to_string(),
+        link_address: discovery.link_select_address.map(|addr| addr.to_string()),
+        vendor_string: discovery.vendor_class.clone(),
+        circuit_id: discovery.circuit_id.clone(),
+        remote_id: discovery.remote_id.clone(),
+        desired_address: discovery.desired_address.clone(),
+    }
+}
+
+/// What pkt4_send puts in the response besides the record, worked out once when the machine
+/// is fetched
+///
+/// The strings are kept as C strings so `machine_get_response` can hand out pointers to them
+/// without allocating. A cached machine answers many packets. The ones most machines have in
+/// common are interned. Changing the config they come from flushes the cache, see
+/// `cache::response_config_changed`.
+#[derive(Debug, Clone)]
+struct ResponseFields {
+    next_server: u32,
+    filename: Option<CString>,
+    client_type: Arc<CStr>,
+    nameservers: Arc<CStr>,
+    ntpservers: Arc<CStr>,
+    mqtt_server: Option<Arc<CStr>>,
+}
+
+impl ResponseFields {
+    fn new(record: &MachineRecord, vendor_class: &Option<VendorClass>) -> Self {
+        let config = CONFIG.load();
+        log::debug!(
+            "Nameservers are {:?}, ntp servers are {:?}, MQTT server is {:?}",
+            config.nameservers,
+            config.ntpservers,
+            config.mqtt_server
+        );
+
+        ResponseFields {
+            next_server: u32::from_be_bytes(
+                config
+                    .provisioning_server_ipv4
+                    .unwrap_or(Ipv4Addr::LOCALHOST)
+                    .octets(),
+            ),
+            filename: filename(record, vendor_class, config.provisioning_server_ipv4).map(c_string),
+            client_type: intern(
+                vendor_class
+                    .as_ref()
+                    .map(|vc| vc.id.as_str())
+                    .unwrap_or_default(),
+            ),
+            nameservers: intern(&config.nameservers),
+            ntpservers: intern(&config.ntpservers),
+            mqtt_server: config.mqtt_server.as_deref().map(intern),
+        }
+    }
+}
+
+/// The response fields of a machine, in one go
+///
+/// The string fields point into the `Machine` and are only valid until it's freed with
+/// `machine_free`. They're never null unless noted, an empty string means "not set".
+///
+/// Addresses are IPv4, as big endian ints.
+#[repr(C)]
+pub struct MachineResponse {
+    pub interface_address: u32,
+    pub router: u32,
+    pub subnet_mask: u32,
+    pub broadcast_address: u32,
+    /// next-server (siaddr)
+    pub next_server: u32,
+    pub mtu: u16,
+    pub hostname: *const libc::c_char,
+    /// Null if the client doesn't netboot or we don't know what it should boot
+    pub filename: *const libc::c_char,
+    pub client_type: *const libc::c_char,
+    pub uuid: *const libc::c_char,
+    /// Comma separated
+    pub nameservers: *const libc::c_char,
+    /// Comma separated
+    pub ntpservers: *const libc::c_char,
+    /// Null if no MQTT server is configured
+    pub mqtt_server: *const libc::c_char,
+}
+
+/// Get everything needed to build the response for this machine
+///
+/// # Safety
+///
+/// This function dereferences a pointer to a Machine object which is an opaque pointer
+/// consumed in C code. The strings in the result borrow from it, see `MachineResponse`.
+///
+#[unsafe(no_mangle)]
+pub extern "C" fn machine_get_response(ctx: *const Machine) -> MachineResponse {
+    assert!(!ctx.is_null());
+    let machine = unsafe { &*ctx };
+    let record = &machine.record;
+    let fields = &machine.response;
+
+    MachineResponse {
+        interface_address: record.interface_address,
+        router: record.router,
+        subnet_mask: record.subnet_mask,
+        broadcast_address: record.broadcast_address,
+        next_server: fields.next_server,
+        mtu: record.mtu,
+        hostname: record.hostname.as_ptr(),
+        filename: fields.filename.as_ref().map_or(ptr::null(), |f| f.as_ptr()),
+        client_type: fields.client_type.as_ptr(),
+        uuid: record.uuid.as_ptr(),
+        nameservers: fields.nameservers.as_ptr(),
+        ntpservers: fields.ntpservers.as_ptr(),
+        mqtt_server: fields
+            .mqtt_server
+            .as_ref()
+            .map_or(ptr::null(), |m| m.as_ptr()),
+    }
+}
+
+/// Frees an option set attached with `machine_set_option_set`
+pub type OptionSetFree = extern "C" fn(option_set: *mut c_void);
+
+/// The options the C++ side built for this machine's responses
+///
+/// A cached machine answers its DISCOVER, REQUEST and renewals, so the C++ side builds the
+/// options once and attaches them here. They go away with the machine, and a refreshed cache
+/// entry is a new machine, so there's nothing to invalidate.
+#[derive(Default)]
+struct OptionSetSlot(OnceLock<AttachedOptionSet>);
+
+struct AttachedOptionSet {
+    option_set: *mut c_void,
+    free: OptionSetFree,
+}
+
+// The option set is immutable once attached, and `free` can run on any thread
+unsafe impl Send for AttachedOptionSet {}
+unsafe impl Sync for AttachedOptionSet {}
+
+impl Drop for AttachedOptionSet {
+    fn drop(&mut self) {
+        (self.free)(self.option_set);
+    }
+}
+
+// A copy of the machine builds its own
+impl Clone for OptionSetSlot {
+    fn clone(&self) -> Self {
+        Self::default()
+    }
+}
+
+impl std::fmt::Debug for OptionSetSlot {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_tuple("OptionSetSlot")
+            .field(&self.0.get().is_some())
+            .finish()
     }
 }
 
-/// Get the router address.
-/// This is, and will always be, specific to DHCPv4, as router addresses
-/// in DHCPv6 will come from RAs (Router Advertisements).
+/// Get the option set attached to this machine, or null if there isn't one yet
+///
+/// # Safety
+///
+/// This function dereferences a pointer to a Machine object which is an opaque pointer
+/// consumed in C code. The option set is valid until the machine is freed.
+///
+#[unsafe(no_mangle)]
+pub extern "C" fn machine_get_option_set(ctx: *const Machine) -> *mut c_void {
+    assert!(!ctx.is_null());
+    let machine = unsafe { &*ctx };
+
+    machine
+        .option_set
+        .0
+        .get()
+        .map_or(ptr::null_mut(), |attached| attached.option_set)
+}
+
+/// Attach an option set to this machine
+///
+/// The machine takes ownership and calls `free` on it when the machine itself is freed. Only
+/// one option set can be attached. If another thread got there first, `option_set` is freed
+/// straight away and false is returned, use `machine_get_option_set` to get the one attached.
 ///
 /// # Safety
 ///
@@ -88,21 +337,54 @@ impl Machine {
 /// consumed in C code.
 ///
 #[unsafe(no_mangle)]
-pub extern "C" fn machine_get_interface_router(ctx: *mut Machine) -> u32 {
+pub extern "C" fn machine_set_option_set(
+    ctx: *const Machine,
+    option_set: *mut c_void,
+    free: OptionSetFree,
+) -> bool {
     assert!(!ctx.is_null());
-    let machine = unsafe { &mut *ctx };
+    let machine = unsafe { &*ctx };
+
+    machine
+        .option_set
+        .0
+        .set(AttachedOptionSet { option_set, free })
+        .is_ok()
+}
+
+// Strings come from carbide-api and Kea's config, neither of which should contain a NUL
+fn c_string(s: String) -> CString {
+    CString::new(s).unwrap_or_else(|error| {
+        log::error!("String for the DHCP response contains a NUL byte: {error}");
+        CString::default()
+    })
+}
 
+// The shared copy of `s`
+fn intern(s: &str) -> Arc<CStr> {
+    let s = c_string(s.to_string());
+    let mut interned = INTERNED.lock().unwrap();
+    if let Some(existing) = interned.get(s.as_c_str()) {
+        return existing.clone();
+    }
+    let s = Arc::<CStr>::from(s);
+    if interned.len() < MAX_INTERNED {
+        interned.insert(s.clone());
+    }
+    s
+}
+
+fn interface_router(record: &rpc::DhcpRecord) -> u32 {
     // todo(ajf): I guess??
     let default_router = "0.0.0.0".to_string();
 
-    let maybe_gateway = machine
-        .inner
+    let maybe_gateway = record
         .gateway
         .as_ref()
         .unwrap_or_else(|| {
             log::warn!(
                 "No gateway provided for machine interface: {:?}",
-                &machine.inner.machine_interface_id
+                &record.machine_interface_id
             );
             &default_router
         })
@@ -123,21 +405,10 @@ pub extern "C" fn machine_get_interface_router(ctx: *mut Machine) -> u32 {
     0
 }
 
-/// Invoke the discovery process.
-/// This function will be specific to IPv4 interface addresses, as this
-/// returns a u32. DHCPv6 integration will need a separate function for
-/// stateful/managed allocations.
-///
-/// # Safety
-/// This function dereferences a pointer to a Machine object which is an opaque pointer
-/// consumed in C code.
-///
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_get_interface_address(ctx: *mut Machine) -> u32 {
-    assert!(!ctx.is_null());
-    let machine = unsafe { &mut *ctx };
-
-    let maybe_address = machine.inner.address.parse::<IpAddr>();
+// This is specific to IPv4 interface addresses. DHCPv6 integration will need a separate
+// function for stateful/managed allocations.
+fn interface_address(record: &rpc::DhcpRecord) -> u32 {
+    let maybe_address = record.address.parse::<IpAddr>();
 
     match maybe_address {
         Ok(address) => match address {
@@ -154,175 +425,63 @@ pub extern "C" fn machine_get_interface_address(ctx: *mut Machine) -> u32 {
     0
 }
 
-/// Get the machine fqdn
-///
-/// # Safety
-/// This function checks for null pointer and unboxes into a machine object
-///
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_get_interface_hostname(ctx: *mut Machine) -> *mut libc::c_char {
-    assert!(!ctx.is_null());
-    let machine = unsafe { &mut *ctx };
-
-    let fqdn = CString::new(&machine.inner.fqdn[..]).unwrap();
-
-    fqdn.into_raw()
-}
-
-/// Get the machine fqdn
-///
-/// # Safety
-/// This function checks for null pointer and unboxes into a machine object
-///
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_get_filename(ctx: *mut Machine) -> *const libc::c_char {
-    assert!(!ctx.is_null());
-    let machine = unsafe { &mut *ctx };
-
+// The boot file URL, if the client netboots
+fn filename(
+    record: &MachineRecord,
+    vendor_class: &Option<VendorClass>,
+    provisioning_server_ipv4: Option<Ipv4Addr>,
+) -> Option<String> {
     // If the API sent us the URL we should boot from, just use it.
-    let url = if let Some(url) = machine.booturl() {
-        url.to_string()
-    } else {
-        let arch = match &machine.vendor_class {
-            None => {
-                return ptr::null();
-            }
-            Some(v) if !v.is_netboot() => {
-                return ptr::null();
-            }
-            Some(VendorClass { arch, .. }) => arch,
-        };
-
-        let base_url = if let Some(next_server) = CONFIG
-            .read()
-            .unwrap() // TODO(ajf): don't unwrap
-            .provisioning_server_ipv4
-        {
-            next_server.to_string()
-        } else {
-            log::warn!("Could not retrieve provisioning-server-ipv4 configuration from Kea");
-            return ptr::null();
-        };
+    if let Some(url) = record.booturl.as_deref() {
+        return Some(url.to_string());
+    }
 
-        match arch {
-            EfiX64 => format!("http://{base_url}:8080/public/blobs/internal/x86_64/ipxe.efi"),
-            Arm64 => format!("http://{base_url}:8080/public/blobs/internal/aarch64/ipxe.efi"),
-            BiosX86 => {
-                log::error!(
-                    "Matched an HTTP client on a Legacy BIOS client, cannot provide HTTP boot URL {:?}",
-                    &machine
-                );
-                return ptr::null();
-            }
-            Unknown => {
-                log::error!(
-                    "Matched an unknown architecture, cannot provide HTTP boot URL {:?}",
-                    &machine
-                );
-                return ptr::null();
-            }
-        }
+    let arch = match vendor_class {
+        None => return None,
+        Some(v) if !v.is_netboot() => return None,
+        Some(VendorClass { arch, .. }) => arch,
     };
 
-    CString::new(url).unwrap().into_raw()
-}
-
-// IPv4 address of next-server (siaddr) as big endian int 32.
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_get_next_server(ctx: *mut Machine) -> u32 {
-    assert!(!ctx.is_null());
-    let ip_addr = if let Some(next_server) = CONFIG
-        .read()
-        .unwrap() // TODO(ajf): don't unwrap
-        .provisioning_server_ipv4
-    {
-        next_server.octets()
-    } else {
-        "127.0.0.1"
-            .to_string()
-            .parse::<Ipv4Addr>()
-            .unwrap()
-            .octets()
+    let Some(base_url) = provisioning_server_ipv4 else {
+        log::warn!("Could not retrieve provisioning-server-ipv4 configuration from Kea");
+        return None;
     };
 
-    u32::from_be_bytes(ip_addr)
-}
-
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_get_nameservers(ctx: *mut Machine) -> *mut libc::c_char {
-    assert!(!ctx.is_null());
-
-    let nameservers = CString::new(CONFIG.read().unwrap().nameservers.clone()).unwrap();
-    log::debug!("Nameservers are {nameservers:?}");
-
-    nameservers.into_raw()
-}
-
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_get_ntpservers(ctx: *mut Machine) -> *mut libc::c_char {
-    assert!(!ctx.is_null());
-
-    let ntpservers = CString::new(CONFIG.read().unwrap().ntpservers.clone()).unwrap();
-    log::debug!("Ntp servers are {ntpservers:?}");
-
-    ntpservers.into_raw()
-}
-
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_get_mqtt_server(ctx: *mut Machine) -> *mut libc::c_char {
-    assert!(!ctx.is_null());
-
-    match CONFIG.read().unwrap().mqtt_server.clone() {
-        Some(mqtt_server) => {
-            log::debug!("MQTT server is {mqtt_server:?}");
-            CString::new(mqtt_server).unwrap().into_raw()
+    match arch {
+        EfiX64 => Some(format!(
+            "http://{base_url}:8080/public/blobs/internal/x86_64/ipxe.efi"
+        )),
+        Arm64 => Some(format!(
+            "http://{base_url}:8080/public/blobs/internal/aarch64/ipxe.efi"
+        )),
+        BiosX86 => {
+            log::error!(
+                "Matched an HTTP client on a Legacy BIOS client, cannot provide HTTP boot URL {record:?}"
+            );
+            None
         }
-        None => {
-            log::debug!("MQTT server is unset");
-            ptr::null_mut()
+        Unknown => {
+            log::error!("Matched an unknown architecture, cannot provide HTTP boot URL {record:?}");
+            None
         }
     }
 }
 
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_get_client_type(ctx: *mut Machine) -> *mut libc::c_char {
-    assert!(!ctx.is_null());
-    let machine = unsafe { &mut *ctx };
-    let vendor_class = match &machine.vendor_class {
-        None => CString::new("").unwrap(),
-        Some(vc) => CString::new(vc.id.clone()).unwrap(),
-    };
-    vendor_class.into_raw()
-}
-
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_get_uuid(ctx: *mut Machine) -> *mut libc::c_char {
-    assert!(!ctx.is_null());
-    let machine = unsafe { &mut *ctx };
-
-    let uuid = if let Some(machine_interface_id) = &machine.inner.machine_interface_id {
-        CString::new(machine_interface_id.to_string()).unwrap()
+fn uuid(record: &rpc::DhcpRecord) -> String {
+    if let Some(machine_interface_id) = &record.machine_interface_id {
+        machine_interface_id.to_string()
     } else {
         log::debug!(
-            "Found a host missing UUID (Possibly a Instance), dumping everything we know about it: {:?}",
-            &machine
+            "Found a host missing UUID (Possibly a Instance), dumping everything we know about it: {record:?}"
         );
-        CString::new("").unwrap()
-    };
-
-    uuid.into_raw()
+        String::new()
+    }
 }
 
-/// Get the broadcast address.
-///
-/// This is, and will always be, specific to DHCPv4, as broadcast
-/// in DHCPv6 has been completely replaced by multicast.
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_get_broadcast_address(ctx: *mut Machine) -> u32 {
-    assert!(!ctx.is_null());
-    let machine = unsafe { &mut *ctx };
-
-    let maybe_prefix = machine.inner.prefix.parse::<IpNetwork>();
+// This is, and will always be, specific to DHCPv4, as broadcast in DHCPv6 has been completely
+// replaced by multicast.
+fn broadcast_address(record: &rpc::DhcpRecord) -> u32 {
+    let maybe_prefix = record.prefix.parse::<IpNetwork>();
 
     match maybe_prefix {
         Ok(prefix) => match prefix {
@@ -339,87 +498,10 @@ pub extern "C" fn machine_get_broadcast_address(ctx: *mut Machine) -> u32 {
     0
 }
 
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_free_filename(filename: *const libc::c_char) {
-    unsafe {
-        if filename.is_null() {
-            return;
-        }
-
-        drop(CString::from_raw(filename as *mut _))
-    };
-}
-
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_free_client_type(client_type: *mut libc::c_char) {
-    unsafe {
-        if client_type.is_null() {
-            return;
-        }
-
-        drop(CString::from_raw(client_type))
-    };
-}
-
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_free_uuid(uuid: *mut libc::c_char) {
-    unsafe {
-        if uuid.is_null() {
-            return;
-        }
-
-        drop(CString::from_raw(uuid))
-    };
-}
-
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_free_fqdn(fqdn: *mut libc::c_char) {
-    unsafe {
-        if fqdn.is_null() {
-            return;
-        }
-
-        drop(CString::from_raw(fqdn))
-    };
-}
-
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_free_nameservers(nameservers: *mut libc::c_char) {
-    unsafe {
-        if nameservers.is_null() {
-            return;
-        }
-
-        drop(CString::from_raw(nameservers))
-    };
-}
-
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_free_ntpservers(ntpservers: *mut libc::c_char) {
-    unsafe {
-        if ntpservers.is_null() {
-            return;
-        }
-
-        drop(CString::from_raw(ntpservers))
-    };
-}
-
-/// Invoke the discovery process
-/// This is, and will always be, specific to DHCPv4, as the subnet
-/// mask in DHCPv6 is now learned via RAs as a prefix.
-///
-/// # Safety
-///
-/// This function dereferences a pointer to a Machine object which is an opaque pointer
-/// consumed in C code.
-///
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_get_interface_subnet_mask(ctx: *mut Machine) -> u32 {
-    assert!(!ctx.is_null());
-    let machine = unsafe { &mut *ctx };
-
-    let maybe_prefix = machine.inner.prefix.parse::<IpNetwork>();
+// This is, and will always be, specific to DHCPv4, as the subnet mask in DHCPv6 is now learned
+// via RAs as a prefix.
+fn interface_subnet_mask(record: &rpc::DhcpRecord) -> u32 {
+    let maybe_prefix = record.prefix.parse::<IpNetwork>();
 
     match maybe_prefix {
         Ok(prefix) => match prefix {
@@ -436,13 +518,6 @@ pub extern "C" fn machine_get_interface_subnet_mask(ctx: *mut Machine) -> u32 {
     0
 }
 
-/// Extract MTU from Machine object. We got it in the grpc response in discovery_fetch_machine.
-/// https://jirasw.nvidia.com/browse/FORGE-2443
-#[unsafe(no_mangle)]
-pub extern "C" fn machine_get_interface_mtu(ctx: *mut Machine) -> u16 {
-    unsafe { (*ctx).inner.mtu as u16 }
-}
-
 /// Free the Machine object.
 ///
 /// # Safety
@@ -450,8 +525,9 @@ pub extern "C" fn machine_get_interface_mtu(ctx: *mut Machine) -> u16 {
 /// This function dereferences a pointer to a Machine object which is an opaque pointer
 /// consumed in C code.
 ///
-/// This does not forget the memory afterwards, so the opaque pointer in the C code is now
-/// unusable.
+/// The pointer is one reference to a machine which may also be held by the cache, so this
+/// only frees the memory once the last reference is gone. Either way the opaque pointer in
+/// the C code is now unusable.
 ///
 #[unsafe(no_mangle)]
 pub extern "C" fn machine_free(ctx: *mut Machine) {
@@ -460,52 +536,60 @@ pub extern "C" fn machine_free(ctx: *mut Machine) {
     }
 
     unsafe {
-        drop(Box::from_raw(ctx));
+        drop(Arc::from_raw(ctx as *const Machine));
     }
 }
 
 #[cfg(test)]
 mod test {
-    use std::ffi::CString;
+    use std::ffi::{CStr, c_void};
     use std::net::Ipv4Addr;
     use std::str::FromStr;
+    use std::sync::Arc;
+    use std::sync::atomic::{AtomicUsize, Ordering};
 
     use rpc::forge as rpc;
 
     use crate::discovery::Discovery;
-    use crate::machine::{Machine, machine_get_filename};
+    use crate::machine::{
+        Machine, machine_free, machine_get_option_set, machine_get_response, machine_set_option_set,
+    };
     use crate::vendor_class::VendorClass;
 
+    fn discovery() -> Discovery {
+        Discovery {
+            relay_address: "127.0.0.1".parse().unwrap(),
+            mac_address: "00:00:00:00:00:00".parse().unwrap(),
+            _client_system: None,
+            vendor_class: None,
+            link_select_address: "127.0.0.1".parse().ok(),
+            circuit_id: None,
+            remote_id: None,
+            desired_address: None,
+        }
+    }
+
     #[test]
     fn test_use_booturl_internal() {
         crate::carbide_set_config_next_server_ipv4("127.0.0.1".parse::<Ipv4Addr>().unwrap().into());
 
-        let mut machine = Box::new(Machine {
-            inner: rpc::DhcpRecord::default(),
-            discovery_info: Discovery {
-                relay_address: "127.0.0.1".parse().unwrap(),
-                mac_address: "00:00:00:00:00:00".parse().unwrap(),
-                _client_system: None,
-                vendor_class: None,
-                link_select_address: "127.0.0.1".parse().ok(),
-                circuit_id: None,
-                remote_id: None,
-                desired_address: None,
-            },
-            vendor_class: VendorClass::from_str("HTTPClient:Arch:00011:UNDI:003000")
+        let machine = Machine::new(
+            rpc::DhcpRecord::default(),
+            discovery(),
+            VendorClass::from_str("HTTPClient:Arch:00011:UNDI:003000")
                 .unwrap()
                 .into(),
-        });
+        );
 
-        let out = machine_get_filename(&mut *machine);
+        let response = machine_get_response(&machine);
 
-        assert_ne!(out, std::ptr::null());
+        assert_ne!(response.filename, std::ptr::null());
 
-        let cstr = unsafe { CString::from_raw(out as *mut _) };
+        let filename = unsafe { CStr::from_ptr(response.filename) };
 
         assert_eq!(
-            cstr,
-            CString::new("http://127.0.0.1:8080/public/blobs/internal/aarch64/ipxe.efi").unwrap()
+            filename.to_str().unwrap(),
+            "http://127.0.0.1:8080/public/blobs/internal/aarch64/ipxe.efi"
         );
     }
 
@@ -516,29 +600,125 @@ mod test {
             ..Default::default()
         };
 
-        let mut machine = Box::new(Machine {
-            inner: dhcp_record,
-            discovery_info: Discovery {
-                relay_address: "127.0.0.1".parse::<Ipv4Addr>().unwrap(),
-                mac_address: "00:00:00:00:00:00".parse().unwrap(),
-                _client_system: None,
-                vendor_class: None,
-                link_select_address: "127.0.0.1".parse::<Ipv4Addr>().ok(),
-                circuit_id: None,
-                remote_id: None,
-                desired_address: None,
-            },
-            vendor_class: VendorClass::from_str("HTTPClient:Arch:00011:UNDI:003000")
+        let machine = Machine::new(
+            dhcp_record,
+            discovery(),
+            VendorClass::from_str("HTTPClient:Arch:00011:UNDI:003000")
                 .unwrap()
                 .into(),
-        });
+        );
 
-        let out = machine_get_filename(&mut *machine);
+        let response = machine_get_response(&machine);
 
-        assert_ne!(out, std::ptr::null());
+        assert_ne!(response.filename, std::ptr::null());
 
-        let cstr = unsafe { CString::from_raw(out as *mut _) };
+        let filename = unsafe { CStr::from_ptr(response.filename) };
 
-        assert_eq!(cstr, CString::new("https://foobar").unwrap());
+        assert_eq!(filename.to_str().unwrap(), "https://foobar");
+    }
+
+    static FREED: AtomicUsize = AtomicUsize::new(0);
+
+    extern "C" fn count_free(_option_set: *mut c_void) {
+        FREED.fetch_add(1, Ordering::SeqCst);
+    }
+
+    #[test]
+    fn test_option_set_freed_with_machine() {
+        let machine = Arc::new(Machine::new(rpc::DhcpRecord::default(), discovery(), None));
+        let ctx = Arc::into_raw(machine.clone()) as *mut Machine;
+        let mut first = 1u8;
+        let mut second = 2u8;
+        let first_ptr = &mut first as *mut u8 as *mut c_void;
+        let second_ptr = &mut second as *mut u8 as *mut c_void;
+
+        assert!(machine_get_option_set(ctx).is_null());
+        assert!(machine_set_option_set(ctx, first_ptr, count_free));
+        // Losing the race frees the loser's set right away
+        assert!(!machine_set_option_set(ctx, second_ptr, count_free));
+        assert_eq!(FREED.load(Ordering::SeqCst), 1);
+        assert_eq!(machine_get_option_set(ctx), first_ptr);
+
+        // Still referenced by `machine`, the set stays
+        machine_free(ctx);
+        assert_eq!(FREED.load(Ordering::SeqCst), 1);
+        drop(machine);
+        assert_eq!(FREED.load(Ordering::SeqCst), 2);
+    }
+
+    // Another vendor class gets its own client type, but the record and common strings are shared
+    #[test]
+    fn test_machines_share_record() {
+        let pxe = Machine::new(
+            rpc::DhcpRecord::default(),
+            discovery(),
+            VendorClass::from_str("PXEClient:Arch:00007:UNDI:003000")
+                .unwrap()
+                .into(),
+        );
+        let ipxe = Machine::from_record(
+            pxe.record.clone(),
+            discovery(),
+            VendorClass::from_str("HTTPClient:Arch:00011:UNDI:003000")
+                .unwrap()
+                .into(),
+        );
+        let other = Machine::new(
+            rpc::DhcpRecord::default(),
+            discovery(),
+            VendorClass::from_str("PXEClient:Arch:00007:UNDI:003000")
+                .unwrap()
+                .into(),
+        );
+        assert!(Arc::ptr_eq(&pxe.record, &ipxe.record));
+
+        let pxe = machine_get_response(&pxe);
+        let ipxe = machine_get_response(&ipxe);
+        let other = machine_get_response(&other);
+        assert_eq!(pxe.uuid, ipxe.uuid);
+        assert_ne!(pxe.client_type, ipxe.client_type);
+        assert_eq!(pxe.client_type, other.client_type);
+        assert_eq!(pxe.nameservers, ipxe.nameservers);
+        assert_eq!(pxe.nameservers, other.nameservers);
+    }
+
+    #[test]
+    fn test_response_fields() {
+        let dhcp_record = rpc::DhcpRecord {
+            fqdn: "december-nitrogen.forge.local".to_string(),
+            address: "172.20.0.42".to_string(),
+            prefix: "172.20.0.0/24".to_string(),
+            gateway: Some("172.20.0.1".to_string()),
+            mtu: 1490,
+            ..Default::default()
+        };
+
+        // No vendor class: not netbooting, no client type
+        let machine = Machine::new(dhcp_record, discovery(), None);
+        let response = machine_get_response(&machine);
+
+        assert_eq!(
+            response.interface_address,
+            u32::from(Ipv4Addr::new(172, 20, 0, 42))
+        );
+        assert_eq!(response.router, u32::from(Ipv4Addr::new(172, 20, 0, 1)));
+        assert_eq!(
+            response.subnet_mask,
+            u32::from(Ipv4Addr::new(255, 255, 255, 0))
+        );
+        assert_eq!(
+            response.broadcast_address,
+            u32::from(Ipv4Addr::new(172, 20, 0, 255))
+        );
+        assert_eq!(response.mtu, 1490);
+        assert!(response.filename.is_null());
+        unsafe {
+            assert_eq!(
+                CStr::from_ptr(response.hostname).to_str().unwrap(),
+                "december-nitrogen.forge.local"
+            );
+            assert_eq!(CStr::from_ptr(response.client_type).to_bytes(), b"");
+            assert_eq!(CStr::from_ptr(response.uuid).to_bytes(), b"");
+        }
     }
 }
@@ -16,59 +16,364 @@
  */
 
 use std::ops::Deref;
-use std::sync::Arc;
-use std::sync::atomic::{AtomicI64, Ordering};
-use std::time::Duration;
+use std::sync::atomic::{AtomicI64, AtomicU64, Ordering};
+use std::sync::{Arc, OnceLock};
+use std::time::{Duration, Instant};
 
 use ::metrics_endpoint::{MetricsEndpointConfig, new_metrics_setup, run_metrics_endpoint};
 use metrics_endpoint::{HealthController, MetricsSetup};
-use opentelemetry::KeyValue;
-use rpc::forge_tls_client::{self, ApiConfig, ForgeClientConfig};
+use opentelemetry::metrics::Histogram;
+use opentelemetry::trace::TraceContextExt;
+use opentelemetry::{Context, KeyValue};
 use tokio::runtime::Runtime;
 use tokio::time::{interval, timeout};
 
-use crate::{CONFIG, CarbideDhcpContext, CarbideDhcpMetrics, tls};
+use crate::discovery::DiscoveryBuilderResult;
+use crate::{
+    CONFIG, CarbideDhcpContext, CarbideDhcpMetrics, admission, api_client, prewarm, tls, trace,
+    update_config,
+};
 
 const METRICS_CAPTURE_FREQUENCY: Duration = Duration::from_secs(30);
 const READINESS_CHECK_FREQUENCY: Duration = Duration::from_secs(30);
 
+/// Why a packet was dropped, the `reason` label of carbide-dhcp.dropped_requests
+#[repr(C)]
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum DropReason {
+    NonRelayedPacket = 0,
+    InvalidDiscoveryBuilderPointer = 1,
+    InvalidMacAddress = 2,
+    InvalidVendorClass = 3,
+    InvalidMachinePointer = 4,
+    BuilderError = 5,
+    FetchMachineError = 6,
+    InvalidCircuitId = 7,
+    TooManyFailuresError = 8,
+    ApiUnavailable = 9,
+    ApiDeadlineExceeded = 10,
+    DuplicateInFlight = 11,
+    ClientRateLimited = 12,
+    RelayRateLimited = 13,
+}
+
+impl DropReason {
+    const ALL: [DropReason; 14] = [
+        DropReason::NonRelayedPacket,
+        DropReason::InvalidDiscoveryBuilderPointer,
+        DropReason::InvalidMacAddress,
+        DropReason::InvalidVendorClass,
+        DropReason::InvalidMachinePointer,
+        DropReason::BuilderError,
+        DropReason::FetchMachineError,
+        DropReason::InvalidCircuitId,
+        DropReason::TooManyFailuresError,
+        DropReason::ApiUnavailable,
+        DropReason::ApiDeadlineExceeded,
+        DropReason::DuplicateInFlight,
+        DropReason::ClientRateLimited,
+        DropReason::RelayRateLimited,
+    ];
+
+    fn as_str(self) -> &'static str {
+        match self {
+            DropReason::NonRelayedPacket => "NonRelayedPacket",
+            DropReason::InvalidDiscoveryBuilderPointer => "InvalidDiscoveryBuilderPointer",
+            DropReason::InvalidMacAddress => "InvalidMacAddress",
+            DropReason::InvalidVendorClass => "InvalidVendorClass",
+            DropReason::InvalidMachinePointer => "InvalidMachinePointer",
+            DropReason::BuilderError => "BuilderError",
+            DropReason::FetchMachineError => "FetchMachineError",
+            DropReason::InvalidCircuitId => "InvalidCircuitId",
+            DropReason::TooManyFailuresError => "TooManyFailuresError",
+            DropReason::ApiUnavailable => "ApiUnavailable",
+            DropReason::ApiDeadlineExceeded => "ApiDeadlineExceeded",
+            DropReason::DuplicateInFlight => "DuplicateInFlight",
+            DropReason::ClientRateLimited => "ClientRateLimited",
+            DropReason::RelayRateLimited => "RelayRateLimited",
+        }
+    }
+}
+
+impl From<DiscoveryBuilderResult> for DropReason {
+    fn from(result: DiscoveryBuilderResult) -> Self {
+        match result {
+            DiscoveryBuilderResult::InvalidDiscoveryBuilderPointer => {
+                DropReason::InvalidDiscoveryBuilderPointer
+            }
+            DiscoveryBuilderResult::InvalidMacAddress => DropReason::InvalidMacAddress,
+            DiscoveryBuilderResult::InvalidVendorClass => DropReason::InvalidVendorClass,
+            // A "successful" discovery that didn't give us a machine
+            DiscoveryBuilderResult::Success | DiscoveryBuilderResult::InvalidMachinePointer => {
+                DropReason::InvalidMachinePointer
+            }
+            DiscoveryBuilderResult::BuilderError => DropReason::BuilderError,
+            DiscoveryBuilderResult::FetchMachineError => DropReason::FetchMachineError,
+            DiscoveryBuilderResult::InvalidCircuitId => DropReason::InvalidCircuitId,
+            DiscoveryBuilderResult::TooManyFailuresError => DropReason::TooManyFailuresError,
+            DiscoveryBuilderResult::ApiUnavailable => DropReason::ApiUnavailable,
+            DiscoveryBuilderResult::ApiDeadlineExceeded => DropReason::ApiDeadlineExceeded,
+        }
+    }
+}
+
+/// What a cache lookup found, the `result` label of carbide-dhcp.cache_lookups
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum CacheLookup {
+    Hit = 0,
+    /// Nothing cached, or a failure we still retry
+    Miss = 1,
+    /// Too many failures, answered without asking carbide-api
+    NegativeHit = 2,
+}
+
+impl CacheLookup {
+    const ALL: [CacheLookup; 3] = [
+        CacheLookup::Hit,
+        CacheLookup::Miss,
+        CacheLookup::NegativeHit,
+    ];
+
+    fn as_str(self) -> &'static str {
+        match self {
+            CacheLookup::Hit => "hit",
+            CacheLookup::Miss => "miss",
+            CacheLookup::NegativeHit => "negative_hit",
+        }
+    }
+}
+
+/// A step in handling a packet, the `stage` label of carbide-dhcp.stage_duration
+#[repr(C)]
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum PipelineStage {
+    /// pkt4_receive reading the query into a discovery
+    ParseQuery = 0,
+    CacheLookup = 1,
+    /// Getting a connection to carbide-api, only slow when it needs a TLS handshake
+    ApiConnect = 2,
+    /// DiscoverDhcp, including any time waiting for a batch to fill
+    ApiCall = 3,
+    /// pkt4_send filling in the response
+    BuildResponse = 4,
+}
+
+impl PipelineStage {
+    const ALL: [PipelineStage; 5] = [
+        PipelineStage::ParseQuery,
+        PipelineStage::CacheLookup,
+        PipelineStage::ApiConnect,
+        PipelineStage::ApiCall,
+        PipelineStage::BuildResponse,
+    ];
+
+    fn as_str(self) -> &'static str {
+        match self {
+            PipelineStage::ParseQuery => "parse_query",
+            PipelineStage::CacheLookup => "cache_lookup",
+            PipelineStage::ApiConnect => "api_connect",
+            PipelineStage::ApiCall => "api_call",
+            PipelineStage::BuildResponse => "build_response",
+        }
+    }
+}
+
+// From a few microseconds for the in-process stages up to the API call timing out
+const STAGE_DURATION_BOUNDARIES: [f64; 14] = [
+    0.000_005, 0.000_01, 0.000_025, 0.000_05, 0.000_1, 0.000_25, 0.000_5, 0.001, 0.005, 0.01, 0.05,
+    0.1, 1.0, 10.0,
+];
+
+/// Per packet counters
+///
+/// Kea's packet threads only bump atomics, the OpenTelemetry counters are observable and read
+/// these when metrics are collected. Counting starts at load, whether or not a metrics
+/// endpoint is configured.
+pub struct RequestCounters {
+    total: AtomicU64,
+    dropped: [AtomicU64; DropReason::ALL.len()],
+    cache_lookups: [AtomicU64; CacheLookup::ALL.len()],
+    api_requests_in_flight: AtomicI64,
+}
+
+impl RequestCounters {
+    pub const fn new() -> Self {
+        Self {
+            total: AtomicU64::new(0),
+            dropped: [const { AtomicU64::new(0) }; DropReason::ALL.len()],
+            cache_lookups: [const { AtomicU64::new(0) }; CacheLookup::ALL.len()],
+            api_requests_in_flight: AtomicI64::new(0),
+        }
+    }
+}
+
+pub static REQUEST_COUNTERS: RequestCounters = RequestCounters::new();
+
+struct StageHistogram {
+    histogram: Histogram<f64>,
+    labels: [[KeyValue; 1]; PipelineStage::ALL.len()],
+}
+
+/// Only set once the metrics endpoint is up, until then stages aren't timed at all
+static STAGE_HISTOGRAM: OnceLock<StageHistogram> = OnceLock::new();
+
+fn stage_histogram(mconf: &MetricsSetup) -> StageHistogram {
+    StageHistogram {
+        histogram: mconf
+            .meter
+            .f64_histogram("carbide-dhcp.stage_duration")
+            .with_description("Time taken by each stage of handling a DHCP packet")
+            .with_unit("s")
+            .with_boundaries(STAGE_DURATION_BOUNDARIES.to_vec())
+            .build(),
+        labels: PipelineStage::ALL.map(|stage| [KeyValue::new("stage", stage.as_str())]),
+    }
+}
+
+pub fn observe_stage(stage: PipelineStage, elapsed: Duration) {
+    if let Some(stage_histogram) = STAGE_HISTOGRAM.get() {
+        stage_histogram.histogram.record(
+            elapsed.as_secs_f64(),
+            &stage_histogram.labels[stage as usize],
+        );
+    }
+}
+
+/// Times a stage until it's dropped
+///
+/// In a traced packet's context (trace.rs) the stage is a span as well.
+pub struct StageTimer {
+    timing: Option<(PipelineStage, Instant)>,
+    span: Option<Context>,
+}
+
+impl StageTimer {
+    pub fn start(stage: PipelineStage) -> Self {
+        Self {
+            // Don't even read the clock if nothing would be recorded
+            timing: STAGE_HISTOGRAM.get().map(|_| (stage, Instant::now())),
+            span: trace::stage(stage.as_str()),
+        }
+    }
+
+    /// The context for work done in the stage, so its spans are children of this one
+    pub fn context(&self) -> Context {
+        self.span.clone().unwrap_or_else(Context::current)
+    }
+}
+
+impl Drop for StageTimer {
+    fn drop(&mut self) {
+        if let Some((stage, start)) = self.timing {
+            observe_stage(stage, start.elapsed());
+        }
+        if let Some(span) = &self.span {
+            span.span().end();
+        }
+    }
+}
+
+/// Counts a request to carbide-api as in flight until it's dropped
+pub struct ApiRequestInFlight(());
+
+impl ApiRequestInFlight {
+    pub fn start() -> Self {
+        REQUEST_COUNTERS
+            .api_requests_in_flight
+            .fetch_add(1, Ordering::Relaxed);
+        Self(())
+    }
+}
+
+impl Drop for ApiRequestInFlight {
+    fn drop(&mut self) {
+        REQUEST_COUNTERS
+            .api_requests_in_flight
+            .fetch_sub(1, Ordering::Relaxed);
+    }
+}
+
 pub async fn certificate_loop() {
     let mut interval = tokio::time::interval(METRICS_CAPTURE_FREQUENCY);
     loop {
         interval.tick().await;
-        let metrics = CONFIG
-            .read()
-            .expect("config lock poisoned?")
-            .metrics
-            .clone();
+        let metrics = CONFIG.load().metrics.clone();
         if let Some(metrics) = metrics
             && let Some(client_expiry) = metrics.forge_client_config.client_cert_expiry()
         {
-            metrics
+            let previous_expiry = metrics
                 .certificate_expiration_value
-                .store(client_expiry, Ordering::SeqCst);
+                .swap(client_expiry, Ordering::SeqCst);
+            // A new expiry means the certificate was rotated. Reconnect now, rather than on
+            // the next cache miss while a DHCP client waits.
+            if previous_expiry != 0 && previous_expiry != client_expiry {
+                log::info!("client certificate rotated, reconnecting to carbide-api");
+                api_client::reconnect_all().await;
+            }
         }
     }
 }
 
-fn initialize_metrics(mconf: &MetricsSetup) -> CarbideDhcpMetrics {
+fn initialize_metrics(
+    mconf: &MetricsSetup,
+    counters: &'static RequestCounters,
+) -> CarbideDhcpMetrics {
     let certificate_expiration_value = Arc::new(AtomicI64::new(0));
     // initialize metrics.
     let metrics = CarbideDhcpMetrics {
-        total_requests_counter: mconf
-            .meter
-            .u64_counter("carbide-dhcp.requests")
-            .with_description("The total number of DHCP requests")
-            .build(),
-        dropped_requests_counter: mconf
-            .meter
-            .u64_counter("carbide-dhcp.dropped_requests")
-            .with_description("The number of dropped DHCP requests")
-            .build(),
         forge_client_config: tls::build_forge_client_config(),
         certificate_expiration_value: certificate_expiration_value.clone(),
     };
 
+    mconf
+        .meter
+        .u64_observable_counter("carbide-dhcp.requests")
+        .with_description("The total number of DHCP requests")
+        .with_callback(move |observer| {
+            observer.observe(counters.total.load(Ordering::Relaxed), &[]);
+        })
+        .build();
+
+    // Only reasons we've seen, like a plain counter would
+    let reason_labels = DropReason::ALL.map(|reason| [KeyValue::new("reason", reason.as_str())]);
+    mconf
+        .meter
+        .u64_observable_counter("carbide-dhcp.dropped_requests")
+        .with_description("The number of dropped DHCP requests")
+        .with_callback(move |observer| {
+            for (dropped, labels) in counters.dropped.iter().zip(&reason_labels) {
+                let dropped = dropped.load(Ordering::Relaxed);
+                if dropped > 0 {
+                    observer.observe(dropped, labels);
+                }
+            }
+        })
+        .build();
+
+    let result_labels = CacheLookup::ALL.map(|result| [KeyValue::new("result", result.as_str())]);
+    mconf
+        .meter
+        .u64_observable_counter("carbide-dhcp.cache_lookups")
+        .with_description("The number of machine cache lookups, by what they found")
+        .with_callback(move |observer| {
+            for (lookups, labels) in counters.cache_lookups.iter().zip(&result_labels) {
+                let lookups = lookups.load(Ordering::Relaxed);
+                if lookups > 0 {
+                    observer.observe(lookups, labels);
+                }
+            }
+        })
+        .build();
+
+    mconf
+        .meter
+        .i64_observable_gauge("carbide-dhcp.api_requests_in_flight")
+        .with_description("The number of discoveries waiting on carbide-api")
+        .with_callback(move |observer| {
+            observer.observe(counters.api_requests_in_flight.load(Ordering::Relaxed), &[]);
+        })
+        .build();
+
     // Observable gauges don't need to be stored anywhere, they're
     // stored internally within the meter and the callback is run when metrics are
     // collected.
@@ -86,24 +391,21 @@ fn initialize_metrics(mconf: &MetricsSetup) -> CarbideDhcpMetrics {
 }
 
 pub fn metrics_server() {
-    let metrics_endpoint = CONFIG
-        .read()
-        .expect("config lock poisoned?")
-        .metrics_endpoint;
+    let metrics_endpoint = CONFIG.load().metrics_endpoint;
 
     if let Some(metrics_endpoint) = metrics_endpoint {
         let mconf = new_metrics_setup("carbide-dhcp", "forge-system", true);
         match mconf {
             Ok(mconf) => {
                 // initialize metrics.
-                let metrics = initialize_metrics(&mconf);
+                let metrics = initialize_metrics(&mconf, &REQUEST_COUNTERS);
+                let _ = STAGE_HISTOGRAM.set(stage_histogram(&mconf));
                 let health_controller = HealthController::new();
 
-                {
-                    let mut config = CONFIG.write().expect("config lock poisoned");
-                    config.metrics = Some(metrics);
+                update_config(|config| {
+                    config.metrics = Some(metrics.clone());
                     config.health_controller = Some(health_controller.clone());
-                }
+                });
 
                 let runtime: &Runtime = CarbideDhcpContext::get_tokio_runtime();
                 // start certificate loop
@@ -137,46 +439,40 @@ pub fn metrics_server() {
     }
 }
 
-async fn check_api_connectivity(carbide_api_url: &str, client_config: &ForgeClientConfig) -> bool {
-    let api_config: ApiConfig<'_> = ApiConfig::new(carbide_api_url, client_config);
-    match forge_tls_client::ForgeTlsClient::retry_build(&api_config).await {
-        Ok(mut client) => {
-            let request = tonic::Request::new(rpc::forge::EchoRequest {
-                message: "dhcp_echo".into(),
-            });
+pub(crate) async fn check_api_connectivity(carbide_api_url: &str) -> bool {
+    // Uses the same shared client as discovery, so this also keeps its connection warm
+    let client = api_client::get(carbide_api_url);
+    let request = rpc::forge::EchoRequest {
+        message: "dhcp_echo".into(),
+    };
 
-            match client.echo(request).await {
-                Ok(_) => true,
-                Err(e) => {
-                    log::error!("error communication with carbide API: {e:?}");
-                    false
-                }
-            }
-        }
+    let connected = match client.echo(request).await {
+        Ok(_) => true,
         Err(e) => {
-            log::error!("api connectivity check timed out: {e:?}");
+            log::error!("error communication with carbide API: {e:?}");
+            if admission::is_outage(&e) {
+                api_client::reset(carbide_api_url);
+            }
             false
         }
-    }
+    };
+    // Closes the breaker without waiting for a discovery to probe it
+    admission::record(carbide_api_url, connected);
+    connected
 }
 
 pub async fn start_readiness_monitoring() {
     let mut readiness_interval = interval(READINESS_CHECK_FREQUENCY);
-    let forge_client_config = tls::build_forge_client_config();
 
-    let url = &CONFIG.read().expect("config poisoned").api_endpoint.clone();
+    let url = &CONFIG.load().api_endpoint.clone();
 
     loop {
         readiness_interval.tick().await;
-        match timeout(
-            Duration::from_secs(10),
-            check_api_connectivity(url, &forge_client_config),
-        )
-        .await
-        {
+        match timeout(Duration::from_secs(10), check_api_connectivity(url)).await {
             Ok(result) => set_service_ready(result),
             Err(e) => {
                 log::warn!("Readiness check timed out: {e:?}");
+                admission::record(url, false);
                 set_service_ready(false)
             }
         }
@@ -184,36 +480,33 @@ pub async fn start_readiness_monitoring() {
 }
 
 pub fn increment_total_requests() {
-    if let Some(metrics) = CONFIG.read().expect("config lock poisoned").metrics.clone() {
-        metrics.total_requests_counter.add(1, &[]);
-    }
+    REQUEST_COUNTERS.total.fetch_add(1, Ordering::Relaxed);
 }
 
-pub fn increment_dropped_requests(reason: String) {
-    if let Some(metrics) = CONFIG.read().expect("config lock poisoned").metrics.clone() {
-        metrics
-            .dropped_requests_counter
-            .add(1, &[KeyValue::new("reason", reason)]);
-    }
+pub fn increment_dropped_requests(reason: DropReason) {
+    REQUEST_COUNTERS.dropped[reason as usize].fetch_add(1, Ordering::Relaxed);
+}
+
+pub fn record_cache_lookup(result: CacheLookup) {
+    REQUEST_COUNTERS.cache_lookups[result as usize].fetch_add(1, Ordering::Relaxed);
+}
+
+/// How many cache lookups have found `result` since the hook was loaded
+pub fn cache_lookups(result: CacheLookup) -> u64 {
+    REQUEST_COUNTERS.cache_lookups[result as usize].load(Ordering::Relaxed)
 }
 
 pub fn set_service_ready(ready: bool) {
-    if let Some(health_controller) = &CONFIG
-        .read()
-        .expect("config lock poisoned")
-        .health_controller
-    {
+    // Not until the cache is warm, if we were asked to wait for that
+    let ready = ready && prewarm::finished();
+    if let Some(health_controller) = &CONFIG.load().health_controller {
         health_controller.set_ready(ready);
         log::debug!("DHCP readiness set to: {ready}");
     }
 }
 
 pub fn set_service_healthy(healthy: bool) {
-    if let Some(health_controller) = &CONFIG
-        .read()
-        .expect("config lock poisoned")
-        .health_controller
-    {
+    if let Some(health_controller) = &CONFIG.load().health_controller {
         health_controller.set_healthy(healthy);
         log::debug!("DHCP health set to: {healthy}");
     }
@@ -227,13 +520,16 @@ mod tests {
 
     #[test]
     fn test_metrics() {
+        static COUNTERS: RequestCounters = RequestCounters::new();
+
         let mconf = new_metrics_setup("carbide-dhcp", "forge-system", false).unwrap();
-        let metrics = initialize_metrics(&mconf);
+        let metrics = initialize_metrics(&mconf, &COUNTERS);
         metrics
             .certificate_expiration_value
             .store(1740173562, Ordering::SeqCst);
-        metrics.total_requests_counter.add(1, &[]);
-        metrics.dropped_requests_counter.add(1, &[]);
+        COUNTERS.total.fetch_add(1, Ordering::Relaxed);
+        COUNTERS.dropped[DropReason::NonRelayedPacket as usize].fetch_add(1, Ordering::Relaxed);
+        COUNTERS.cache_lookups[CacheLookup::Hit as usize].fetch_add(1, Ordering::Relaxed);
 
         let mut buffer = vec![];
         let encoder = TextEncoder::new();
@@ -243,4 +539,16 @@ mod tests {
         let prom_metrics = String::from_utf8(buffer).unwrap();
         assert_eq!(prom_metrics, include_str!("../tests/fixtures/metrics.txt"));
     }
+
+    #[test]
+    fn test_drop_reason_labels() {
+        for (idx, reason) in DropReason::ALL.iter().enumerate() {
+            assert_eq!(*reason as usize, idx);
+        }
+        // Same labels as before the enum, so existing dashboards keep working
+        assert_eq!(
+            DropReason::from(DiscoveryBuilderResult::FetchMachineError).as_str(),
+            "FetchMachineError"
+        );
+    }
 }
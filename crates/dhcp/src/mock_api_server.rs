@@ -22,9 +22,10 @@
 /// Module only included if #cfg(test)
 ///
 use std::collections::HashMap;
-use std::net::{SocketAddr, SocketAddrV4};
+use std::net::{Ipv4Addr, SocketAddr, SocketAddrV4};
 use std::str::FromStr;
 use std::sync::{Arc, Mutex};
+use std::time::Duration;
 
 use ::rpc::forge as rpc;
 use http_body_util::{BodyExt, Full};
@@ -41,6 +42,8 @@ use tokio::task::JoinHandle;
 use crate::machine::Machine;
 
 pub const ENDPOINT_DISCOVER_DHCP: &str = "/forge.Forge/DiscoverDhcp";
+pub const ENDPOINT_DISCOVER_DHCP_BATCH: &str = "/forge.Forge/DiscoverDhcpBatch";
+pub const ENDPOINT_FIND_DHCP_RECORDS: &str = "/forge.Forge/FindDhcpRecords";
 
 // Contents of the response
 const DHCP_RESPONSE_FQDN: &str = "december-nitrogen.forge.local";
@@ -63,8 +66,8 @@ pub fn base_dhcp_response(mac_address: MacAddress) -> rpc::DhcpRecord {
     }
 }
 
-// Encode a DhcpRecord to match gRPC HTTP/2 DATA frame that API server (via hyper) produces.
-pub fn dhcp_response(mac_address_str: &str) -> Vec<u8> {
+// The DhcpRecord the mock API server hands out for a MAC address
+pub fn dhcp_record(mac_address_str: &str) -> rpc::DhcpRecord {
     let mac_address = mac_address_str.parse::<MacAddress>().unwrap();
 
     let mut r = base_dhcp_response(mac_address);
@@ -81,7 +84,12 @@ pub fn dhcp_response(mac_address_str: &str) -> Vec<u8> {
         }
         _ => {}
     }
+    r
+}
 
+// Encode a DhcpRecord to match gRPC HTTP/2 DATA frame that API server (via hyper) produces.
+pub fn dhcp_response(mac_address_str: &str) -> Vec<u8> {
+    let r = dhcp_record(mac_address_str);
     let mut out = Vec::with_capacity(224);
     out.push(0); // Message is not compressed
     out.extend_from_slice(&(r.encoded_len() as u32).to_be_bytes());
@@ -96,8 +104,9 @@ fn address_to_offer(mac: MacAddress) -> String {
 
 // Does this Machine the result we expected?
 pub fn matches_mock_response(machine: &Machine) -> bool {
-    machine.inner.fqdn == DHCP_RESPONSE_FQDN
-        && machine.inner.address == address_to_offer(machine.discovery_info.mac_address)
+    machine.record.hostname.to_bytes() == DHCP_RESPONSE_FQDN.as_bytes()
+        && Ipv4Addr::from(machine.record.interface_address).to_string()
+            == address_to_offer(machine.discovery_info.mac_address)
 }
 
 pub struct MockAPIServer {
@@ -106,6 +115,8 @@ pub struct MockAPIServer {
     tx: Option<tokio::sync::oneshot::Sender<()>>,
     local_addr: String,
     inject_failure: Arc<Mutex<bool>>,
+    response_delay: Arc<Mutex<Duration>>,
+    failure_percent: Arc<Mutex<u8>>,
 }
 
 #[derive(Debug)]
@@ -130,6 +141,10 @@ impl MockAPIServer {
 
         let inject_failure = Arc::new(Mutex::new(false));
         let i2 = inject_failure.clone();
+        let response_delay = Arc::new(Mutex::new(Duration::ZERO));
+        let d2 = response_delay.clone();
+        let failure_percent = Arc::new(Mutex::new(0));
+        let f2 = failure_percent.clone();
         let calls = Arc::new(Mutex::new(HashMap::new()));
         let c2 = calls.clone();
         let listener = TcpListener::bind(addr).await.unwrap();
@@ -139,6 +154,8 @@ impl MockAPIServer {
             loop {
                 let c3 = c2.clone();
                 let i3 = i2.clone();
+                let d3 = d2.clone();
+                let f3 = f2.clone();
                 tokio::select! {
                     result = listener.accept() => {
                         let (stream, _) = result.unwrap();
@@ -146,8 +163,10 @@ impl MockAPIServer {
                             http2::Builder::new(TokioExecutor::new()).serve_connection(TokioIo::new(stream), service_fn(move |req: Request<body::Incoming>| {
                                 let c3 = c3.clone();
                                 let i3 = i3.clone();
+                                let d3 = d3.clone();
+                                let f3 = f3.clone();
                                 async move {
-                                    Ok::<Response<Full<Bytes>>, hyper::Error>(MockAPIServer::handler(req, c3.clone(), i3.clone()).await.unwrap())
+                                    Ok::<Response<Full<Bytes>>, hyper::Error>(MockAPIServer::handler(req, c3.clone(), i3.clone(), d3.clone(), f3.clone()).await.unwrap())
                                 }
                             })).await.inspect_err(|e| eprintln!("ERROR: {e:?}")).unwrap()
                         });
@@ -166,6 +185,8 @@ impl MockAPIServer {
             local_addr: format!("http://{local_addr}"),
             tx: Some(tx),
             inject_failure,
+            response_delay,
+            failure_percent,
         }
     }
 
@@ -178,6 +199,18 @@ impl MockAPIServer {
         *self.inject_failure.lock().unwrap() = fail;
     }
 
+    // Make DiscoverDhcp take at least this long to answer
+    pub fn set_response_delay(&mut self, delay: Duration) {
+        *self.response_delay.lock().unwrap() = delay;
+    }
+
+    // Answer this percentage of discovery calls with an UNAVAILABLE status, spread evenly over
+    // the calls. Unlike `set_inject_failure` the connection stays up, so calls sharing it are
+    // not affected.
+    pub fn set_failure_percent(&mut self, percent: u8) {
+        *self.failure_percent.lock().unwrap() = percent.min(100);
+    }
+
     // Number of times the given endpoint has been hit
     pub fn calls_for(&self, endpoint: &str) -> usize {
         let l = self.calls.lock().unwrap();
@@ -192,26 +225,48 @@ impl MockAPIServer {
         req: Request<Incoming>,
         calls: Arc<Mutex<HashMap<String, usize>>>,
         fail: Arc<Mutex<bool>>,
+        delay: Arc<Mutex<Duration>>,
+        failure_percent: Arc<Mutex<u8>>,
     ) -> Result<Response<Full<Bytes>>, MockAPIServerError> {
         let path = req.uri().path();
-        calls
-            .lock()
-            .unwrap()
-            .entry(path.to_owned())
-            .and_modify(|e| *e += 1)
-            .or_insert(1);
+        let call = {
+            let mut calls = calls.lock().unwrap();
+            let count = calls.entry(path.to_owned()).or_insert(0);
+            *count += 1;
+            *count
+        };
+        let fail_call = fails(call, *failure_percent.lock().unwrap());
         match path {
             // Add the endpoints you need here
             ENDPOINT_DISCOVER_DHCP => {
+                let delay = *delay.lock().unwrap();
+                if !delay.is_zero() {
+                    tokio::time::sleep(delay).await;
+                }
                 let inject_failure = *fail.lock().unwrap();
                 if inject_failure {
                     Err(MockAPIServerError::MockAPIFetchMachineError)
+                } else if fail_call {
+                    respond_unavailable()
                 } else {
                     Ok(Response::new(
                         MockAPIServer::discover_dhcp(req).await.into(),
                     ))
                 }
             }
+            ENDPOINT_DISCOVER_DHCP_BATCH | ENDPOINT_FIND_DHCP_RECORDS => {
+                let delay = *delay.lock().unwrap();
+                if !delay.is_zero() {
+                    tokio::time::sleep(delay).await;
+                }
+                if *fail.lock().unwrap() {
+                    Err(MockAPIServerError::MockAPIFetchMachineError)
+                } else if fail_call {
+                    respond_unavailable()
+                } else {
+                    respond(MockAPIServer::discover_dhcp_batch(req).await)
+                }
+            }
             "/forge.Forge/Echo" => respond(rpc::EchoResponse {
                 message: "dhcp_echo".into(),
             }),
@@ -227,6 +282,22 @@ impl MockAPIServer {
         let disco = rpc::DhcpDiscovery::decode(input_bytes.slice(5..)).unwrap();
         dhcp_response(&disco.mac_address)
     }
+
+    async fn discover_dhcp_batch(req: Request<Incoming>) -> rpc::DhcpDiscoveryBatchResult {
+        let input_bytes = req.into_body().collect().await.unwrap().to_bytes();
+        let batch = rpc::DhcpDiscoveryBatch::decode(input_bytes.slice(5..)).unwrap();
+        rpc::DhcpDiscoveryBatchResult {
+            results: batch
+                .discoveries
+                .iter()
+                .map(|disco| rpc::DhcpDiscoveryResult {
+                    result: Some(rpc::dhcp_discovery_result::Result::Record(dhcp_record(
+                        &disco.mac_address,
+                    ))),
+                })
+                .collect(),
+        }
+    }
 }
 
 impl Drop for MockAPIServer {
@@ -254,3 +325,20 @@ fn respond(out: impl prost::Message) -> Result<Response<Full<Bytes>>, MockAPISer
         .body(body.into())
         .unwrap())
 }
+
+// gRPC "trailers-only" error response: the status goes in the headers and there is no body
+fn respond_unavailable() -> Result<Response<Full<Bytes>>, MockAPIServerError> {
+    Ok(Response::builder()
+        .status(200)
+        .header(header::CONTENT_TYPE, "application/grpc+tonic")
+        .header("grpc-status", "14") // UNAVAILABLE
+        .header("grpc-message", "MockAPIServer injected failure")
+        .body(Full::default())
+        .unwrap())
+}
+
+// Whether the `call`th call (counting from 1) should fail, to fail `percent` of all calls
+fn fails(call: usize, percent: u8) -> bool {
+    let percent = usize::from(percent);
+    call * percent / 100 != (call - 1) * percent / 100
+}
@@ -0,0 +1,429 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2026 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/// Discoveries which don't block the Kea packet thread
+///
+/// With `carbide-async-discovery` enabled, pkt4_receive calls `discovery_start_for` instead of
+/// `discovery_fetch_machine_for`. A cache hit is answered right away, a miss is spawned on the
+/// tokio runtime and the callout returns. Kea then parks the packet at lease4_offer or
+/// leases4_committed until the result is in (see `pending_discovery_notify`), and pkt4_send collects it with
+/// `pending_discovery_wait`.
+///
+use std::ffi::c_void;
+use std::sync::{Arc, Condvar, Mutex};
+
+use opentelemetry::Context;
+use opentelemetry::trace::FutureExt;
+
+use crate::discovery::{Discovery, DiscoveryBuilderResult, DiscoveryRequest, Lookup};
+#[cfg(any(test, feature = "bench-hooks"))]
+use crate::discovery::{DiscoveryBuilder, DiscoveryBuilderFFI, marshal_discovery_ffi};
+use crate::machine::Machine;
+use crate::{CONFIG, CarbideDhcpContext, trace};
+
+/// Called once, from a tokio worker thread, when a discovery completes.
+pub type DiscoveryCompleteCallback = extern "C" fn(user_data: *mut c_void);
+
+/// A discovery which may still be waiting on carbide-api
+///
+/// Shared between the Kea packet (via the callout handle context) and the task doing the fetch.
+pub struct PendingDiscovery {
+    state: Mutex<PendingState>,
+    completed: Condvar,
+}
+
+#[derive(Default)]
+struct PendingState {
+    result: Option<DiscoveryBuilderResult>,
+    machine: Option<Arc<Machine>>,
+    on_complete: Option<Notify>,
+}
+
+struct Notify {
+    callback: DiscoveryCompleteCallback,
+    user_data: *mut c_void,
+}
+
+// user_data belongs to the C++ side, which hands it to us so we can give it back to the
+// callback on whichever thread completes the discovery.
+unsafe impl Send for Notify {}
+
+impl PendingDiscovery {
+    fn new() -> Self {
+        Self {
+            state: Mutex::new(PendingState::default()),
+            completed: Condvar::new(),
+        }
+    }
+
+    fn complete(&self, result: Result<Arc<Machine>, DiscoveryBuilderResult>) {
+        let notify = {
+            let mut state = self.state.lock().unwrap();
+            match result {
+                Ok(machine) => {
+                    state.result = Some(DiscoveryBuilderResult::Success);
+                    state.machine = Some(machine);
+                }
+                Err(err) => state.result = Some(err),
+            }
+            state.on_complete.take()
+        };
+        self.completed.notify_all();
+        // Outside the lock, the callback unparks the packet which can end up in pkt4_send
+        // calling `pending_discovery_wait` on this same object.
+        if let Some(notify) = notify {
+            (notify.callback)(notify.user_data);
+        }
+    }
+}
+
+/// Start the discovery described by the builder without waiting for carbide-api
+///
+/// On `DiscoveryBuilderResult::Success` a `PendingDiscovery` handle is written to
+/// `pending_out`, which must be released with `pending_discovery_free`. It may already be
+/// complete, for example when the answer came from the cache. Any other result means the
+/// discovery could not be started and nothing was written.
+///
+/// # Safety
+///
+/// `ctx` must be a null pointer or a valid `DiscoveryBuilderFFI` object. It is not consumed,
+/// the caller still has to free it.
+///
+/// Only built for the tests, and the benches with the `bench-hooks` feature. pkt4_receive
+/// uses `discovery_start_for`.
+#[cfg(any(test, feature = "bench-hooks"))]
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn discovery_start(
+    ctx: *mut DiscoveryBuilderFFI,
+    pending_out: *mut *const PendingDiscovery,
+) -> DiscoveryBuilderResult {
+    let url = CONFIG.load().api_endpoint.clone();
+
+    unsafe { discovery_start_at(ctx, pending_out, url) }
+}
+
+#[cfg(any(test, feature = "bench-hooks"))]
+unsafe fn discovery_start_at(
+    ctx: *mut DiscoveryBuilderFFI,
+    pending_out: *mut *const PendingDiscovery,
+    url: String,
+) -> DiscoveryBuilderResult {
+    unsafe {
+        if pending_out.is_null() {
+            return DiscoveryBuilderResult::InvalidMachinePointer;
+        }
+        *pending_out = std::ptr::null();
+
+        marshal_discovery_ffi(ctx, |builder: &mut DiscoveryBuilder| {
+            start(crate::discovery::lookup(builder), pending_out, url)
+        })
+    }
+}
+
+/// As `discovery_start`, for a discovery read straight from the packet rather than built up
+/// with the `discovery_set_*` functions
+///
+/// # Safety
+///
+/// `request` must be a null pointer or a valid `DiscoveryRequest`, see `ByteView`.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn discovery_start_for(
+    request: *const DiscoveryRequest,
+    pending_out: *mut *const PendingDiscovery,
+) -> DiscoveryBuilderResult {
+    unsafe {
+        if pending_out.is_null() {
+            return DiscoveryBuilderResult::InvalidMachinePointer;
+        }
+        *pending_out = std::ptr::null();
+        if request.is_null() {
+            return DiscoveryBuilderResult::InvalidDiscoveryBuilderPointer;
+        }
+
+        let _trace = trace::packet_context((*request).trace).map(Context::attach);
+        match Discovery::from_request(&*request) {
+            Ok(discovery) => {
+                let url = CONFIG.load().api_endpoint.clone();
+                start(
+                    crate::discovery::lookup_discovery(discovery),
+                    pending_out,
+                    url,
+                )
+            }
+            Err(err) => err,
+        }
+    }
+}
+
+// Answer from the lookup, or spawn the fetch it needs
+unsafe fn start(
+    lookup: Lookup,
+    pending_out: *mut *const PendingDiscovery,
+    url: String,
+) -> DiscoveryBuilderResult {
+    let pending = Arc::new(PendingDiscovery::new());
+    match lookup {
+        Lookup::Done(result) => pending.complete(result),
+        Lookup::Refresh(machine, fetch) => {
+            fetch.refresh(url);
+            pending.complete(Ok(machine));
+        }
+        Lookup::Fetch(fetch) => {
+            let task_pending = pending.clone();
+            CarbideDhcpContext::get_tokio_runtime().spawn(
+                async move {
+                    task_pending.complete(fetch.run(url).await);
+                }
+                .with_current_context(),
+            );
+        }
+    }
+    unsafe { *pending_out = Arc::into_raw(pending) };
+    DiscoveryBuilderResult::Success
+}
+
+/// Ask for `callback(user_data)` to be called when the discovery completes
+///
+/// Returns false, without registering anything, if it has completed already or a callback is
+/// registered already. Otherwise the callback runs exactly once, on a tokio worker thread. The
+/// caller keeps `user_data` when false is returned.
+///
+/// # Safety
+///
+/// `pending` must be a valid handle from `discovery_start_for`.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn pending_discovery_notify(
+    pending: *const PendingDiscovery,
+    callback: DiscoveryCompleteCallback,
+    user_data: *mut c_void,
+) -> bool {
+    let pending = unsafe { &*pending };
+    let mut state = pending.state.lock().unwrap();
+    if state.result.is_some() || state.on_complete.is_some() {
+        return false;
+    }
+    state.on_complete = Some(Notify {
+        callback,
+        user_data,
+    });
+    true
+}
+
+/// Block until the discovery completes and return its result
+///
+/// On `DiscoveryBuilderResult::Success` the `Machine` is written to `machine_ptr_out` and is
+/// owned by the caller, free it with `machine_free`. Only the first successful call gets the
+/// machine, later calls return `InvalidMachinePointer`.
+///
+/// # Safety
+///
+/// `pending` must be a valid handle from `discovery_start_for`.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn pending_discovery_wait(
+    pending: *const PendingDiscovery,
+    machine_ptr_out: *mut *mut Machine,
+) -> DiscoveryBuilderResult {
+    unsafe {
+        if machine_ptr_out.is_null() {
+            return DiscoveryBuilderResult::InvalidMachinePointer;
+        }
+        *machine_ptr_out = std::ptr::null_mut();
+
+        let pending = &*pending;
+        let mut state = pending
+            .completed
+            .wait_while(pending.state.lock().unwrap(), |state| {
+                state.result.is_none()
+            })
+            .unwrap();
+        match state.result {
+            Some(DiscoveryBuilderResult::Success) => match state.machine.take() {
+                Some(machine) => {
+                    *machine_ptr_out = Arc::into_raw(machine) as *mut Machine;
+                    DiscoveryBuilderResult::Success
+                }
+                None => DiscoveryBuilderResult::InvalidMachinePointer,
+            },
+            Some(err) => err,
+            None => unreachable!("wait_while returned before completion"),
+        }
+    }
+}
+
+/// The machine, if the discovery has already completed, without waiting for it
+///
+/// Returns null while the discovery is running, if it failed, or once `pending_discovery_wait`
+/// has taken the machine. Otherwise the caller gets its own reference to the machine, which it
+/// frees with `machine_free`, and `pending_discovery_wait` still returns it later.
+///
+/// # Safety
+///
+/// `pending` must be a valid handle from `discovery_start_for`.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn pending_discovery_peek(pending: *const PendingDiscovery) -> *mut Machine {
+    let pending = unsafe { &*pending };
+    let state = pending.state.lock().unwrap();
+    match &state.machine {
+        Some(machine) => Arc::into_raw(machine.clone()) as *mut Machine,
+        None => std::ptr::null_mut(),
+    }
+}
+
+/// Release a `PendingDiscovery` handle
+///
+/// If the discovery is still running it carries on, and its result still goes in the cache.
+///
+/// # Safety
+///
+/// `pending` must be a valid handle from `discovery_start_for` and must not be used afterwards.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn pending_discovery_free(pending: *const PendingDiscovery) {
+    unsafe {
+        drop(Arc::from_raw(pending));
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::ptr::{null, null_mut};
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::time::{Duration, Instant};
+
+    use mac_address::MacAddress;
+
+    use super::*;
+    use crate::discovery::{discovery_builder_allocate, discovery_builder_free};
+    use crate::{machine, mock_api_server};
+
+    static NOTIFIED: AtomicUsize = AtomicUsize::new(0);
+
+    extern "C" fn count_notify(_user_data: *mut c_void) {
+        NOTIFIED.fetch_add(1, Ordering::SeqCst);
+    }
+
+    // Only the first registration is kept, the second caller still owns its user_data
+    #[test]
+    fn test_pending_discovery_notify_once() {
+        extern "C" fn count(user_data: *mut c_void) {
+            unsafe { &*(user_data as *const AtomicUsize) }.fetch_add(1, Ordering::SeqCst);
+        }
+        let first = AtomicUsize::new(0);
+        let second = AtomicUsize::new(0);
+        let user_data = |count: &AtomicUsize| count as *const AtomicUsize as *mut c_void;
+
+        let pending = PendingDiscovery::new();
+        unsafe {
+            assert!(pending_discovery_notify(&pending, count, user_data(&first)));
+            assert!(!pending_discovery_notify(
+                &pending,
+                count,
+                user_data(&second)
+            ));
+        }
+        pending.complete(Err(DiscoveryBuilderResult::FetchMachineError));
+        assert_eq!(first.load(Ordering::SeqCst), 1);
+        assert_eq!(second.load(Ordering::SeqCst), 0);
+        assert!(!unsafe { pending_discovery_notify(&pending, count, user_data(&second)) });
+    }
+
+    #[test]
+    fn test_discovery_start_handles_null() {
+        unsafe {
+            assert_eq!(
+                discovery_start(null_mut(), null_mut()),
+                DiscoveryBuilderResult::InvalidMachinePointer
+            );
+
+            let mut out = null();
+            assert_eq!(
+                discovery_start(null_mut(), &mut out),
+                DiscoveryBuilderResult::InvalidDiscoveryBuilderPointer
+            );
+            assert!(out.is_null());
+        }
+    }
+
+    // Start a discovery without blocking, get told when it's done, then collect it.
+    #[test]
+    fn test_discovery_start_success() {
+        let rt: &tokio::runtime::Runtime = CarbideDhcpContext::get_tokio_runtime();
+        let api_server = rt.block_on(mock_api_server::MockAPIServer::start());
+
+        let builder_ffi = discovery_builder_allocate();
+        unsafe {
+            marshal_discovery_ffi(builder_ffi, |builder| {
+                builder.relay_address([172, 20, 0, 14].into());
+                builder.mac_address(MacAddress::new([2, 66, 172, 20, 14, 1]));
+                builder.circuit_id("eth0");
+                DiscoveryBuilderResult::Success
+            });
+        }
+
+        let mut pending = null();
+        let res = unsafe {
+            discovery_start_at(
+                builder_ffi,
+                &mut pending,
+                api_server.local_http_addr().to_string(),
+            )
+        };
+        assert_eq!(res, DiscoveryBuilderResult::Success);
+        assert!(!pending.is_null());
+
+        // Either we get in before the fetch completes and are notified, or it's already done
+        let notified_before = NOTIFIED.load(Ordering::SeqCst);
+        let registered = unsafe { pending_discovery_notify(pending, count_notify, null_mut()) };
+
+        // Peeking doesn't take the machine from the wait below
+        let deadline = Instant::now() + Duration::from_secs(5);
+        let mut peeked = unsafe { pending_discovery_peek(pending) };
+        while peeked.is_null() && Instant::now() < deadline {
+            std::thread::sleep(Duration::from_millis(1));
+            peeked = unsafe { pending_discovery_peek(pending) };
+        }
+        assert!(!peeked.is_null());
+        assert!(mock_api_server::matches_mock_response(unsafe { &*peeked }));
+        machine::machine_free(peeked);
+
+        let mut out = null_mut();
+        let res = unsafe { pending_discovery_wait(pending, &mut out) };
+        assert_eq!(res, DiscoveryBuilderResult::Success);
+        let machine = unsafe { &*out };
+        assert!(mock_api_server::matches_mock_response(machine));
+        if registered {
+            // The callback runs just after waiters are woken, give it a moment
+            let deadline = Instant::now() + Duration::from_secs(1);
+            while NOTIFIED.load(Ordering::SeqCst) == notified_before && Instant::now() < deadline {
+                std::thread::sleep(Duration::from_millis(1));
+            }
+            assert_eq!(NOTIFIED.load(Ordering::SeqCst), notified_before + 1);
+        }
+
+        // The machine can only be taken once
+        let mut again = null_mut();
+        let res = unsafe { pending_discovery_wait(pending, &mut again) };
+        assert_eq!(res, DiscoveryBuilderResult::InvalidMachinePointer);
+        assert!(again.is_null());
+        assert!(unsafe { pending_discovery_peek(pending) }.is_null());
+
+        machine::machine_free(out);
+        unsafe {
+            pending_discovery_free(pending);
+            discovery_builder_free(builder_ffi);
+        }
+    }
+}
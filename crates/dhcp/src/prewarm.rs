@@ -0,0 +1,192 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2026 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/// Fill the cache from carbide-api in bulk when the hook is loaded
+///
+/// The snapshot (snapshot.rs) only puts back machines whose TTL hasn't run out. After a longer
+/// restart that can be none of them, and the first packet from every host is a DiscoverDhcp.
+/// With `carbide-cache-prewarm` the machines left out are looked up again in the background,
+/// `carbide-cache-prewarm-batch` to a FindDhcpRecords call, while Kea is already serving.
+/// A machine some packet fetched first is left as it is.
+///
+/// FindDhcpRecords only reads. A DiscoverDhcp would create interfaces, allocate addresses and
+/// record a DHCP request for machines which haven't sent one since the restart.
+///
+/// With `carbide-cache-prewarm-wait-ready` as well, the readiness probe stays false until
+/// that's done, so a rolling upgrade doesn't move on while this server is still cold.
+///
+/// The cache is keyed on what clients send, not only on their DhcpRecord, so the discoveries to
+/// prewarm come from the snapshot. Without one there's nothing to do.
+///
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::Instant;
+
+use crate::cache::{self, CacheEntry, CacheEntryStatus, CacheKey};
+use crate::machine::{self, Machine};
+use crate::metrics::{self, set_service_ready};
+use crate::{CONFIG, CarbideDhcpContext, api_client, batch};
+
+/// Default for `carbide-cache-prewarm-batch`, also the most it can be
+pub const DEFAULT_PREWARM_BATCH: usize = batch::MAX_BATCH_SIZE;
+
+/// False while readiness waits for prewarming
+static FINISHED: AtomicBool = AtomicBool::new(true);
+
+/// Fetch `expired` again in the background, if `carbide-cache-prewarm` is on
+///
+/// Called when the hook is loaded, with what `snapshot::start` left out.
+pub fn start(expired: Vec<(CacheKey, Arc<Machine>)>) {
+    let (url, batch_size, wait_ready) = {
+        let config = CONFIG.load();
+        if !config.cache_prewarm || expired.is_empty() {
+            return;
+        }
+        (
+            config.api_endpoint.clone(),
+            config.cache_prewarm_batch,
+            config.cache_prewarm_wait_ready,
+        )
+    };
+    if wait_ready {
+        FINISHED.store(false, Ordering::Relaxed);
+        set_service_ready(false);
+    }
+
+    CarbideDhcpContext::get_tokio_runtime().spawn(async move {
+        let started = Instant::now();
+        let total = expired.len();
+        let warmed = prewarm(&url, expired, batch_size).await;
+        log::info!(
+            "prewarmed {warmed} of {total} machines from carbide-api in {:?}",
+            started.elapsed()
+        );
+        if wait_ready {
+            FINISHED.store(true, Ordering::Relaxed);
+            set_service_ready(metrics::check_api_connectivity(&url).await);
+        }
+    });
+}
+
+/// Whether readiness is no longer waiting on prewarming
+pub fn finished() -> bool {
+    FINISHED.load(Ordering::Relaxed)
+}
+
+// Returns how many machines made it into the cache
+async fn prewarm(url: &str, expired: Vec<(CacheKey, Arc<Machine>)>, batch_size: usize) -> usize {
+    let client = api_client::get(url);
+    let mut warmed = 0;
+    for page in expired.chunks(batch_size.clamp(1, batch::MAX_BATCH_SIZE)) {
+        let requests = page
+            .iter()
+            .map(|(_, machine)| machine::discovery_request(&machine.discovery_info))
+            .collect();
+        let records = batch::find_dhcp_records(&client, requests).await;
+        for ((key, machine), record) in page.iter().zip(records) {
+            // Left for the next packet to retry, it's not worth a negative entry
+            let record = match record {
+                Ok(record) => record,
+                Err(status) => {
+                    log::debug!("unable to prewarm {key}: {status}");
+                    continue;
+                }
+            };
+            let machine = Machine::new(
+                record,
+                machine.discovery_info.clone(),
+                machine.vendor_class.clone(),
+            );
+            let entry = CacheEntry {
+                timestamp: Instant::now(),
+                status: CacheEntryStatus::ValidEntry(Arc::new(machine)),
+                refresh_failed: None,
+            };
+            if cache::restore(*key, entry) {
+                warmed += 1;
+            }
+        }
+    }
+    warmed
+}
+
+#[cfg(test)]
+mod tests {
+    use std::net::{IpAddr, Ipv4Addr};
+
+    use mac_address::MacAddress;
+
+    use super::*;
+    use crate::discovery::Discovery;
+    use crate::mock_api_server;
+
+    fn expired(last_mac: u8) -> (CacheKey, Arc<Machine>) {
+        let mac_address = MacAddress::new([2, 66, 172, 20, 23, last_mac]);
+        let key = CacheKey::new(
+            mac_address,
+            IpAddr::V4(Ipv4Addr::new(172, 20, 23, 254)),
+            &None,
+            &None,
+            "",
+        )
+        .unwrap();
+        let discovery = Discovery {
+            relay_address: Ipv4Addr::new(172, 20, 23, 254),
+            mac_address,
+            _client_system: None,
+            vendor_class: None,
+            link_select_address: None,
+            circuit_id: None,
+            remote_id: None,
+            desired_address: None,
+        };
+        let record = mock_api_server::dhcp_record(&mac_address.to_string());
+        (key, Arc::new(Machine::new(record, discovery, None)))
+    }
+
+    // Pages of FindDhcpRecords, and every machine ends up in the cache
+    #[test]
+    fn test_prewarm_fills_cache_in_batches() {
+        let rt: &tokio::runtime::Runtime = CarbideDhcpContext::get_tokio_runtime();
+        let api_server = rt.block_on(mock_api_server::MockAPIServer::start());
+        let expired: Vec<_> = (1..=5).map(expired).collect();
+        let keys: Vec<_> = expired.iter().map(|(key, _)| *key).collect();
+
+        let warmed = rt.block_on(prewarm(api_server.local_http_addr(), expired, 2));
+
+        assert_eq!(warmed, 5);
+        for key in &keys {
+            assert!(matches!(
+                cache::get(key).map(|entry| entry.status),
+                Some(CacheEntryStatus::ValidEntry(_))
+            ));
+        }
+        // 2 + 2 + 1, and nothing which would make carbide-api write
+        assert_eq!(
+            api_server.calls_for(mock_api_server::ENDPOINT_FIND_DHCP_RECORDS),
+            3
+        );
+        assert_eq!(
+            api_server.calls_for(mock_api_server::ENDPOINT_DISCOVER_DHCP_BATCH),
+            0
+        );
+        assert_eq!(
+            api_server.calls_for(mock_api_server::ENDPOINT_DISCOVER_DHCP),
+            0
+        );
+    }
+}
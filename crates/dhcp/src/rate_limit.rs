@@ -0,0 +1,247 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2026 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/// Limit how many packets a single client or relay gets handled
+///
+/// The negative cache only helps once carbide-api has failed for a client. A BMC or DPU stuck
+/// in a PXE loop sends valid requests which keep costing a Kea thread, and often an RPC, each.
+/// pkt4_receive asks `carbide_rate_limit` about each packet before looking the machine up,
+/// and drops it if it is over the limit.
+///
+/// Each MAC address gets a token bucket of `carbide-rate-limit-client-burst` packets, refilled
+/// at `carbide-rate-limit-client-per-sec`. Each relay, by giaddr, gets one sized by the
+/// `carbide-rate-limit-relay-*` params. A rate of 0 turns that limit off, which is the default.
+/// The check comes before anything else is done with the packet, option 82 isn't parsed yet.
+///
+/// Buckets are kept in sharded LRUs like the cache. A client which drops out of one starts
+/// again with a full bucket.
+///
+use std::hash::{BuildHasher, Hash, RandomState};
+use std::num::NonZeroUsize;
+use std::sync::Mutex;
+use std::time::Instant;
+
+use lazy_static::lazy_static;
+use lru::LruCache;
+
+use crate::CONFIG;
+use crate::discovery::ByteView;
+use crate::metrics::DropReason;
+
+/// Default for `carbide-rate-limit-client-burst`
+pub const DEFAULT_CLIENT_BURST: u32 = 20;
+/// Default for `carbide-rate-limit-relay-burst`
+pub const DEFAULT_RELAY_BURST: u32 = 1000;
+/// Buckets kept for each of clients and relays
+const RATE_LIMIT_TABLE_SIZE: usize = 16384;
+const RATE_LIMIT_SHARDS: usize = 16;
+
+lazy_static! {
+    static ref CLIENT_LIMIT: RateLimiter<[u8; 6]> = {
+        let config = CONFIG.load();
+        RateLimiter::new(
+            config.rate_limit_client_per_sec,
+            config.rate_limit_client_burst,
+        )
+    };
+    static ref RELAY_LIMIT: RateLimiter<u32> = {
+        let config = CONFIG.load();
+        RateLimiter::new(
+            config.rate_limit_relay_per_sec,
+            config.rate_limit_relay_burst,
+        )
+    };
+}
+
+#[derive(Debug, Clone, Copy)]
+struct TokenBucket {
+    tokens: f64,
+    updated: Instant,
+}
+
+struct RateLimiter<K> {
+    shards: Vec<Mutex<LruCache<K, TokenBucket>>>,
+    hasher: RandomState,
+    /// Tokens added per second, 0 for no limit
+    rate: f64,
+    burst: f64,
+}
+
+impl<K: Hash + Eq> RateLimiter<K> {
+    fn new(per_sec: u32, burst: u32) -> RateLimiter<K> {
+        let shard_capacity =
+            NonZeroUsize::new(RATE_LIMIT_TABLE_SIZE.div_ceil(RATE_LIMIT_SHARDS)).unwrap();
+        RateLimiter {
+            shards: (0..RATE_LIMIT_SHARDS)
+                .map(|_| Mutex::new(LruCache::new(shard_capacity)))
+                .collect(),
+            hasher: RandomState::new(),
+            rate: per_sec.into(),
+            // A burst smaller than one packet would never let anything through
+            burst: burst.max(1).into(),
+        }
+    }
+
+    /// Take a token from the bucket for `key`. False if it's empty.
+    fn allow(&self, key: K, now: Instant) -> bool {
+        if self.rate == 0.0 {
+            return true;
+        }
+        let index = self.hasher.hash_one(&key) as usize % self.shards.len();
+        let mut shard = self.shards[index].lock().unwrap();
+        let bucket = shard.get_or_insert_mut(key, || TokenBucket {
+            tokens: self.burst,
+            updated: now,
+        });
+        let elapsed = now.saturating_duration_since(bucket.updated).as_secs_f64();
+        bucket.tokens = (bucket.tokens + elapsed * self.rate).min(self.burst);
+        bucket.updated = now;
+        if bucket.tokens < 1.0 {
+            return false;
+        }
+        bucket.tokens -= 1.0;
+        true
+    }
+
+    /// Put back a token `allow` took for `key`, for a packet which was dropped after all
+    fn refund(&self, key: K) {
+        if self.rate == 0.0 {
+            return;
+        }
+        let index = self.hasher.hash_one(&key) as usize % self.shards.len();
+        if let Some(bucket) = self.shards[index].lock().unwrap().peek_mut(&key) {
+            bucket.tokens = (bucket.tokens + 1.0).min(self.burst);
+        }
+    }
+}
+
+/// Whether to handle a packet from `mac_address` through the relay at `link_address`
+///
+/// Returns false if either is over its limit, with the reason to count the drop under in
+/// `reason_out`. A MAC address which isn't 6 bytes is only limited by its relay.
+///
+/// A dropped packet doesn't count against the other limit: the relay is asked first, so a
+/// busy relay doesn't use up its clients' tokens, and a client over its limit gets the relay
+/// token back.
+///
+/// # Safety
+///
+/// `mac_address` must be a valid view, and `reason_out` a valid pointer.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn carbide_rate_limit(
+    mac_address: ByteView,
+    relay_address: u32,
+    reason_out: *mut DropReason,
+) -> bool {
+    unsafe {
+        rate_limit(
+            &CLIENT_LIMIT,
+            &RELAY_LIMIT,
+            mac_address,
+            relay_address,
+            reason_out,
+        )
+    }
+}
+
+unsafe fn rate_limit(
+    clients: &RateLimiter<[u8; 6]>,
+    relays: &RateLimiter<u32>,
+    mac_address: ByteView,
+    relay_address: u32,
+    reason_out: *mut DropReason,
+) -> bool {
+    let now = Instant::now();
+    if !relays.allow(relay_address, now) {
+        unsafe { *reason_out = DropReason::RelayRateLimited };
+        return false;
+    }
+    let mac_address: Option<[u8; 6]> =
+        unsafe { mac_address.as_bytes() }.and_then(|bytes| bytes.try_into().ok());
+    if mac_address.is_some_and(|mac_address| !clients.allow(mac_address, now)) {
+        relays.refund(relay_address);
+        unsafe { *reason_out = DropReason::ClientRateLimited };
+        return false;
+    }
+    true
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+
+    use super::*;
+
+    // A burst goes through, then one packet per 1/rate seconds
+    #[test]
+    fn test_rate_limit_bucket() {
+        let limiter = RateLimiter::new(2, 3);
+        let start = Instant::now();
+        for _ in 0..3 {
+            assert!(limiter.allow(1u32, start));
+        }
+        assert!(!limiter.allow(1, start));
+        // Others have their own bucket
+        assert!(limiter.allow(2, start));
+
+        assert!(!limiter.allow(1, start + Duration::from_millis(400)));
+        assert!(limiter.allow(1, start + Duration::from_millis(600)));
+        assert!(!limiter.allow(1, start + Duration::from_millis(600)));
+
+        // Refills up to the burst and no further
+        let later = start + Duration::from_secs(60);
+        for _ in 0..3 {
+            assert!(limiter.allow(1, later));
+        }
+        assert!(!limiter.allow(1, later));
+    }
+
+    // Neither limit is charged for a packet the other one drops
+    #[test]
+    fn test_rate_limit_relay_first() {
+        let clients = RateLimiter::new(1, 1);
+        let relays = RateLimiter::new(1, 2);
+        let mut reason = DropReason::NonRelayedPacket;
+        let (first, second) = ([2, 66, 172, 20, 26, 1], [2, 66, 172, 20, 26, 2]);
+        let view = |mac: &[u8; 6]| ByteView {
+            ptr: mac.as_ptr(),
+            len: mac.len(),
+        };
+        unsafe {
+            assert!(rate_limit(&clients, &relays, view(&first), 1, &mut reason));
+            // Over the client's limit, the relay keeps its token for the next client
+            assert!(!rate_limit(&clients, &relays, view(&first), 1, &mut reason));
+            assert_eq!(reason, DropReason::ClientRateLimited);
+            assert!(rate_limit(&clients, &relays, view(&second), 1, &mut reason));
+
+            // Over the relay's limit, a client on another relay still has its token
+            let third = [2, 66, 172, 20, 26, 3];
+            assert!(!rate_limit(&clients, &relays, view(&third), 1, &mut reason));
+            assert_eq!(reason, DropReason::RelayRateLimited);
+            assert!(rate_limit(&clients, &relays, view(&third), 2, &mut reason));
+        }
+    }
+
+    #[test]
+    fn test_rate_limit_off() {
+        let limiter = RateLimiter::new(0, 0);
+        let start = Instant::now();
+        for _ in 0..100 {
+            assert!(limiter.allow(1u32, start));
+        }
+    }
+}
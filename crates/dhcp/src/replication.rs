@@ -0,0 +1,437 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2026 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/// Keep the cache of the other server in an HA pair warm
+///
+/// Each Kea of a pair has its own cache, so after a failover the survivor would take every
+/// client cold, and forget which ones carbide-api keeps failing for. With
+/// `carbide-cache-replication-peer` set, every cache insert, invalidation and flush is sent
+/// to the peer in a UDP datagram, and with `carbide-cache-replication-listen` set, the peer's
+/// are applied here. Entries keep their age, so they expire on both servers at the same time.
+///
+/// Updates go through a bounded queue to a task on the tokio runtime, so a packet thread never
+/// waits on the network. When the queue is full, or a datagram is lost, the peer misses that
+/// update and asks carbide-api itself.
+///
+/// Datagrams are signed with a BLAKE3 keyed hash derived from
+/// `carbide-cache-replication-secret`, which both servers need, and are only accepted within
+/// `MAX_CLOCK_SKEW` of when they were sent. Each carries the time the sender started and a
+/// counter, and one that is not after the last accepted is dropped, so a captured datagram
+/// can't be replayed. Little endian, the entry is as in snapshot.rs:
+///
+/// ```text
+/// "CDHCPRP2", sent at (u64 ms since the epoch), sender started at (u64 ns since the epoch),
+/// counter (u64), kind (u8), then by kind
+///   0 put:        cache entry
+///   1 invalidate: MAC address, link address and circuit id hash, each optional
+///   2 flush:      nothing
+/// keyed hash of all of the above (32 bytes)
+/// ```
+///
+use std::io;
+use std::net::{IpAddr, Ipv4Addr, Ipv6Addr, SocketAddr};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant, SystemTime};
+
+use arc_swap::ArcSwapOption;
+use lazy_static::lazy_static;
+use tokio::net::UdpSocket;
+use tokio::sync::mpsc;
+use tokio::task::JoinHandle;
+
+use crate::cache::{self, CacheEntry, CacheKey, CacheMatch};
+use crate::snapshot::{self, Reader};
+use crate::{CONFIG, CarbideDhcpContext};
+
+const MAGIC: &[u8; 8] = b"CDHCPRP2";
+const KIND_PUT: u8 = 0;
+const KIND_INVALIDATE: u8 = 1;
+const KIND_FLUSH: u8 = 2;
+const HASH_LEN: usize = blake3::OUT_LEN;
+const KEY_CONTEXT: &str = "carbide-dhcp 2026 cache replication";
+/// Older or newer datagrams are dropped
+const MAX_CLOCK_SKEW: Duration = Duration::from_secs(30);
+/// Updates waiting to be sent
+const QUEUE_SIZE: usize = 4096;
+
+lazy_static! {
+    static ref QUEUE: ArcSwapOption<mpsc::Sender<Update>> = ArcSwapOption::empty();
+    /// The sending and receiving tasks
+    static ref TASKS: Mutex<Vec<JoinHandle<()>>> = Mutex::new(Vec::new());
+}
+
+/// Where a datagram comes in the sender's sequence
+///
+/// A restarted sender starts at a greater `started`, so its counter can begin at 0 again.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+struct Sequence {
+    started: u64,
+    counter: u64,
+}
+
+#[derive(Debug, Clone)]
+enum Update {
+    Put(CacheKey, CacheEntry),
+    Invalidate(CacheMatch),
+    Flush,
+}
+
+/// Pass a cache insert on to the peer
+pub(crate) fn cache_put(key: CacheKey, entry: CacheEntry) {
+    send(Update::Put(key, entry));
+}
+
+/// Pass an invalidation from the control channel on to the peer
+pub(crate) fn cache_invalidated(matching: CacheMatch) {
+    send(Update::Invalidate(matching));
+}
+
+/// Pass a flush from the control channel on to the peer
+pub(crate) fn cache_flushed() {
+    send(Update::Flush);
+}
+
+fn send(update: Update) {
+    let Some(queue) = QUEUE.load_full() else {
+        return;
+    };
+    if queue.try_send(update).is_err() {
+        log::debug!("cache replication queue is full, dropping an update");
+    }
+}
+
+/// Start sending to and receiving from the peer, as configured
+///
+/// Called when the hook is loaded, once its parameters are in.
+pub fn start() {
+    let (listen, peer, secret) = {
+        let config = CONFIG.load();
+        (
+            config.cache_replication_listen,
+            config.cache_replication_peer,
+            config.cache_replication_secret.clone(),
+        )
+    };
+    if listen.is_none() && peer.is_none() {
+        return;
+    }
+    let Some(secret) = secret else {
+        log::error!("carbide-cache-replication-secret is not set, not replicating the cache");
+        return;
+    };
+    let signing_key = blake3::derive_key(KEY_CONTEXT, secret.as_bytes());
+
+    let runtime = CarbideDhcpContext::get_tokio_runtime();
+    let mut tasks = TASKS.lock().unwrap();
+    if let Some(peer) = peer {
+        let (queue, updates) = mpsc::channel(QUEUE_SIZE);
+        QUEUE.store(Some(Arc::new(queue)));
+        tasks.push(runtime.spawn(send_updates(peer, signing_key, updates)));
+        log::info!("replicating cache updates to {peer}");
+    }
+    if let Some(listen) = listen {
+        tasks.push(runtime.spawn(receive_updates(listen, signing_key)));
+    }
+}
+
+/// Stop replicating. Called when the hook is unloaded.
+pub fn stop() {
+    QUEUE.store(None);
+    for task in TASKS.lock().unwrap().drain(..) {
+        task.abort();
+    }
+}
+
+async fn send_updates(
+    peer: SocketAddr,
+    signing_key: [u8; 32],
+    mut updates: mpsc::Receiver<Update>,
+) {
+    let local: SocketAddr = match peer.ip() {
+        IpAddr::V4(_) => (Ipv4Addr::UNSPECIFIED, 0).into(),
+        IpAddr::V6(_) => (Ipv6Addr::UNSPECIFIED, 0).into(),
+    };
+    let socket = match UdpSocket::bind(local).await {
+        Ok(socket) => socket,
+        Err(err) => {
+            log::error!("unable to open a socket for cache replication: {err}");
+            return;
+        }
+    };
+    let mut sequence = Sequence {
+        started: unix_nanos(SystemTime::now()),
+        counter: 0,
+    };
+    while let Some(update) = updates.recv().await {
+        sequence.counter += 1;
+        let datagram = encode(&update, &signing_key, SystemTime::now(), sequence);
+        if let Err(err) = socket.send_to(&datagram, peer).await {
+            log::debug!("unable to send cache update to {peer}: {err}");
+        }
+    }
+}
+
+async fn receive_updates(listen: SocketAddr, signing_key: [u8; 32]) {
+    let socket = match UdpSocket::bind(listen).await {
+        Ok(socket) => socket,
+        Err(err) => {
+            log::error!("unable to listen for cache replication on {listen}: {err}");
+            return;
+        }
+    };
+    log::info!("listening for cache updates on {listen}");
+    let mut buf = vec![0; u16::MAX as usize];
+    let mut last = None;
+    loop {
+        let (len, from) = match socket.recv_from(&mut buf).await {
+            Ok(received) => received,
+            Err(err) => {
+                log::debug!("unable to receive cache update: {err}");
+                continue;
+            }
+        };
+        match decode(&buf[..len], &signing_key, SystemTime::now(), &mut last) {
+            Ok(update) => apply(update),
+            Err(err) => log::warn!("ignoring cache update from {from}: {err}"),
+        }
+    }
+}
+
+fn apply(update: Update) {
+    match update {
+        Update::Put(key, entry) => {
+            cache::replace(key, entry);
+        }
+        Update::Invalidate(matching) => {
+            cache::invalidate(&matching);
+        }
+        Update::Flush => {
+            cache::flush();
+        }
+    }
+}
+
+fn unix_nanos(time: SystemTime) -> u64 {
+    time.duration_since(SystemTime::UNIX_EPOCH)
+        .map_or(0, |since| since.as_nanos() as u64)
+}
+
+fn encode(update: &Update, signing_key: &[u8; 32], now: SystemTime, sequence: Sequence) -> Vec<u8> {
+    let mut out = Vec::with_capacity(512);
+    out.extend_from_slice(MAGIC);
+    snapshot::put_u64(&mut out, snapshot::unix_millis(now));
+    snapshot::put_u64(&mut out, sequence.started);
+    snapshot::put_u64(&mut out, sequence.counter);
+    match update {
+        Update::Put(key, entry) => {
+            out.push(KIND_PUT);
+            snapshot::put_entry(&mut out, key, entry);
+        }
+        Update::Invalidate(matching) => {
+            out.push(KIND_INVALIDATE);
+            snapshot::put_opt(&mut out, &matching.mac_address, |out, mac_address| {
+                out.extend_from_slice(mac_address)
+            });
+            snapshot::put_opt(&mut out, &matching.link_address, snapshot::put_ip);
+            snapshot::put_opt(&mut out, &matching.circuit_id, |out, circuit_id| {
+                snapshot::put_u64(out, *circuit_id)
+            });
+        }
+        Update::Flush => out.push(KIND_FLUSH),
+    }
+    let hash = blake3::keyed_hash(signing_key, &out);
+    out.extend_from_slice(hash.as_bytes());
+    out
+}
+
+/// Check and read a datagram. `last` is the sequence of the last one accepted, and is moved
+/// on when this one is.
+fn decode(
+    datagram: &[u8],
+    signing_key: &[u8; 32],
+    now: SystemTime,
+    last: &mut Option<Sequence>,
+) -> io::Result<Update> {
+    let Some(signed_len) = datagram.len().checked_sub(HASH_LEN) else {
+        return Err(snapshot::invalid("cache update is truncated"));
+    };
+    let (signed, hash) = datagram.split_at(signed_len);
+    // blake3::Hash compares in constant time
+    if blake3::keyed_hash(signing_key, signed) != blake3::Hash::from_bytes(hash.try_into().unwrap())
+    {
+        return Err(snapshot::invalid("cache update has a bad signature"));
+    }
+
+    let mut reader = Reader(signed);
+    if reader.bytes(MAGIC.len())? != MAGIC {
+        return Err(snapshot::invalid(
+            "not a cache update, or from another version",
+        ));
+    }
+    let sent_at = reader.u64()?;
+    if snapshot::unix_millis(now).abs_diff(sent_at) > MAX_CLOCK_SKEW.as_millis() as u64 {
+        return Err(snapshot::invalid(
+            "cache update is too old, or the clocks are out",
+        ));
+    }
+    let sequence = Sequence {
+        started: reader.u64()?,
+        counter: reader.u64()?,
+    };
+    if last.is_some_and(|last| sequence <= last) {
+        return Err(snapshot::invalid(
+            "cache update was already received, or is out of order",
+        ));
+    }
+
+    let update = match reader.u8()? {
+        KIND_PUT => {
+            let (key, age, status) = reader.entry()?;
+            let timestamp = Instant::now()
+                .checked_sub(age)
+                .ok_or_else(|| snapshot::invalid("cache update is older than this process"))?;
+            Update::Put(
+                key,
+                CacheEntry {
+                    timestamp,
+                    status,
+                    refresh_failed: None,
+                },
+            )
+        }
+        KIND_INVALIDATE => Update::Invalidate(CacheMatch {
+            mac_address: reader.opt(Reader::array)?,
+            link_address: reader.opt(Reader::ip)?,
+            circuit_id: reader.opt(Reader::u64)?,
+        }),
+        KIND_FLUSH => Update::Flush,
+        _ => return Err(snapshot::invalid("cache update has a bad kind")),
+    };
+    *last = Some(sequence);
+    Ok(update)
+}
+
+#[cfg(test)]
+mod tests {
+    use mac_address::MacAddress;
+
+    use super::*;
+    use crate::cache::CacheEntryStatus;
+
+    const KEY: [u8; 32] = [7; 32];
+
+    fn sequence(started: u64, counter: u64) -> Sequence {
+        Sequence { started, counter }
+    }
+
+    #[test]
+    fn test_replication_round_trip() {
+        let now = SystemTime::now();
+        let mut last = None;
+        let key = CacheKey::new(
+            MacAddress::new([2, 66, 172, 20, 19, 1]),
+            IpAddr::V4(Ipv4Addr::new(172, 20, 19, 0)),
+            &Some("Ethernet3".to_string()),
+            &None,
+            "",
+        )
+        .unwrap();
+        let put = Update::Put(
+            key,
+            CacheEntry {
+                timestamp: Instant::now() - Duration::from_secs(20),
+                status: CacheEntryStatus::DiscoveryFailing(2),
+                refresh_failed: None,
+            },
+        );
+        match decode(
+            &encode(&put, &KEY, now, sequence(1, 1)),
+            &KEY,
+            now,
+            &mut last,
+        )
+        .unwrap()
+        {
+            Update::Put(decoded, entry) => {
+                assert_eq!(decoded, key);
+                assert!(matches!(
+                    entry.status,
+                    CacheEntryStatus::DiscoveryFailing(2)
+                ));
+                // Keeps its age, give or take the time the test takes
+                let age = entry.timestamp.elapsed();
+                assert!(age >= Duration::from_secs(20) && age < Duration::from_secs(25));
+            }
+            other => panic!("unexpected {other:?}"),
+        }
+
+        let matching = CacheMatch {
+            mac_address: Some([2, 66, 172, 20, 19, 1]),
+            link_address: None,
+            circuit_id: Some(42),
+        };
+        let invalidate = encode(&Update::Invalidate(matching), &KEY, now, sequence(1, 2));
+        assert!(matches!(
+            decode(&invalidate, &KEY, now, &mut last).unwrap(),
+            Update::Invalidate(decoded) if decoded == matching
+        ));
+        assert!(matches!(
+            decode(
+                &encode(&Update::Flush, &KEY, now, sequence(1, 3)),
+                &KEY,
+                now,
+                &mut last
+            )
+            .unwrap(),
+            Update::Flush
+        ));
+        assert_eq!(last, Some(sequence(1, 3)));
+    }
+
+    // A datagram which was changed, signed with another secret, or sent long ago is refused
+    #[test]
+    fn test_replication_rejects_bad_datagrams() {
+        let now = SystemTime::now();
+        let mut last = None;
+        let mut flush = encode(&Update::Flush, &KEY, now, sequence(1, 1));
+        assert!(decode(&flush, &[8; 32], now, &mut last).is_err());
+        assert!(decode(&flush, &KEY, now + Duration::from_secs(60), &mut last).is_err());
+        assert!(decode(&flush[..10], &KEY, now, &mut last).is_err());
+        flush[MAGIC.len() + 24] = KIND_INVALIDATE;
+        assert!(decode(&flush, &KEY, now, &mut last).is_err());
+        assert_eq!(last, None);
+    }
+
+    // A datagram is only accepted once, and not after a later one from the same sender
+    #[test]
+    fn test_replication_rejects_replays() {
+        let now = SystemTime::now();
+        let mut last = None;
+        let first = encode(&Update::Flush, &KEY, now, sequence(1, 1));
+        let second = encode(&Update::Flush, &KEY, now, sequence(1, 2));
+        assert!(decode(&first, &KEY, now, &mut last).is_ok());
+        assert!(decode(&first, &KEY, now, &mut last).is_err());
+        assert!(decode(&second, &KEY, now, &mut last).is_ok());
+        assert!(decode(&first, &KEY, now, &mut last).is_err());
+
+        // A restarted sender counts from the start again
+        let restarted = encode(&Update::Flush, &KEY, now, sequence(2, 1));
+        assert!(decode(&restarted, &KEY, now, &mut last).is_ok());
+        assert!(decode(&second, &KEY, now, &mut last).is_err());
+        assert_eq!(last, Some(sequence(2, 1)));
+    }
+}
@@ -0,0 +1,566 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2026 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/// Cache snapshot, so a restarted Kea doesn't start cold
+///
+/// With `carbide-cache-snapshot-path` set, the cache is written to that file every
+/// `carbide-cache-snapshot-interval-secs` and when the hook is unloaded, and read back when it
+/// is loaded. Entries keep the TTL they had left, minus the time Kea was down, so renewals after
+/// a restart are answered from the cache instead of every client asking carbide-api at once.
+///
+/// The file is a compact binary format of our own, little endian throughout:
+///
+/// ```text
+/// header: "CDHCPSN2", written at (u64 ms since the epoch), entry count (u32)
+/// entry:  cache key, age (u64 ms), status (u8), then by status
+///         0 valid:   discovery, then the `MachineRecord`
+///         1 failing: failure count (u32)
+///         2 failed:  nothing
+/// ```
+///
+/// A snapshot from before the cache kept `MachineRecord`s has another magic, and is ignored.
+///
+/// It is written to a temporary file which is then renamed over the old one, so a crash while
+/// writing leaves the previous snapshot. A file which can't be read is ignored.
+///
+/// replication.rs sends entries to the HA peer in the same encoding.
+///
+use std::ffi::{CString, OsString};
+use std::fs;
+use std::io::{self, ErrorKind};
+use std::net::{IpAddr, Ipv4Addr, Ipv6Addr};
+use std::path::Path;
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+use chrono::DateTime;
+use lazy_static::lazy_static;
+use mac_address::MacAddress;
+use tokio::task::JoinHandle;
+
+use crate::cache::{self, CacheEntry, CacheEntryStatus, CacheKey};
+use crate::discovery::Discovery;
+use crate::machine::{Machine, MachineRecord};
+use crate::{CONFIG, CarbideDhcpContext};
+
+/// How often to write the snapshot, unless `carbide-cache-snapshot-interval-secs` says otherwise
+pub const DEFAULT_SNAPSHOT_INTERVAL: Duration = Duration::from_secs(60);
+
+const MAGIC: &[u8; 8] = b"CDHCPSN2";
+
+const STATUS_VALID: u8 = 0;
+const STATUS_FAILING: u8 = 1;
+const STATUS_FAILED: u8 = 2;
+
+lazy_static! {
+    /// The task writing the snapshot every interval
+    static ref WRITER: Mutex<Option<JoinHandle<()>>> = Mutex::new(None);
+    /// Held while writing, so the last write at unload can't race a periodic one
+    static ref WRITING: Mutex<()> = Mutex::new(());
+}
+
+/// Restore the cache from the snapshot and start writing it every interval
+///
+/// Called when the hook is loaded, once its parameters are in. Does nothing without a
+/// `carbide-cache-snapshot-path`. Returns the machines in the snapshot which have expired since,
+/// for prewarm.rs.
+pub fn start() -> Vec<(CacheKey, Arc<Machine>)> {
+    let (path, interval) = {
+        let config = CONFIG.load();
+        (
+            config.cache_snapshot_path.clone(),
+            config.cache_snapshot_interval,
+        )
+    };
+    let Some(path) = path else {
+        return Vec::new();
+    };
+
+    let expired = match load(&path) {
+        Ok(loaded) => {
+            log::info!(
+                "restored {} cache entries from snapshot {}, {} machines had expired",
+                loaded.restored,
+                path.display(),
+                loaded.expired.len()
+            );
+            loaded.expired
+        }
+        Err(err) if err.kind() == ErrorKind::NotFound => {
+            log::info!("no cache snapshot at {}, starting cold", path.display());
+            Vec::new()
+        }
+        Err(err) => {
+            log::warn!(
+                "ignoring cache snapshot {}, starting cold: {err}",
+                path.display()
+            );
+            Vec::new()
+        }
+    };
+
+    if interval.is_zero() {
+        return expired;
+    }
+    let writer = CarbideDhcpContext::get_tokio_runtime().spawn(async move {
+        let mut ticker = tokio::time::interval(interval);
+        // The first tick is immediate, and we've only just loaded
+        ticker.tick().await;
+        loop {
+            ticker.tick().await;
+            let path = path.clone();
+            match tokio::task::spawn_blocking(move || save(&path)).await {
+                Ok(Ok(_)) => {}
+                Ok(Err(err)) => log::error!("unable to write cache snapshot: {err}"),
+                Err(err) => log::error!("cache snapshot task failed: {err}"),
+            }
+        }
+    });
+    if let Some(previous) = WRITER.lock().unwrap().replace(writer) {
+        previous.abort();
+    }
+    expired
+}
+
+/// Stop writing the snapshot every interval, and write it one last time
+///
+/// Called when the hook is unloaded.
+pub fn stop() {
+    if let Some(writer) = WRITER.lock().unwrap().take() {
+        writer.abort();
+    }
+    let Some(path) = CONFIG.load().cache_snapshot_path.clone() else {
+        return;
+    };
+    match save(&path) {
+        Ok(saved) => log::info!("wrote {saved} cache entries to snapshot {}", path.display()),
+        Err(err) => log::error!("unable to write cache snapshot {}: {err}", path.display()),
+    }
+}
+
+/// Write every live cache entry to `path`. Returns how many were written.
+pub(crate) fn save(path: &Path) -> io::Result<usize> {
+    let entries = cache::entries();
+    let mut out = Vec::with_capacity(MAGIC.len() + 12 + entries.len() * 256);
+    out.extend_from_slice(MAGIC);
+    put_u64(&mut out, unix_millis(SystemTime::now()));
+    put_u32(&mut out, entries.len() as u32);
+    for (key, entry) in &entries {
+        put_entry(&mut out, key, entry);
+    }
+
+    let mut temp = OsString::from(path.as_os_str());
+    temp.push(".tmp");
+    let _writing = WRITING.lock().unwrap();
+    fs::write(&temp, &out)?;
+    fs::rename(&temp, path)?;
+    Ok(entries.len())
+}
+
+/// What `load` did with a snapshot
+#[derive(Debug)]
+pub(crate) struct Loaded {
+    /// Entries put back in the cache
+    pub restored: usize,
+    /// Machines left out, because they expired or the cache had them already
+    pub expired: Vec<(CacheKey, Arc<Machine>)>,
+}
+
+/// Put the entries in the snapshot at `path` which are still live back in the cache
+pub(crate) fn load(path: &Path) -> io::Result<Loaded> {
+    let data = fs::read(path)?;
+    let mut reader = Reader(&data);
+    if reader.bytes(MAGIC.len())? != MAGIC {
+        return Err(invalid("not a cache snapshot, or from another version"));
+    }
+    let written_at = reader.u64()?;
+    let count = reader.u32()?;
+
+    // Entries kept ageing while nobody was running
+    let downtime = Duration::from_millis(unix_millis(SystemTime::now()).saturating_sub(written_at));
+    // Read them all first so a bad file doesn't leave half of it in the cache
+    let entries = (0..count)
+        .map(|_| reader.entry())
+        .collect::<io::Result<Vec<_>>>()?;
+
+    let now = Instant::now();
+    let mut loaded = Loaded {
+        restored: 0,
+        expired: Vec::new(),
+    };
+    for (key, age, status) in entries {
+        let machine = match &status {
+            CacheEntryStatus::ValidEntry(machine) => Some(machine.clone()),
+            _ => None,
+        };
+        let restored = now.checked_sub(age + downtime).is_some_and(|timestamp| {
+            cache::restore(
+                key,
+                CacheEntry {
+                    timestamp,
+                    status,
+                    refresh_failed: None,
+                },
+            )
+        });
+        if restored {
+            loaded.restored += 1;
+        } else if let Some(machine) = machine {
+            loaded.expired.push((key, machine));
+        }
+    }
+    Ok(loaded)
+}
+
+pub(crate) fn unix_millis(time: SystemTime) -> u64 {
+    time.duration_since(UNIX_EPOCH)
+        .map_or(0, |since| since.as_millis() as u64)
+}
+
+pub(crate) fn invalid(message: &str) -> io::Error {
+    io::Error::new(ErrorKind::InvalidData, message)
+}
+
+//
+// Writing
+//
+
+fn put_u16(out: &mut Vec<u8>, value: u16) {
+    out.extend_from_slice(&value.to_le_bytes());
+}
+
+fn put_u32(out: &mut Vec<u8>, value: u32) {
+    out.extend_from_slice(&value.to_le_bytes());
+}
+
+pub(crate) fn put_u64(out: &mut Vec<u8>, value: u64) {
+    out.extend_from_slice(&value.to_le_bytes());
+}
+
+fn put_str(out: &mut Vec<u8>, value: &str) {
+    put_bytes(out, value.as_bytes());
+}
+
+fn put_bytes(out: &mut Vec<u8>, value: &[u8]) {
+    put_u32(out, value.len() as u32);
+    out.extend_from_slice(value);
+}
+
+// Presence flag, then the value if present
+pub(crate) fn put_opt<T>(out: &mut Vec<u8>, value: &Option<T>, put: impl FnOnce(&mut Vec<u8>, &T)) {
+    match value {
+        Some(value) => {
+            out.push(1);
+            put(out, value);
+        }
+        None => out.push(0),
+    }
+}
+
+pub(crate) fn put_ip(out: &mut Vec<u8>, addr: &IpAddr) {
+    match addr {
+        IpAddr::V4(v4) => {
+            out.push(4);
+            out.extend_from_slice(&v4.octets());
+        }
+        IpAddr::V6(v6) => {
+            out.push(6);
+            out.extend_from_slice(&v6.octets());
+        }
+    }
+}
+
+pub(crate) fn put_entry(out: &mut Vec<u8>, key: &CacheKey, entry: &CacheEntry) {
+    out.extend_from_slice(&key.mac_address);
+    put_ip(out, &key.link_address);
+    put_u64(out, key.circuit_id);
+    put_u64(out, key.remote_id);
+    put_u64(out, key.vendor_id);
+    put_u64(out, entry.timestamp.elapsed().as_millis() as u64);
+
+    match &entry.status {
+        CacheEntryStatus::ValidEntry(machine) => {
+            out.push(STATUS_VALID);
+            put_discovery(out, &machine.discovery_info);
+            put_record(out, &machine.record);
+        }
+        CacheEntryStatus::DiscoveryFailing(count) => {
+            out.push(STATUS_FAILING);
+            put_u32(out, *count);
+        }
+        CacheEntryStatus::DiscoveryFailed => out.push(STATUS_FAILED),
+    }
+}
+
+fn put_discovery(out: &mut Vec<u8>, discovery: &Discovery) {
+    out.extend_from_slice(&discovery.relay_address.octets());
+    out.extend_from_slice(&discovery.mac_address.bytes());
+    put_opt(out, &discovery._client_system, |out, v| put_u16(out, *v));
+    put_opt(out, &discovery.vendor_class, |out, v| put_str(out, v));
+    put_opt(out, &discovery.link_select_address, |out, v| {
+        out.extend_from_slice(&v.octets())
+    });
+    put_opt(out, &discovery.circuit_id, |out, v| put_str(out, v));
+    put_opt(out, &discovery.remote_id, |out, v| put_str(out, v));
+    put_opt(out, &discovery.desired_address, |out, v| put_str(out, v));
+}
+
+fn put_record(out: &mut Vec<u8>, record: &MachineRecord) {
+    put_u32(out, record.interface_address);
+    put_u32(out, record.router);
+    put_u32(out, record.subnet_mask);
+    put_u32(out, record.broadcast_address);
+    put_u16(out, record.mtu);
+    put_bytes(out, record.hostname.to_bytes());
+    put_opt(out, &record.booturl, |out, v| put_str(out, v));
+    put_bytes(out, record.uuid.to_bytes());
+    put_opt(out, &record.last_invalidation, |out, v| {
+        put_u64(out, v.timestamp_millis() as u64)
+    });
+}
+
+//
+// Reading
+//
+
+pub(crate) struct Reader<'a>(pub(crate) &'a [u8]);
+
+impl<'a> Reader<'a> {
+    pub(crate) fn bytes(&mut self, len: usize) -> io::Result<&'a [u8]> {
+        if self.0.len() < len {
+            return Err(invalid("cache snapshot is truncated"));
+        }
+        let (bytes, rest) = self.0.split_at(len);
+        self.0 = rest;
+        Ok(bytes)
+    }
+
+    pub(crate) fn array<const N: usize>(&mut self) -> io::Result<[u8; N]> {
+        Ok(self.bytes(N)?.try_into().unwrap())
+    }
+
+    pub(crate) fn u8(&mut self) -> io::Result<u8> {
+        Ok(self.array::<1>()?[0])
+    }
+
+    fn u16(&mut self) -> io::Result<u16> {
+        Ok(u16::from_le_bytes(self.array()?))
+    }
+
+    fn u32(&mut self) -> io::Result<u32> {
+        Ok(u32::from_le_bytes(self.array()?))
+    }
+
+    pub(crate) fn u64(&mut self) -> io::Result<u64> {
+        Ok(u64::from_le_bytes(self.array()?))
+    }
+
+    fn c_string(&mut self) -> io::Result<CString> {
+        let len = self.u32()? as usize;
+        CString::new(self.bytes(len)?)
+            .map_err(|_| invalid("cache snapshot has a string with a NUL byte"))
+    }
+
+    fn string(&mut self) -> io::Result<String> {
+        let len = self.u32()? as usize;
+        String::from_utf8(self.bytes(len)?.to_vec())
+            .map_err(|_| invalid("cache snapshot has a string which is not UTF-8"))
+    }
+
+    pub(crate) fn opt<T>(
+        &mut self,
+        read: impl FnOnce(&mut Self) -> io::Result<T>,
+    ) -> io::Result<Option<T>> {
+        match self.u8()? {
+            0 => Ok(None),
+            1 => read(self).map(Some),
+            _ => Err(invalid("cache snapshot has a bad presence flag")),
+        }
+    }
+
+    pub(crate) fn ip(&mut self) -> io::Result<IpAddr> {
+        match self.u8()? {
+            4 => Ok(IpAddr::V4(Ipv4Addr::from(self.array::<4>()?))),
+            6 => Ok(IpAddr::V6(Ipv6Addr::from(self.array::<16>()?))),
+            _ => Err(invalid("cache snapshot has a bad address family")),
+        }
+    }
+
+    pub(crate) fn entry(&mut self) -> io::Result<(CacheKey, Duration, CacheEntryStatus)> {
+        let key = CacheKey {
+            mac_address: self.array()?,
+            link_address: self.ip()?,
+            circuit_id: self.u64()?,
+            remote_id: self.u64()?,
+            vendor_id: self.u64()?,
+        };
+        let age = Duration::from_millis(self.u64()?);
+
+        let status = match self.u8()? {
+            STATUS_VALID => {
+                let discovery = self.discovery()?;
+                let record = self.record()?;
+                // Parsed again rather than stored, it's cheap and can't get out of step
+                let vendor_class = discovery
+                    .vendor_class
+                    .as_deref()
+                    .and_then(|vendor_class| vendor_class.parse().ok());
+                CacheEntryStatus::ValidEntry(Arc::new(Machine::from_record(
+                    Arc::new(record),
+                    discovery,
+                    vendor_class,
+                )))
+            }
+            STATUS_FAILING => CacheEntryStatus::DiscoveryFailing(self.u32()?),
+            STATUS_FAILED => CacheEntryStatus::DiscoveryFailed,
+            _ => return Err(invalid("cache snapshot has a bad entry status")),
+        };
+        Ok((key, age, status))
+    }
+
+    fn record(&mut self) -> io::Result<MachineRecord> {
+        Ok(MachineRecord {
+            interface_address: self.u32()?,
+            router: self.u32()?,
+            subnet_mask: self.u32()?,
+            broadcast_address: self.u32()?,
+            mtu: self.u16()?,
+            hostname: self.c_string()?,
+            booturl: self.opt(|r| r.string().map(Box::from))?,
+            uuid: self.c_string()?,
+            last_invalidation: self.opt(|r| {
+                DateTime::from_timestamp_millis(r.u64()? as i64)
+                    .ok_or_else(|| invalid("cache snapshot has a bad timestamp"))
+            })?,
+        })
+    }
+
+    fn discovery(&mut self) -> io::Result<Discovery> {
+        Ok(Discovery {
+            relay_address: Ipv4Addr::from(self.array::<4>()?),
+            mac_address: MacAddress::new(self.array()?),
+            _client_system: self.opt(Self::u16)?,
+            vendor_class: self.opt(Self::string)?,
+            link_select_address: self.opt(|r| Ok(Ipv4Addr::from(r.array::<4>()?)))?,
+            circuit_id: self.opt(Self::string)?,
+            remote_id: self.opt(Self::string)?,
+            desired_address: self.opt(Self::string)?,
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::mock_api_server;
+
+    fn key(last_mac: u8) -> CacheKey {
+        CacheKey::new(
+            MacAddress::new([2, 66, 172, 20, 18, last_mac]),
+            IpAddr::V4(Ipv4Addr::new(172, 20, 18, 0)),
+            &Some("Ethernet12".to_string()),
+            &None,
+            "PXEClient",
+        )
+        .unwrap()
+    }
+
+    // What's written is what's read back, timestamps included
+    #[test]
+    fn test_snapshot_round_trip() {
+        let mac_address = MacAddress::new([2, 66, 172, 20, 18, 1]);
+        let discovery = Discovery {
+            relay_address: Ipv4Addr::new(172, 20, 18, 254),
+            mac_address,
+            _client_system: Some(7),
+            vendor_class: Some("PXEClient:Arch:00007:UNDI:003000".to_string()),
+            link_select_address: Some(Ipv4Addr::new(172, 20, 18, 0)),
+            circuit_id: Some("Ethernet12".to_string()),
+            remote_id: None,
+            desired_address: Some("172.20.18.1".to_string()),
+        };
+        let record = mock_api_server::dhcp_record(&mac_address.to_string());
+        let vendor_class = discovery.vendor_class.as_deref().unwrap().parse().ok();
+        let machine = Arc::new(Machine::new(record.clone(), discovery, vendor_class));
+
+        let entries = [
+            (key(1), CacheEntryStatus::ValidEntry(machine)),
+            (key(2), CacheEntryStatus::DiscoveryFailing(3)),
+            (key(3), CacheEntryStatus::DiscoveryFailed),
+        ];
+        let timestamp = Instant::now() - Duration::from_secs(10);
+        let mut out = Vec::new();
+        for (key, status) in &entries {
+            let entry = CacheEntry {
+                timestamp,
+                status: status.clone(),
+                refresh_failed: None,
+            };
+            put_entry(&mut out, key, &entry);
+        }
+
+        let mut reader = Reader(&out);
+        for (key, status) in entries {
+            let (read_key, age, read_status) = reader.entry().unwrap();
+            assert_eq!(read_key, key);
+            assert!(age >= Duration::from_secs(10) && age < Duration::from_secs(20));
+            match (status, read_status) {
+                (CacheEntryStatus::ValidEntry(_), CacheEntryStatus::ValidEntry(read)) => {
+                    assert_eq!(*read.record, MachineRecord::new(&record));
+                    assert!(mock_api_server::matches_mock_response(&read));
+                    assert_eq!(
+                        read.discovery_info.circuit_id.as_deref(),
+                        Some("Ethernet12")
+                    );
+                    assert_eq!(read.discovery_info.remote_id, None);
+                    assert_eq!(read.discovery_info._client_system, Some(7));
+                    assert!(read.vendor_class.is_some());
+                }
+                (
+                    CacheEntryStatus::DiscoveryFailing(count),
+                    CacheEntryStatus::DiscoveryFailing(read),
+                ) => assert_eq!(count, read),
+                (CacheEntryStatus::DiscoveryFailed, CacheEntryStatus::DiscoveryFailed) => {}
+                (status, read) => panic!("wrote {status:?}, read {read:?}"),
+            }
+        }
+        assert!(reader.0.is_empty());
+    }
+
+    #[test]
+    fn test_snapshot_rejects_bad_files() {
+        let temp = tempfile::tempdir().unwrap();
+        let dir = temp.path();
+
+        let not_ours = dir.join("not-ours");
+        fs::write(&not_ours, b"something else entirely").unwrap();
+        assert_eq!(load(&not_ours).unwrap_err().kind(), ErrorKind::InvalidData);
+
+        // Header promises an entry which isn't there
+        let truncated = dir.join("truncated");
+        let mut out = MAGIC.to_vec();
+        put_u64(&mut out, unix_millis(SystemTime::now()));
+        put_u32(&mut out, 1);
+        fs::write(&truncated, &out).unwrap();
+        assert_eq!(load(&truncated).unwrap_err().kind(), ErrorKind::InvalidData);
+
+        assert_eq!(
+            load(&dir.join("missing")).unwrap_err().kind(),
+            ErrorKind::NotFound
+        );
+    }
+}
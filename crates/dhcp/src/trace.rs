@@ -0,0 +1,281 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2026 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/// OpenTelemetry traces of single DHCP exchanges
+///
+/// With `carbide-trace-otlp-endpoint` set, one packet in `carbide-trace-sample-one-in` gets a
+/// span from pkt4_receive (`carbide_trace_start`) to pkt4_send (`carbide_trace_sent`), keyed by
+/// its xid and MAC address. The stages timed by `StageTimer` (cache lookup, connecting to
+/// carbide-api and the DiscoverDhcp call) are its children, and the trace context goes to
+/// carbide-api in the request metadata, so a slow exchange can be followed into the API.
+///
+/// Discoveries sent in a DiscoverDhcpBatch (batch.rs) don't carry the context, the batch is
+/// shared between packets. One the collector sends on its own still does.
+///
+/// A packet which isn't sampled costs one atomic increment, and the stage timers one
+/// thread-local lookup.
+///
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+
+use once_cell::sync::OnceCell;
+use opentelemetry::propagation::{Injector, TextMapPropagator};
+use opentelemetry::trace::{SpanKind, Status, TraceContextExt, Tracer, TracerProvider};
+use opentelemetry::{Context, KeyValue};
+use opentelemetry_otlp::WithExportConfig;
+use opentelemetry_sdk::Resource;
+use opentelemetry_sdk::propagation::TraceContextPropagator;
+use opentelemetry_sdk::trace::{SdkTracer, SdkTracerProvider};
+use tonic::metadata::{MetadataKey, MetadataMap};
+
+use crate::discovery::ByteView;
+use crate::{CONFIG, CarbideDhcpContext};
+
+/// Set by `start` when tracing is on
+static TRACING: OnceCell<Tracing> = OnceCell::new();
+
+struct Tracing {
+    provider: SdkTracerProvider,
+    tracer: SdkTracer,
+    sample_one_in: u64,
+    packets: AtomicU64,
+}
+
+/// Start exporting traces, if `carbide-trace-otlp-endpoint` is set
+///
+/// Called when the hook is loaded, once its parameters are in.
+pub fn start() {
+    let (endpoint, sample_one_in) = {
+        let config = CONFIG.load();
+        (
+            config.trace_otlp_endpoint.clone(),
+            config.trace_sample_one_in,
+        )
+    };
+    let Some(endpoint) = endpoint else {
+        return;
+    };
+    if sample_one_in == 0 {
+        return;
+    }
+
+    // The exporter's gRPC client needs our runtime
+    let _runtime = CarbideDhcpContext::get_tokio_runtime().enter();
+    let exporter = match opentelemetry_otlp::SpanExporter::builder()
+        .with_tonic()
+        .with_endpoint(endpoint.clone())
+        .build()
+    {
+        Ok(exporter) => exporter,
+        Err(err) => {
+            log::error!("unable to export traces to {endpoint}: {err}");
+            return;
+        }
+    };
+    let provider = SdkTracerProvider::builder()
+        .with_batch_exporter(exporter)
+        .with_resource(
+            Resource::builder()
+                .with_attributes([KeyValue::new("service.name", "carbide-dhcp")])
+                .build(),
+        )
+        .build();
+    let tracer = provider.tracer("carbide-dhcp");
+    let tracing = Tracing {
+        provider,
+        tracer,
+        sample_one_in: sample_one_in.into(),
+        packets: AtomicU64::new(0),
+    };
+    if TRACING.set(tracing).is_ok() {
+        log::info!("tracing 1 in {sample_one_in} packets to {endpoint}");
+    }
+}
+
+/// Send the spans which are still buffered. Called when the hook is unloaded.
+pub fn stop() {
+    if let Some(tracing) = TRACING.get()
+        && let Err(err) = tracing.provider.force_flush()
+    {
+        log::warn!("unable to flush traces: {err}");
+    }
+}
+
+/// The span of one packet, from `carbide_trace_start`
+pub struct PacketTrace {
+    context: Context,
+    sent: AtomicBool,
+}
+
+impl PacketTrace {
+    /// The context to run the packet's discovery in
+    pub(crate) fn context(&self) -> &Context {
+        &self.context
+    }
+}
+
+/// # Safety
+///
+/// `trace` must be null or a valid `PacketTrace`.
+pub(crate) unsafe fn packet_context(trace: *const PacketTrace) -> Option<Context> {
+    unsafe { trace.as_ref() }.map(|trace| trace.context().clone())
+}
+
+/// A span for a stage of handling a sampled packet, as the current context
+///
+/// None, without doing any more work, when the current context isn't a sampled packet's.
+pub(crate) fn stage(name: &'static str) -> Option<Context> {
+    let tracing = TRACING.get()?;
+    let parent = Context::current();
+    if !parent.span().span_context().is_sampled() {
+        return None;
+    }
+    let span = tracing.tracer.start_with_context(name, &parent);
+    Some(parent.with_span(span))
+}
+
+/// Add the current trace context to the metadata of a request to carbide-api
+pub(crate) fn inject(metadata: &mut MetadataMap) {
+    let context = Context::current();
+    if context.span().span_context().is_sampled() {
+        TraceContextPropagator::new().inject_context(&context, &mut MetadataInjector(metadata));
+    }
+}
+
+struct MetadataInjector<'a>(&'a mut MetadataMap);
+
+impl Injector for MetadataInjector<'_> {
+    fn set(&mut self, key: &str, value: String) {
+        if let (Ok(key), Ok(value)) = (MetadataKey::from_bytes(key.as_bytes()), value.parse()) {
+            self.0.insert(key, value);
+        }
+    }
+}
+
+/// Start the span of a packet, if it is sampled
+///
+/// Returns null if it isn't. Otherwise the span lasts until `carbide_trace_sent`, or
+/// `carbide_trace_free` if the packet was dropped.
+///
+/// # Safety
+///
+/// `mac_address` must be a valid view.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn carbide_trace_start(
+    xid: u32,
+    mac_address: ByteView,
+    relay_address: u32,
+) -> *mut PacketTrace {
+    let Some(tracing) = TRACING.get() else {
+        return std::ptr::null_mut();
+    };
+    if tracing.packets.fetch_add(1, Ordering::Relaxed) % tracing.sample_one_in != 0 {
+        return std::ptr::null_mut();
+    }
+
+    let mac_address = unsafe { mac_address.as_bytes() }
+        .unwrap_or_default()
+        .iter()
+        .map(|byte| format!("{byte:02x}"))
+        .collect::<Vec<_>>()
+        .join(":");
+    let span = tracing
+        .tracer
+        .span_builder("dhcp4_exchange")
+        .with_kind(SpanKind::Server)
+        .with_attributes([
+            KeyValue::new("dhcp.xid", format!("{xid:08x}")),
+            KeyValue::new("dhcp.mac_address", mac_address),
+            KeyValue::new(
+                "dhcp.relay_address",
+                std::net::Ipv4Addr::from(relay_address).to_string(),
+            ),
+        ])
+        .start(&tracing.tracer);
+    Box::into_raw(Box::new(PacketTrace {
+        context: Context::new().with_span(span),
+        sent: AtomicBool::new(false),
+    }))
+}
+
+/// End the span of a packet which is being answered
+///
+/// # Safety
+///
+/// `trace` must be a valid handle from `carbide_trace_start`.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn carbide_trace_sent(trace: *const PacketTrace) {
+    let trace = unsafe { &*trace };
+    if !trace.sent.swap(true, Ordering::Relaxed) {
+        trace.context.span().end();
+    }
+}
+
+/// Release a handle from `carbide_trace_start`
+///
+/// The span of a packet which wasn't sent ends here, as an error.
+///
+/// # Safety
+///
+/// `trace` must be a valid handle from `carbide_trace_start`, and must not be used afterwards.
+#[unsafe(no_mangle)]
+pub unsafe extern "C" fn carbide_trace_free(trace: *mut PacketTrace) {
+    let trace = unsafe { Box::from_raw(trace) };
+    if !trace.sent.load(Ordering::Relaxed) {
+        let span = trace.context.span();
+        span.set_status(Status::error("dropped"));
+        span.end();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use opentelemetry::trace::{SpanContext, SpanId, TraceFlags, TraceId, TraceState};
+
+    use super::*;
+
+    // A sampled context goes to carbide-api as a W3C traceparent, anything else doesn't
+    #[test]
+    fn test_trace_inject() {
+        let span_context = |flags| {
+            SpanContext::new(
+                TraceId::from_hex("4bf92f3577b34da6a3ce929d0e0e4736").unwrap(),
+                SpanId::from_hex("00f067aa0ba902b7").unwrap(),
+                flags,
+                true,
+                TraceState::default(),
+            )
+        };
+        let injected = |context: Context| {
+            let _context = context.attach();
+            let mut metadata = MetadataMap::new();
+            inject(&mut metadata);
+            metadata
+        };
+
+        let metadata =
+            injected(Context::new().with_remote_span_context(span_context(TraceFlags::SAMPLED)));
+        assert_eq!(
+            metadata.get("traceparent").unwrap().to_str().unwrap(),
+            "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01"
+        );
+
+        let metadata =
+            injected(Context::new().with_remote_span_context(span_context(TraceFlags::default())));
+        assert!(metadata.is_empty());
+        assert!(injected(Context::new()).is_empty());
+    }
+}
@@ -36,17 +36,26 @@ impl DHCPFactory {
     // The idx is used as the last byte of the MAC and Link addresses to make them unique.
     pub fn discover(idx: u8) -> Message {
         // 0x02 prefix is a 'locally administered address'
-        let mac = vec![0x02, 0x00, 0x00, 0x00, 0x00, idx];
+        let mac = [0x02, 0x00, 0x00, 0x00, 0x00, idx];
 
         // Five colon separated fields. Our parser (vendor_class.rs) only uses fields 0 and 2.
         // 7 is MachineArchitecture::EfiX64, HTTP version
-        let uefi_vendor_class = b"HTTPClient::7::".to_vec();
+        let uefi_vendor_class = b"HTTPClient::7::";
 
         let mut relay_agent = relay::RelayAgentInformation::default();
         relay_agent.insert(RelayInfo::AgentCircuitId(b"eth0".to_vec()));
         let link_address = [172, 16, 42, idx];
         relay_agent.insert(RelayInfo::LinkSelection(link_address.into()));
 
+        DHCPFactory::relayed_discover(mac, uefi_vendor_class, relay_agent)
+    }
+
+    // Make a DHCP_DISCOVER packet as our relay would forward it
+    pub fn relayed_discover(
+        mac: [u8; 6],
+        vendor_class: &[u8],
+        relay_agent: relay::RelayAgentInformation,
+    ) -> Message {
         let gateway_ip = RELAY_IP.parse::<Ipv4Addr>().unwrap();
 
         let mut msg = v4::Message::default();
@@ -56,11 +65,26 @@ impl DHCPFactory {
             .set_hops(1) // a real relayed packet would have this. not necessary for the test.
             .opts_mut();
         use v4::DhcpOption::*;
-        opts.insert(ClassIdentifier(uefi_vendor_class)); // 60
+        opts.insert(ClassIdentifier(vendor_class.to_vec())); // 60
         opts.insert(RelayAgentInformation(relay_agent)); // 82
         opts.insert(ClientSystemArchitecture(v4::Architecture::Intelx86PC)); // 93
         opts.insert(MessageType(v4::MessageType::Discover));
 
         msg
     }
+
+    // Make the DHCP_REQUEST a client sends after `discover` got it `offer`
+    pub fn request(discover: &Message, offer: &Message) -> Message {
+        let mut msg = discover.clone();
+        msg.set_xid(offer.xid());
+        let opts = msg.opts_mut();
+        use v4::DhcpOption::*;
+        opts.insert(MessageType(v4::MessageType::Request));
+        opts.insert(RequestedIpAddress(offer.yiaddr())); // 50
+        if let Some(server_id) = offer.opts().get(v4::OptionCode::ServerIdentifier) {
+            opts.insert(server_id.clone()); // 54
+        }
+
+        msg
+    }
 }
@@ -24,6 +24,9 @@ use std::time::Duration;
 use serde_json::json;
 use tempfile::TempDir;
 
+// Kea recommendation for the memfile backend
+const DEFAULT_THREAD_POOL_SIZE: u16 = 4;
+
 pub struct Kea {
     temp_conf_file: PathBuf,
 
@@ -43,13 +46,47 @@ impl Kea {
         api_server_url: &str,
         dhcp_in_port: u16,
         dhcp_out_port: u16,
+    ) -> Result<Kea, eyre::Report> {
+        Kea::with_thread_pool_size(
+            api_server_url,
+            dhcp_in_port,
+            dhcp_out_port,
+            DEFAULT_THREAD_POOL_SIZE,
+        )
+    }
+
+    // As `new`, but with `thread_pool_size` Kea packet processing threads
+    pub fn with_thread_pool_size(
+        api_server_url: &str,
+        dhcp_in_port: u16,
+        dhcp_out_port: u16,
+        thread_pool_size: u16,
+    ) -> Result<Kea, eyre::Report> {
+        Kea::with_hook_parameters(
+            api_server_url,
+            dhcp_in_port,
+            dhcp_out_port,
+            thread_pool_size,
+            json!({}),
+        )
+    }
+
+    // As `with_thread_pool_size`, with `hook_parameters` added to (or replacing) the hook library
+    // parameters. Must be a JSON object.
+    pub fn with_hook_parameters(
+        api_server_url: &str,
+        dhcp_in_port: u16,
+        dhcp_out_port: u16,
+        thread_pool_size: u16,
+        hook_parameters: serde_json::Value,
     ) -> Result<Kea, eyre::Report> {
         let temp_base_directory = tempfile::tempdir()?;
 
         let temp_conf_file = temp_base_directory.path().join("kea-dhcp4.conf");
 
         let mut temp_conf_fd = File::create(&temp_conf_file)?;
-        temp_conf_fd.write_all(Kea::config(api_server_url).as_bytes())?;
+        temp_conf_fd
+            .write_all(Kea::config(api_server_url, thread_pool_size, hook_parameters).as_bytes())?;
 
         // Close the file so it's updated for Kea.
         drop(temp_conf_fd);
@@ -96,7 +133,11 @@ impl Kea {
         Ok(())
     }
 
-    fn config(api_server_url: &str) -> String {
+    fn config(
+        api_server_url: &str,
+        thread_pool_size: u16,
+        hook_parameters: serde_json::Value,
+    ) -> String {
         let hook_lib_d = format!(
             "{}/../../target/debug/libdhcp.so",
             env!("CARGO_MANIFEST_DIR")
@@ -117,6 +158,19 @@ impl Kea {
             hook_lib_d
         };
 
+        let mut parameters = json!({
+            "carbide-api-url": api_server_url,
+            "carbide-metrics-endpoint": "[::]:1089",
+            "carbide-nameservers": "1.1.1.1,8.8.8.8",
+            "carbide-provisioning-server-ipv4": "127.0.0.1",
+            "carbide-runtime-worker-threads": 4
+        });
+        if let (Some(parameters), Some(extra)) =
+            (parameters.as_object_mut(), hook_parameters.as_object())
+        {
+            parameters.extend(extra.clone());
+        }
+
         let conf = json!({
         "Dhcp4": {
             "interfaces-config": {
@@ -130,7 +184,7 @@ impl Kea {
             },
             "multi-threading": {
                 "enable-multi-threading": true,
-                "thread-pool-size": 4,
+                "thread-pool-size": thread_pool_size,
                 "packet-queue-size": 28,
                 "user-context": {
                     "comment": "Values above are Kea recommendations for memfile backend",
@@ -143,12 +197,7 @@ impl Kea {
             "hooks-libraries": [
                 {
                         "library": hook_lib,
-                        "parameters": {
-                            "carbide-api-url": api_server_url,
-                        "carbide-metrics-endpoint": "[::]:1089",
-                            "carbide-nameservers": "1.1.1.1,8.8.8.8",
-                            "carbide-provisioning-server-ipv4": "127.0.0.1"
-                        }
+                        "parameters": parameters
                 }
             ],
             "subnet4": [
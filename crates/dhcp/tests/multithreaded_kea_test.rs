@@ -21,7 +21,7 @@ use std::sync::Arc;
 use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
 use std::sync::mpsc::channel;
 use std::thread;
-use std::time::Duration;
+use std::time::{Duration, Instant};
 
 use dhcp::mock_api_server;
 use dhcproto::{Decodable, Decoder, v4};
@@ -38,6 +38,10 @@ const NUM_EXPECTED: u64 = NUM_THREADS as u64 * NUM_MSGS_PER_THREAD as u64;
 
 const READ_TIMEOUT: Duration = Duration::from_millis(500);
 
+// Kea packet processing thread counts to run the test at. Throughput is printed for each,
+// run with `--nocapture` to see it.
+const KEA_THREAD_POOL_SIZES: [u16; 3] = [4, 8, 16];
+
 // Start a real Kea process, configured to be multi threaded, and send it some DISCOVERY messages from multiple threads.
 // We pretend to be the relay because our hooks only accepted relayed packets.
 //
@@ -50,13 +54,38 @@ fn test_real_kea_multithreaded() -> Result<(), eyre::Report> {
         .enable_all()
         .build()
         .unwrap();
-    let api_server = rt.block_on(mock_api_server::MockAPIServer::start());
 
-    let dhcp_in_port = 7000;
-    let dhcp_out_port = 7001;
+    for (i, thread_pool_size) in KEA_THREAD_POOL_SIZES.into_iter().enumerate() {
+        // Fresh API server per run so the call count and the hooks' cache start empty
+        let api_server = rt.block_on(mock_api_server::MockAPIServer::start());
+        let dhcp_in_port = 7000 + (i as u16 * 2);
+        let dhcp_out_port = dhcp_in_port + 1;
+
+        let start = Instant::now();
+        run_kea_multithreaded(&api_server, thread_pool_size, dhcp_in_port, dhcp_out_port)?;
+        let elapsed = start.elapsed();
+        println!(
+            "thread-pool-size {thread_pool_size}: {NUM_EXPECTED} packets in {elapsed:?}, {:.0} packets/s",
+            NUM_EXPECTED as f64 / elapsed.as_secs_f64()
+        );
+    }
+
+    Ok(())
+}
 
+fn run_kea_multithreaded(
+    api_server: &mock_api_server::MockAPIServer,
+    thread_pool_size: u16,
+    dhcp_in_port: u16,
+    dhcp_out_port: u16,
+) -> Result<(), eyre::Report> {
     // Start Kea process. Stops on drop.
-    let mut kea = Kea::new(api_server.local_http_addr(), dhcp_in_port, dhcp_out_port)?;
+    let mut kea = Kea::with_thread_pool_size(
+        api_server.local_http_addr(),
+        dhcp_in_port,
+        dhcp_out_port,
+        thread_pool_size,
+    )?;
     kea.run()?;
 
     // UDP socket to Kea. We're pretending to be dhcp-relay.
@@ -141,7 +170,7 @@ fn test_real_kea_multithreaded() -> Result<(), eyre::Report> {
     assert_eq!(
         recv_packets.load(Ordering::Relaxed),
         NUM_EXPECTED,
-        "Receive thread returned early because one or more packets were lost."
+        "Receive thread returned early because one or more packets were lost with thread-pool-size {thread_pool_size}."
     );
 
     // Each thread only triggered one backend call because the other messages used the cache.